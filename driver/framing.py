@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+
+# framing.py - Checks that the proxy never lets the bytes of one request or
+# response be read as part of another, now that client connections are kept
+# alive and upstream connections are pooled and shared between clients.
+# Exits with 1 if a check failed.
+#
+#     driver/framing.py
+#
+# The origin is a small server of its own, run in this process: unlike
+# driver/origin it reads chunked request bodies, as a real server would, and
+# it answers each request with what it received.
+
+import socket
+import sys
+import threading
+
+from harness import PROXY, check_binaries, free_port, start_listener, stop
+
+SOCKET_TIMEOUT = 5
+
+
+class Origin:
+    """Keeps its connections alive, and answers each request with its path and the names of its headers"""
+
+    def __init__(self):
+        self.port = free_port()
+        self.listener = socket.create_server(("localhost", self.port))
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            conn, _ = self.listener.accept()
+            threading.Thread(target=self.serve, args=(conn,), daemon=True).start()
+
+    def serve(self, conn):
+        f = conn.makefile("rb")
+        try:
+            while True:
+                line = f.readline()
+                if not line:
+                    return
+                path = line.split()[1].decode()
+                headers = {}
+                while True:
+                    line = f.readline()
+                    if line in (b"\r\n", b"\n", b""):
+                        break
+                    name, _, value = line.decode().partition(":")
+                    headers[name.strip().lower()] = value.strip()
+                # Transfer-Encoding wins over Content-Length, as RFC 9112 says
+                if "chunked" in headers.get("transfer-encoding", ""):
+                    while True:
+                        size = int(f.readline().split(b";")[0], 16)
+                        f.read(size + 2)
+                        if size == 0:
+                            break
+                elif "content-length" in headers:
+                    f.read(int(headers["content-length"]))
+                body = ("%s %s" % (path, ",".join(sorted(headers)))).encode()
+                # /long?N gets a header line of N bytes, longer than the proxy's buffer
+                extra = b"X-Long: %s\r\n" % (b"x" * int(path.split("?")[1])) if path.startswith("/long") else b""
+                conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\nCache-Control: no-store\r\n%s\r\n%s"
+                             % (len(body), extra, body))
+        except (OSError, ValueError, IndexError):
+            pass
+        finally:
+            conn.close()
+
+
+def exchange(port, data):
+    """Sends data to the proxy, returns all it answers until it closes"""
+    s = socket.create_connection(("localhost", port), timeout=SOCKET_TIMEOUT)
+    try:
+        s.sendall(data)
+        out = b""
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                return out
+            out += chunk
+    except OSError:
+        return out
+    finally:
+        s.close()
+
+
+def status(response):
+    """Status code of a response, "none" if there is none"""
+    # The proxy's own errors are an empty line then "code: reason", the origin's a status line
+    if response.startswith(b"\r\n"):
+        return response[2:].split(b":", 1)[0].decode()
+    line = response.split(b"\r\n", 1)[0].split()
+    return line[1].decode() if len(line) > 1 else "none"
+
+
+def body_of(response):
+    return response.split(b"\r\n\r\n", 1)[-1]
+
+
+def main():
+    check_binaries(PROXY)
+    origin = Origin()
+    proxy, proxy_port = start_listener("proxy", [PROXY])
+    url = "http://localhost:%d" % origin.port
+    failed = []
+
+    def get(path, extra=""):
+        return ("GET %s%s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n%s\r\n" % (url, path, extra)).encode()
+
+    def post(path, extra, body):
+        return ("POST %s%s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n%s\r\n" % (url, path, extra)).encode() + body
+
+    def check(what, ok, response):
+        print("%-60s %s" % (what, "OK" if ok else "FAILED"))
+        if not ok:
+            failed.append("%s, got %r" % (what, response[:200]))
+
+    try:
+        # A body the origin ends at the chunked terminator, the rest would be a request on the pooled connection
+        smuggled = b"GET /smuggled HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        body = b"0\r\n\r\n" + smuggled
+        r = exchange(proxy_port, post("/first", "Transfer-Encoding: chunked\r\nContent-Length: %d\r\n" % len(body), body))
+        check("Transfer-Encoding with Content-Length is refused with 400", status(r) == "400", r)
+        for i in range(4):
+            r = exchange(proxy_port, get("/next%d" % i))
+            check("a following request gets its own response (%d)" % i,
+                  status(r) == "200" and body_of(r).startswith(b"/next%d " % i), r)
+
+        r = exchange(proxy_port, post("/te", "Transfer-Encoding: chunked\r\n", b"5\r\nhello\r\n0\r\n\r\n"))
+        check("Transfer-Encoding alone is refused with 501", status(r) == "501", r)
+        r = exchange(proxy_port, post("/cl", "Content-Length: 5x\r\n", b"hello"))
+        check("a Content-Length that isn't a number is refused with 400", status(r) == "400", r)
+        r = exchange(proxy_port, post("/cl", "Content-Length: 5\r\nContent-Length: 5\r\n", b"hello"))
+        check("a repeated Content-Length is refused with 400", status(r) == "400", r)
+
+        # A body is read whatever the method, or its bytes would be the next request on the client connection
+        r = exchange(proxy_port, post("/nolen", "", b"hello"))
+        check("a POST without Content-Length is refused with 411", status(r) == "411", r)
+        r = exchange(proxy_port, post("/empty", "Content-Length: 0\r\n", b""))
+        check("a POST with an empty body is relayed", status(r) == "200" and body_of(r).startswith(b"/empty "), r)
+        pipelined = ("GET %s/second HTTP/1.1\r\nHost: localhost\r\n\r\n" % url).encode()
+        keep = ("GET %s/first HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n"
+                % (url, len(pipelined))).encode()
+        r = exchange(proxy_port, keep + pipelined)
+        check("a GET with a body is refused, its body is not a request", status(r) == "400" and b"/second" not in r, r)
+
+        # Response header lines longer than the proxy's buffer are relayed whole, up to its -H limit
+        r = exchange(proxy_port, get("/long?16384"))
+        check("a 16K response header is relayed", status(r) == "200" and b"X-Long: " + b"x" * 16384 + b"\r\n" in r
+              and body_of(r).startswith(b"/long?16384 "), r)
+        r = exchange(proxy_port, get("/long?131072"))
+        check("a response header over the -H limit is not relayed", b"x" * 131072 not in r, r)
+
+        # Hop-by-hop headers, and those Connection names, stay between the client and the proxy
+        r = exchange(proxy_port, get("/hop", "Connection: close, X-Hop\r\nX-Hop: 1\r\nKeep-Alive: 5\r\n"
+                                             "Upgrade: h2c\r\nTE: trailers\r\nX-End: 1\r\n"))
+        names = body_of(r).split(b" ", 1)[-1].split(b",")
+        check("hop-by-hop request headers are not forwarded",
+              b"x-end" in names and not {b"x-hop", b"keep-alive", b"upgrade", b"te"} & set(names), r)
+    finally:
+        stop(proxy)
+
+    for f in failed:
+        print("FAILED " + f)
+    print("%s" % ("FAILED" if failed else "all framing checks passed"))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
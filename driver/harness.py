@@ -0,0 +1,72 @@
+# harness.py - What the Python drivers share: where the binaries are, and
+# starting the proxy and driver/origin on free ports picked the way
+# driver/free-port.sh picks them.
+
+import os
+import random
+import socket
+import subprocess
+import sys
+import time
+
+TOP = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+PROXY = os.path.join(TOP, "src", "proxy")
+ORIGIN = os.path.join(TOP, "driver", "origin")
+LOADGEN = os.path.join(TOP, "driver", "loadgen")
+
+# As in free-port.sh
+MAX_RAND = 63000
+PORT_START = 1024
+PORT_MAX = 65000
+MAX_PORT_TRIES = 10
+
+
+def check_binaries(*binaries):
+    for binary in binaries:
+        if not os.access(binary, os.X_OK):
+            sys.exit("%s is missing, run make first" % binary)
+
+
+def is_port_in_use(port):
+    s = socket.socket()
+    try:
+        s.bind(("", port))
+        return False
+    except OSError:
+        return True
+    finally:
+        s.close()
+
+
+def free_port():
+    port = random.randrange(MAX_RAND) + PORT_START
+    while is_port_in_use(port):
+        if port == PORT_MAX:
+            sys.exit("No free port")
+        port += 1
+    return port
+
+
+def wait_for_port_use(port, name):
+    for _ in range(MAX_PORT_TRIES):
+        try:
+            socket.create_connection(("localhost", port), timeout=1).close()
+            return
+        except OSError:
+            time.sleep(0.2)
+    sys.exit("Timeout waiting for %s to grab port %d" % (name, port))
+
+
+def start_listener(name, argv):
+    """Runs argv with a free port as its last argument, returns the process and the port once it listens."""
+    port = free_port()
+    proc = subprocess.Popen(argv + [str(port)], stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    wait_for_port_use(port, name)
+    return proc, port
+
+
+def stop(*procs):
+    for proc in procs:
+        proc.kill()
+        proc.wait()
@@ -0,0 +1,512 @@
+/*
+ * loadgen - Drives the proxy, or a server directly, from many concurrent connections and prints the
+ * throughput and latency percentiles as JSON on stdout.
+ *
+ * Closed loop (the default): each connection sends its next request as soon as it has read the previous
+ * response, so the offered load follows the server.
+ *
+ * Open loop (-r RATE): requests are due at a fixed total rate, spread evenly over the connections.  The
+ * latency of a request is measured from when it was due rather than from when it was sent, so a server that
+ * stalls is charged for every request it kept waiting (the coordinated omission correction of wrk2).
+ *
+ * The requests are drawn from a weighted mix of paths on the origin, see usage, or replayed in order from a trace
+ * (-t): an access log of the proxy, or lines of "URI SIZE" as written by src/cachesim. The trace's uris are
+ * requested from the origin given, whatever host they name. The run ends when the trace does.
+ */
+#define _GNU_SOURCE         // strcasestr
+#include <csapp.h>
+#include <hist.h>
+#include <netinet/tcp.h>
+
+#define DEFAULT_MIX "home.html*8,lipsum.txt*4,sus.png*2,cgi-bin/adder?1&2*1"
+#define MAX_MIX 64                  // Entries in a request mix
+#define WORKER_STACK_SIZE (256 * 1024)
+#define DISCARD_SIZE 16384          // Bytes of body read at once
+
+typedef struct {
+  int post;                         // POST the -b body rather than GET
+  char *path;                       // Without the leading slash
+  unsigned weight;
+} mix_entry_t;
+
+/* One connection and what it measured */
+typedef struct {
+  pthread_t tid;
+  int id;
+  int fd;                           // -1 when it has no connection open
+  rio_t rio;
+  unsigned seed;
+  hist_t latency;                   // ns, of the requests due after the warmup
+  uint64_t requests, errors, bytes, connects;
+  uint64_t status[6];               // By class, 0 for a malformed status
+} worker_t;
+
+/* Settings, written by main before any worker starts */
+static char *origin_host, *origin_port;
+static char *proxy_host, *proxy_port;  // NULL to send to the origin directly
+static int nconns = 16;
+static int fresh;                   // A new connection per request
+static double rate;                 // Requests per second over all connections, 0 for a closed loop
+static int timeout_secs = 5;
+static mix_entry_t mix[MAX_MIX];
+static int nmix;
+static unsigned mix_total;          // Sum of the weights
+static mix_entry_t *trace;          // Replayed instead of the mix
+static long trace_len, trace_next;  // trace_next is taken atomically by the workers
+static char *post_body;
+static size_t post_bytes = 1024;
+static long long t_start, t_measure, t_end; // Monotonic ns: workers start, warmup ends, run ends
+
+/* Prototype functions */
+static void usage(const char*);
+static long long now_ns(void);
+static void split_hostport(char*, char**, char**);
+static void parse_mix(char*);
+static void read_trace(const char*);
+static const mix_entry_t *pick(worker_t*);
+static int worker_connect(worker_t*);
+static void worker_close(worker_t*);
+static int read_response(worker_t*, int*, uint64_t*);
+static int request(worker_t*, const mix_entry_t*, int*, uint64_t*);
+static void *worker(void*);
+static void report(worker_t*, double);
+
+static void usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-c CONNS] [-d SECS] [-w WARMUP_SECS] [-r RATE] [-f] [-m MIX | -t TRACE] [-b POST_BYTES]\n"
+          "       [-T TIMEOUT_SECS] [-x PROXY_HOST:PORT] ORIGIN_HOST:PORT\n"
+          "  MIX is a comma-separated list of [POST:]PATH[*WEIGHT], by default\n"
+          "  " DEFAULT_MIX "\n", progname);
+  exit(1);
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void split_hostport(char *s, char **host, char **port) {
+  char *colon = strrchr(s, ':');
+
+  if (!colon || colon == s || !colon[1]) {
+    fprintf(stderr, "%s: expected HOST:PORT\n", s);
+    exit(1);
+  }
+  *colon = '\0';
+  *host = s;
+  *port = colon + 1;
+}
+
+static void parse_mix(char *spec) {
+  char *save, *tok;
+
+  for (tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    mix_entry_t *e = &mix[nmix];
+    char *star = strrchr(tok, '*');
+
+    if (nmix == MAX_MIX) {
+      fprintf(stderr, "more than %d entries in the mix\n", MAX_MIX);
+      exit(1);
+    }
+    e->weight = 1;
+    if (star) {
+      *star = '\0';
+      e->weight = atoi(star + 1);
+    }
+    if ((e->post = strncmp(tok, "POST:", 5) == 0)) {
+      tok += 5;
+    }
+    while (*tok == '/') {
+      tok++;
+    }
+    e->path = tok;
+    if (e->weight) {
+      mix_total += e->weight;
+      nmix++;
+    }
+  }
+  if (mix_total == 0) {
+    fprintf(stderr, "empty request mix\n");
+    exit(1);
+  }
+}
+
+/* Reads the uris of a trace, see above */
+static void read_trace(const char *path) {
+  FILE *f = fopen(path, "r");
+  char *line = NULL;
+  size_t cap = 0, max = 0;
+
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  while (getline(&line, &cap, f) > 0) {
+    char *uri = line, *quote = strchr(line, '"');
+    int post = 0;
+
+    if (quote) { // An access log line: "METHOD URI" STATUS BYTES
+      post = strncmp(quote + 1, "POST ", 5) == 0;
+      if ((uri = strchr(quote + 1, ' ')) == NULL) {
+        continue;
+      }
+      uri++;
+    }
+    uri += strspn(uri, " \t");
+    uri[strcspn(uri, " \t\n\"")] = '\0';
+    if (strncmp(uri, "http://", 7) == 0) {
+      uri += 7 + strcspn(uri + 7, "/");
+    }
+    while (*uri == '/') {
+      uri++;
+    }
+    if (trace_len == max) {
+      max = max ? 2 * max : 4096;
+      trace = realloc(trace, max * sizeof(mix_entry_t));
+    }
+    trace[trace_len++] = (mix_entry_t) { post, strdup(uri), 1 };
+  }
+  free(line);
+  fclose(f);
+  if (trace_len == 0) {
+    fprintf(stderr, "%s: empty trace\n", path);
+    exit(1);
+  }
+}
+
+/* Returns the next request to send, or NULL at the end of the trace */
+static const mix_entry_t *pick(worker_t *w) {
+  unsigned r;
+  int i = 0;
+
+  if (trace) {
+    long next = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    return next < trace_len ? &trace[next] : NULL;
+  }
+  r = rand_r(&w->seed) % mix_total;
+  while (r >= mix[i].weight) {
+    r -= mix[i++].weight;
+  }
+  return &mix[i];
+}
+
+static int worker_connect(worker_t *w) {
+  struct timeval tv = { timeout_secs, 0 };
+  int one = 1;
+
+  w->fd = proxy_host ? open_clientfd(proxy_host, proxy_port) : open_clientfd(origin_host, origin_port);
+  if (w->fd < 0) {
+    w->fd = -1;
+    return -1;
+  }
+  // A stalled server makes the request fail rather than hang the run
+  setsockopt(w->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(w->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  // A POST goes out as two writes, the body must not wait for the ack of the header
+  setsockopt(w->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  rio_readinitb(&w->rio, w->fd);
+  w->connects++;
+  return 0;
+}
+
+static void worker_close(worker_t *w) {
+  if (w->fd >= 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+}
+
+/* Reads a whole response, sets *status and adds the bytes read to *bytes. The connection is closed unless
+ * both sides keep it alive. Returns 0, or -1 if the response was cut short or malformed.
+ */
+static int read_response(worker_t *w, int *status, uint64_t *bytes) {
+  char line[MAXLINE], discard[DISCARD_SIZE];
+  int minor, keep_alive = 0, close_hdr = 0, chunked = 0;
+  long long length = -1;
+  ssize_t n;
+
+  if ((n = rio_readlineb(&w->rio, line, MAXLINE)) <= 0) {
+    return -1;
+  }
+  *bytes += n;
+  if (sscanf(line, "HTTP/1.%d %d", &minor, status) != 2) {
+    *status = 0;
+    return -1;
+  }
+  while (1) {
+    if ((n = rio_readlineb(&w->rio, line, MAXLINE)) <= 0) {
+      return -1;
+    }
+    *bytes += n;
+    if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+      break;
+    }
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      length = strtoll(line + 15, NULL, 10);
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      chunked = strcasestr(line + 18, "chunked") != NULL;
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      close_hdr = strcasestr(line + 11, "close") != NULL;
+      keep_alive = strcasestr(line + 11, "keep-alive") != NULL;
+    }
+  }
+  keep_alive = !close_hdr && (minor > 0 || keep_alive);
+
+  if ((*status >= 100 && *status < 200) || *status == 204 || *status == 304) {
+    length = 0;
+  } else if (chunked) {
+    while (1) {
+      long long size;
+
+      if ((n = rio_readlineb(&w->rio, line, MAXLINE)) <= 0) {
+        return -1;
+      }
+      *bytes += n;
+      if ((size = strtoll(line, NULL, 16)) == 0) {
+        break;
+      }
+      for (size += 2; size > 0; size -= n) { // The chunk and its CRLF
+        if ((n = rio_readnb(&w->rio, discard, size < DISCARD_SIZE ? size : DISCARD_SIZE)) <= 0) {
+          return -1;
+        }
+        *bytes += n;
+      }
+    }
+    do { // Trailers
+      if ((n = rio_readlineb(&w->rio, line, MAXLINE)) <= 0) {
+        return -1;
+      }
+      *bytes += n;
+    } while (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+    length = 0;
+  }
+
+  if (length < 0) { // Delimited by the end of the connection
+    while ((n = rio_readnb(&w->rio, discard, DISCARD_SIZE)) > 0) {
+      *bytes += n;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    keep_alive = 0;
+  }
+  for (; length > 0; length -= n) {
+    if ((n = rio_readnb(&w->rio, discard, length < DISCARD_SIZE ? length : DISCARD_SIZE)) <= 0) {
+      return -1;
+    }
+    *bytes += n;
+  }
+  if (!keep_alive || fresh) {
+    worker_close(w);
+  }
+  return 0;
+}
+
+/* Sends one request of the mix and reads its response. A kept-alive connection the server closed while it
+ * was idle is reopened once. Returns 0, or -1 if the request failed.
+ */
+static int request(worker_t *w, const mix_entry_t *e, int *status, uint64_t *bytes) {
+  char req[MAXLINE];
+  int len, reused;
+
+  // Through a proxy the request line has the absolute uri
+  if (proxy_host) {
+    len = snprintf(req, sizeof(req), "%s http://%s:%s/%s HTTP/1.1\r\n", e->post ? "POST" : "GET",
+                   origin_host, origin_port, e->path);
+  } else {
+    len = snprintf(req, sizeof(req), "%s /%s HTTP/1.1\r\n", e->post ? "POST" : "GET", e->path);
+  }
+  len += snprintf(req + len, sizeof(req) - len, "Host: %s:%s\r\nConnection: %s\r\n", origin_host, origin_port,
+                  fresh ? "close" : "keep-alive");
+  if (e->post) {
+    len += snprintf(req + len, sizeof(req) - len, "Content-Length: %zu\r\n", post_bytes);
+  }
+  len += snprintf(req + len, sizeof(req) - len, "\r\n");
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    uint64_t before = *bytes;
+
+    if ((reused = w->fd >= 0) == 0 && worker_connect(w) < 0) {
+      return -1;
+    }
+    if (rio_writen(w->fd, req, len) == len
+        && (!e->post || rio_writen(w->fd, post_body, post_bytes) == post_bytes)
+        && read_response(w, status, bytes) == 0) {
+      return 0;
+    }
+    worker_close(w);
+    if (!reused || *bytes != before) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+static void *worker(void *vargp) {
+  worker_t *w = vargp;
+  long long interval = rate > 0 ? (long long) (nconns * 1e9 / rate) : 0;
+  long long due = t_start + (interval * w->id) / nconns; // Staggered so the connections do not send in bursts
+  long long stop = t_end + timeout_secs * 1000000000LL;    // Open loop: a late server cannot hold the run up
+  struct timespec ts;
+
+  ts.tv_sec = t_start / 1000000000LL;
+  ts.tv_nsec = t_start % 1000000000LL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+  while (1) {
+    const mix_entry_t *e = pick(w);
+    uint64_t bytes = 0;
+    int status = 0, rc;
+    long long now = now_ns();
+
+    if (e == NULL) {
+      break;
+    }
+    if (interval) {
+      if (due >= t_end || now >= stop) {
+        break;
+      }
+      if (due > now) {
+        ts.tv_sec = due / 1000000000LL;
+        ts.tv_nsec = due % 1000000000LL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+    } else {
+      if (now >= t_end) {
+        break;
+      }
+      due = now;
+    }
+
+    rc = request(w, e, &status, &bytes);
+    now = now_ns();
+    if (due >= t_measure) {
+      w->bytes += bytes;
+      if (rc < 0) {
+        w->errors++;
+      } else {
+        w->requests++;
+        w->status[status >= 100 && status < 600 ? status / 100 : 0]++;
+        hist_record(&w->latency, now - due);
+      }
+    }
+    due += interval;
+  }
+  worker_close(w);
+  return NULL;
+}
+
+/* Prints the sum of every worker's results as JSON */
+static void report(worker_t *workers, double secs) {
+  static const char *class_names[6] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+  static const struct { const char *name; double q; } quantiles[] = {
+    { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }, { "p9999", 0.9999 },
+  };
+  hist_t *latency = calloc(1, sizeof(hist_t));
+  uint64_t requests = 0, errors = 0, bytes = 0, connects = 0, status[6] = { 0 };
+
+  for (int i = 0; i < nconns; i++) {
+    worker_t *w = &workers[i];
+
+    hist_merge(latency, &w->latency);
+    requests += w->requests;
+    errors += w->errors;
+    bytes += w->bytes;
+    connects += w->connects;
+    for (int c = 0; c < 6; c++) {
+      status[c] += w->status[c];
+    }
+  }
+
+  printf("{\n");
+  printf("  \"mode\": \"%s\",\n", rate > 0 ? "open" : "closed");
+  printf("  \"origin\": \"%s:%s\",\n", origin_host, origin_port);
+  if (proxy_host) {
+    printf("  \"proxy\": \"%s:%s\",\n", proxy_host, proxy_port);
+  } else {
+    printf("  \"proxy\": null,\n");
+  }
+  printf("  \"connections\": %d,\n", nconns);
+  printf("  \"keep_alive\": %s,\n", fresh ? "false" : "true");
+  printf("  \"duration_s\": %.3f,\n", secs);
+  printf("  \"target_rate\": %.1f,\n", rate);
+  printf("  \"requests\": %llu,\n", (unsigned long long) requests);
+  printf("  \"errors\": %llu,\n", (unsigned long long) errors);
+  printf("  \"connects\": %llu,\n", (unsigned long long) connects);
+  printf("  \"bytes\": %llu,\n", (unsigned long long) bytes);
+  printf("  \"throughput_rps\": %.1f,\n", requests / secs);
+  printf("  \"throughput_mbps\": %.3f,\n", bytes * 8 / secs / 1e6);
+  printf("  \"status\": {");
+  for (int c = 0; c < 6; c++) {
+    printf("%s\"%s\": %llu", c ? ", " : " ", class_names[c], (unsigned long long) status[c]);
+  }
+  printf(" },\n");
+  printf("  \"latency_us\": {\n");
+  printf("    \"mean\": %.1f,\n", latency->count ? latency->sum / 1e3 / latency->count : 0.0);
+  for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    printf("    \"%s\": %.1f,\n", quantiles[i].name, hist_quantile(latency, quantiles[i].q) / 1e3);
+  }
+  printf("    \"max\": %.1f\n", latency->max / 1e3);
+  printf("  }\n");
+  printf("}\n");
+  free(latency);
+}
+
+int main(int argc, char **argv) {
+  double duration = 10, warmup = 0;
+  char default_mix[] = DEFAULT_MIX;
+  char *mix_spec = default_mix, *trace_path = NULL;
+  pthread_attr_t attr;
+  worker_t *workers;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:d:w:r:fm:t:b:T:x:")) != -1) {
+    switch (opt) {
+    case 'c': nconns = atoi(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'w': warmup = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'f': fresh = 1; break;
+    case 'm': mix_spec = optarg; break;
+    case 't': trace_path = optarg; break;
+    case 'b': post_bytes = strtoul(optarg, NULL, 10); break;
+    case 'T': timeout_secs = atoi(optarg); break;
+    case 'x': split_hostport(optarg, &proxy_host, &proxy_port); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || nconns <= 0 || duration <= 0 || warmup < 0 || rate < 0 || timeout_secs <= 0) {
+    usage(argv[0]);
+  }
+  split_hostport(argv[optind], &origin_host, &origin_port);
+  parse_mix(mix_spec);
+  if (trace_path) {
+    read_trace(trace_path);
+  }
+  post_body = malloc(post_bytes + 1);
+  memset(post_body, 'x', post_bytes);
+  signal(SIGPIPE, SIG_IGN);
+
+  workers = calloc(nconns, sizeof(worker_t));
+  t_start = now_ns() + 100000000LL; // Every worker is started by then
+  t_measure = t_start + (long long) (warmup * 1e9);
+  t_end = t_measure + (long long) (duration * 1e9);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+  for (int i = 0; i < nconns; i++) {
+    workers[i].id = i;
+    workers[i].fd = -1;
+    workers[i].seed = i * 2654435761u + 1;
+    Pthread_create(&workers[i].tid, &attr, worker, &workers[i]);
+  }
+  for (int i = 0; i < nconns; i++) {
+    Pthread_join(workers[i].tid, NULL);
+  }
+  // A trace may end before the duration
+  report(workers, trace && now_ns() < t_end ? (now_ns() - t_measure) / 1e9 : duration);
+  free(workers);
+  free(post_body);
+  return 0;
+}
@@ -0,0 +1,578 @@
+/*
+ * origin - A benchmark origin server.  Each thread runs its own epoll loop on its own SO_REUSEPORT listening
+ * socket, connections are kept alive, and bodies are written from a shared pattern buffer, so a benchmark is
+ * limited by the proxy rather than by the origin.
+ *
+ * Any path is served; what is served is chosen by the query parameters:
+ *
+ *   size=N         Body bytes, with an optional k or m suffix (default 1024)
+ *   status=CODE    Response status (default 200)
+ *   chunked=N      Chunked framing with chunks of N bytes, Content-Length otherwise
+ *   delay=MS       Wait before the response headers, MS is the mean for the distributions
+ *   dist=D         const (default), uniform (0 to twice the mean) or exp
+ *   slow=P         With probability P, wait slow_delay=MS (default 1000) instead of the delay
+ *   cache=C        Cache-Control value: a number of seconds for max-age, or no-store, no-cache, private
+ *   cookie=1       Add a Set-Cookie header
+ *   error=P        With probability P, answer 500 instead
+ *   stall=MS       Stop MS milliseconds in the middle of the body, or after stall_at=N bytes
+ *   abort=P        With probability P, close the connection in the middle of the body, or after abort_at=N bytes
+ *   close=1        Close the connection after the response
+ *
+ * e.g. GET /obj?size=64k&delay=5&dist=exp&cache=60
+ */
+#define _GNU_SOURCE                 // accept4
+#include <csapp.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#define IN_SIZE 8192                // Bytes of a request's line and headers
+#define PATTERN_SIZE 65536          // Bytes of body written at once
+#define MAX_CHUNK 16384
+#define MAX_EVENTS 256
+#define MAX_TIMERS_INIT 1024
+
+enum { CONN_READ, CONN_WAIT, CONN_WRITE, CONN_STALL };
+
+typedef struct {
+  int fd;
+  unsigned gen;                     // Tells the timers of this connection from those of one closed before
+  int state;
+  unsigned events;                  // Registered with epoll
+  char in[IN_SIZE];
+  size_t in_len;
+  int have_head;                    // The request's headers are parsed, its body is being skipped
+  long long body_left;              // Request body bytes still to skip
+  long long delay;                  // ns before the response headers go out
+
+  /* The response being written */
+  int status;
+  int head_only;                    // HEAD
+  int close_after;
+  long long size, sent;             // Body bytes
+  size_t chunk;                     // 0 for Content-Length
+  int last_chunk_sent;
+  long long stall_at, abort_at;     // -1 for none
+  int stall_ms;
+  const char *out;                  // Pending bytes of the current piece
+  size_t out_len;
+  char buf[MAX_CHUNK + 64];         // The headers, or a chunk with its framing
+} conn_t;
+
+typedef struct {
+  long long at;
+  int fd;
+  unsigned gen;
+} wakeup_t;
+
+/* One thread's event loop */
+typedef struct {
+  int epfd, listenfd;
+  unsigned next_gen;
+  unsigned long long seed;
+  wakeup_t *timers;                 // A binary min-heap on at
+  int ntimers, max_timers;
+} loop_t;
+
+static char pattern[2 * PATTERN_SIZE]; // Any PATTERN_SIZE bytes from any offset below PATTERN_SIZE
+static conn_t **conns;              // By fd
+static int nthreads = 4;
+static int max_fds;
+static char *port;
+
+/* Prototype functions */
+static void usage(const char*);
+static long long now_ns(void);
+static double uniform(loop_t*);
+static void timer_add(loop_t*, long long, conn_t*);
+static void timers_run(loop_t*);
+static void conn_events(loop_t*, conn_t*, unsigned);
+static void conn_close(loop_t*, conn_t*);
+static void conn_accept(loop_t*);
+static void conn_read(loop_t*, conn_t*);
+static int conn_request(loop_t*, conn_t*);
+static void conn_respond(loop_t*, conn_t*);
+static int next_piece(loop_t*, conn_t*);
+static void conn_write(loop_t*, conn_t*);
+static const char *param(const char*, const char*, char*, size_t);
+static long long parse_size(const char*);
+static const char *reason(int);
+static void *loop(void*);
+
+static void usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-t THREADS] PORT\n", progname);
+  exit(1);
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* A number in [0, 1) from xorshift64* */
+static double uniform(loop_t *l) {
+  l->seed ^= l->seed >> 12;
+  l->seed ^= l->seed << 25;
+  l->seed ^= l->seed >> 27;
+  return ((l->seed * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static void timer_add(loop_t *l, long long at, conn_t *c) {
+  int i;
+
+  if (l->ntimers == l->max_timers) {
+    l->max_timers *= 2;
+    l->timers = realloc(l->timers, l->max_timers * sizeof(wakeup_t));
+  }
+  for (i = l->ntimers++; i > 0 && l->timers[(i - 1) / 2].at > at; i = (i - 1) / 2) {
+    l->timers[i] = l->timers[(i - 1) / 2];
+  }
+  l->timers[i] = (wakeup_t) { at, c->fd, c->gen };
+}
+
+/* Wakes the connections whose wait is over. A timer of a connection closed since is dropped. */
+static void timers_run(loop_t *l) {
+  long long now = now_ns();
+
+  while (l->ntimers > 0 && l->timers[0].at <= now) {
+    wakeup_t t = l->timers[0], last = l->timers[--l->ntimers];
+    conn_t *c;
+    int i = 0;
+
+    while (2 * i + 1 < l->ntimers) {
+      int child = 2 * i + 1;
+      if (child + 1 < l->ntimers && l->timers[child + 1].at < l->timers[child].at) {
+        child++;
+      }
+      if (last.at <= l->timers[child].at) {
+        break;
+      }
+      l->timers[i] = l->timers[child];
+      i = child;
+    }
+    l->timers[i] = last;
+
+    if ((c = conns[t.fd]) == NULL || c->gen != t.gen) {
+      continue;
+    }
+    if (c->state == CONN_WAIT) {
+      conn_respond(l, c);
+    } else if (c->state == CONN_STALL) {
+      c->state = CONN_WRITE;
+      conn_write(l, c);
+    }
+  }
+}
+
+static void conn_events(loop_t *l, conn_t *c, unsigned events) {
+  struct epoll_event ev = { .events = events, .data.fd = c->fd };
+
+  if (c->events != events) {
+    epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+  }
+}
+
+static void conn_close(loop_t *l, conn_t *c) {
+  conns[c->fd] = NULL;
+  close(c->fd);
+  free(c);
+}
+
+static void conn_accept(loop_t *l) {
+  int fd, one = 1;
+
+  while ((fd = accept4(l->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    conn_t *c;
+
+    if (fd >= max_fds || (c = malloc(sizeof(conn_t))) == NULL) {
+      close(fd);
+      continue;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->fd = fd;
+    c->gen = l->next_gen;
+    l->next_gen += nthreads; // Unique over the threads, as an fd may be reused by another one
+    c->state = CONN_READ;
+    c->events = EPOLLIN;
+    c->in_len = 0;
+    c->have_head = 0;
+    c->body_left = 0;
+    conns[fd] = c;
+    epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+static void conn_read(loop_t *l, conn_t *c) {
+  ssize_t n = read(c->fd, c->in + c->in_len, IN_SIZE - c->in_len);
+
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    conn_close(l, c);
+    return;
+  }
+  if (n < 0) {
+    return;
+  }
+  c->in_len += n;
+  conn_request(l, c);
+}
+
+/* Parses the request at the front of the input once its headers are in, and starts on the response once its
+ * body has been skipped: the body is read first so that a client still sending it cannot deadlock with us.
+ * Returns 0 if the connection is still open.
+ */
+static int conn_request(loop_t *l, conn_t *c) {
+  char method[16], target[IN_SIZE], value[64], *end;
+  double delay, r;
+  size_t head_len, skip;
+
+  if (c->have_head) {
+    goto skip_body;
+  }
+  if ((end = memmem(c->in, c->in_len, "\r\n\r\n", 4)) == NULL) {
+    if (c->in_len == IN_SIZE) {
+      conn_close(l, c);
+      return -1;
+    }
+    return 0;
+  }
+  head_len = end + 4 - c->in;
+  *end = '\0';
+  if (sscanf(c->in, "%15s %8191s", method, target) != 2) {
+    conn_close(l, c);
+    return -1;
+  }
+
+  c->status = 200;
+  c->head_only = strcmp(method, "HEAD") == 0;
+  c->close_after = strstr(c->in, "HTTP/1.0") != NULL && strcasestr(c->in, "keep-alive") == NULL;
+  c->close_after |= strcasestr(c->in, "\nConnection: close") != NULL;
+  c->body_left = 0;
+  if ((end = strcasestr(c->in, "\nContent-Length:")) != NULL) {
+    c->body_left = strtoll(end + 16, NULL, 10);
+  }
+  memmove(c->in, c->in + head_len, c->in_len - head_len);
+  c->in_len -= head_len;
+
+  c->size = param(target, "size", value, sizeof(value)) ? parse_size(value) : 1024;
+  if (param(target, "status", value, sizeof(value))) {
+    c->status = atoi(value);
+  }
+  c->chunk = param(target, "chunked", value, sizeof(value)) ? parse_size(value) : 0;
+  if (c->chunk > MAX_CHUNK) {
+    c->chunk = MAX_CHUNK;
+  }
+  if (param(target, "close", value, sizeof(value)) && atoi(value)) {
+    c->close_after = 1;
+  }
+  if (param(target, "error", value, sizeof(value)) && uniform(l) < atof(value)) {
+    c->status = 500;
+  }
+  c->stall_ms = param(target, "stall", value, sizeof(value)) ? atoi(value) : 0;
+  c->stall_at = param(target, "stall_at", value, sizeof(value)) ? parse_size(value) : c->size / 2;
+  c->abort_at = -1;
+  if (param(target, "abort", value, sizeof(value)) && uniform(l) < atof(value)) {
+    c->abort_at = param(target, "abort_at", value, sizeof(value)) ? parse_size(value) : c->size / 2;
+  }
+
+  delay = param(target, "delay", value, sizeof(value)) ? atof(value) : 0;
+  if (param(target, "dist", value, sizeof(value))) {
+    if (strcmp(value, "uniform") == 0) {
+      delay *= 2 * uniform(l);
+    } else if (strcmp(value, "exp") == 0) {
+      delay *= -log(1 - uniform(l));
+    }
+  }
+  if (param(target, "slow", value, sizeof(value)) && (r = atof(value)) > 0 && uniform(l) < r) {
+    delay = param(target, "slow_delay", value, sizeof(value)) ? atof(value) : 1000;
+  }
+
+  // The response headers go in buf for now, they are only sent when the delay is over
+  c->out_len = snprintf(c->buf, sizeof(c->buf), "HTTP/1.1 %d %s\r\n", c->status, reason(c->status));
+  if (c->status == 500) {
+    c->size = 0;
+    c->chunk = 0;
+    c->abort_at = -1;
+    c->stall_ms = 0;
+  }
+  if (c->chunk) {
+    c->out_len += snprintf(c->buf + c->out_len, sizeof(c->buf) - c->out_len, "Transfer-Encoding: chunked\r\n");
+  } else {
+    c->out_len += snprintf(c->buf + c->out_len, sizeof(c->buf) - c->out_len, "Content-Length: %lld\r\n", c->size);
+  }
+  c->out_len += snprintf(c->buf + c->out_len, sizeof(c->buf) - c->out_len,
+                         "Content-Type: application/octet-stream\r\n");
+  if (param(target, "cache", value, sizeof(value))) {
+    c->out_len += snprintf(c->buf + c->out_len, sizeof(c->buf) - c->out_len, "Cache-Control: %s%s\r\n",
+                           isdigit((unsigned char) value[0]) ? "max-age=" : "", value);
+  }
+  if (param(target, "cookie", value, sizeof(value)) && atoi(value)) {
+    c->out_len += snprintf(c->buf + c->out_len, sizeof(c->buf) - c->out_len, "Set-Cookie: session=%u\r\n", c->gen);
+  }
+  if (c->close_after) {
+    c->out_len += snprintf(c->buf + c->out_len, sizeof(c->buf) - c->out_len, "Connection: close\r\n");
+  }
+  c->out_len += snprintf(c->buf + c->out_len, sizeof(c->buf) - c->out_len, "\r\n");
+  c->out = c->buf;
+  c->delay = delay * 1e6;
+  c->have_head = 1;
+
+skip_body:
+  skip = c->body_left < c->in_len ? c->body_left : c->in_len;
+  memmove(c->in, c->in + skip, c->in_len - skip);
+  c->in_len -= skip;
+  c->body_left -= skip;
+  if (c->body_left > 0) {
+    return 0;
+  }
+  c->have_head = 0;
+  if (c->delay > 0) {
+    c->state = CONN_WAIT;
+    conn_events(l, c, 0);
+    timer_add(l, now_ns() + c->delay, c);
+    return 0;
+  }
+  conn_respond(l, c);
+  return 0;
+}
+
+static void conn_respond(loop_t *l, conn_t *c) {
+  c->state = CONN_WRITE;
+  c->sent = 0;
+  c->last_chunk_sent = 0;
+  conn_write(l, c);
+}
+
+/* Points out at the next piece of the body. Returns 1, 0 at the end of the response, -1 if the response
+ * stalls here and -2 if it is aborted.
+ */
+static int next_piece(loop_t *l, conn_t *c) {
+  long long n = c->size - c->sent;
+
+  if (c->head_only || (c->sent == c->size && (!c->chunk || c->last_chunk_sent))) {
+    return 0;
+  }
+  if (c->abort_at >= 0 && c->sent >= c->abort_at) {
+    return -2;
+  }
+  if (c->stall_ms && c->sent >= c->stall_at) {
+    c->state = CONN_STALL;
+    conn_events(l, c, 0);
+    timer_add(l, now_ns() + c->stall_ms * 1000000LL, c);
+    c->stall_ms = 0; // Once per response
+    return -1;
+  }
+  // Pieces end where the response stalls or is aborted
+  if (c->stall_ms && c->stall_at - c->sent < n) {
+    n = c->stall_at - c->sent;
+  }
+  if (c->abort_at >= 0 && c->abort_at - c->sent < n) {
+    n = c->abort_at - c->sent;
+  }
+
+  if (c->chunk) {
+    int len;
+
+    if (n == 0) {
+      c->out = "0\r\n\r\n";
+      c->out_len = 5;
+      c->last_chunk_sent = 1;
+      return 1;
+    }
+    if (n > c->chunk) {
+      n = c->chunk;
+    }
+    len = sprintf(c->buf, "%llx\r\n", n);
+    memcpy(c->buf + len, pattern + c->sent % PATTERN_SIZE, n);
+    memcpy(c->buf + len + n, "\r\n", 2);
+    c->out = c->buf;
+    c->out_len = len + n + 2;
+  } else {
+    if (n > PATTERN_SIZE) {
+      n = PATTERN_SIZE;
+    }
+    c->out = pattern + c->sent % PATTERN_SIZE;
+    c->out_len = n;
+  }
+  c->sent += n;
+  return 1;
+}
+
+static void conn_write(loop_t *l, conn_t *c) {
+  while (1) {
+    ssize_t n;
+
+    if (c->out_len == 0) {
+      int rc = next_piece(l, c);
+
+      if (rc == -1) {
+        return;
+      }
+      if (rc == -2 || (rc == 0 && c->close_after)) {
+        conn_close(l, c);
+        return;
+      }
+      if (rc == 0) {
+        c->state = CONN_READ;
+        conn_events(l, c, EPOLLIN);
+        conn_request(l, c); // A pipelined request may be waiting
+        return;
+      }
+    }
+    if ((n = write(c->fd, c->out, c->out_len)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        conn_events(l, c, EPOLLOUT);
+      } else {
+        conn_close(l, c);
+      }
+      return;
+    }
+    c->out += n;
+    c->out_len -= n;
+  }
+}
+
+/* Copies the value of query parameter name in target into value. Returns value, or NULL if it is missing. */
+static const char *param(const char *target, const char *name, char *value, size_t size) {
+  const char *p = strchr(target, '?');
+  size_t name_len = strlen(name);
+
+  while (p) {
+    p++;
+    if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+      size_t len = strcspn(p + name_len + 1, "&");
+      if (len >= size) {
+        len = size - 1;
+      }
+      memcpy(value, p + name_len + 1, len);
+      value[len] = '\0';
+      return value;
+    }
+    p = strchr(p, '&');
+  }
+  return NULL;
+}
+
+static long long parse_size(const char *s) {
+  char *end;
+  long long n = strtoll(s, &end, 10);
+
+  if (*end == 'k' || *end == 'K') {
+    n <<= 10;
+  } else if (*end == 'm' || *end == 'M') {
+    n <<= 20;
+  }
+  return n < 0 ? 0 : n;
+}
+
+static const char *reason(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 204: return "No Content";
+  case 301: return "Moved Permanently";
+  case 304: return "Not Modified";
+  case 400: return "Bad Request";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 500: return "Internal Server Error";
+  case 502: return "Bad Gateway";
+  case 503: return "Service Unavailable";
+  default: return "Status";
+  }
+}
+
+static void *loop(void *vargp) {
+  loop_t *l = vargp;
+  struct epoll_event events[MAX_EVENTS], ev = { .events = EPOLLIN };
+
+  l->epfd = epoll_create1(0);
+  ev.data.fd = l->listenfd;
+  epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->listenfd, &ev);
+
+  while (1) {
+    int timeout = -1, n;
+
+    if (l->ntimers > 0) {
+      long long wait = l->timers[0].at - now_ns();
+      timeout = wait <= 0 ? 0 : (int) ((wait + 999999) / 1000000);
+    }
+    n = epoll_wait(l->epfd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      conn_t *c;
+
+      if (fd == l->listenfd) {
+        conn_accept(l);
+      } else if ((c = conns[fd]) != NULL) {
+        if (c->state == CONN_READ) {
+          conn_read(l, c);
+        } else if (c->state == CONN_WRITE) {
+          conn_write(l, c);
+        }
+      }
+    }
+    timers_run(l);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE }, *ai;
+  struct rlimit rl;
+  int opt, one = 1;
+
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+    switch (opt) {
+    case 't': nthreads = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || nthreads <= 0) {
+    usage(argv[0]);
+  }
+  port = argv[optind];
+
+  // As many connections as the hard limit allows
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  max_fds = rl.rlim_cur > 1 << 20 ? 1 << 20 : rl.rlim_cur;
+  conns = calloc(max_fds, sizeof(conn_t*));
+  for (int i = 0; i < 2 * PATTERN_SIZE; i++) {
+    pattern[i] = i % 64 == 63 ? '\n' : 'a' + (i % PATTERN_SIZE) % 26;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if (getaddrinfo(NULL, port, &hints, &ai) != 0) {
+    fprintf(stderr, "%s: bad port\n", port);
+    exit(1);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    loop_t *l = calloc(1, sizeof(loop_t));
+    pthread_t tid;
+
+    // Each thread listens on its own socket, the kernel spreads the connections over them
+    l->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(l->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(l->listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(l->listenfd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(l->listenfd, 1024) < 0) {
+      fprintf(stderr, "%s: %s\n", port, strerror(errno));
+      exit(1);
+    }
+    l->next_gen = i;
+    l->seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+    l->max_timers = MAX_TIMERS_INIT;
+    l->timers = malloc(l->max_timers * sizeof(wakeup_t));
+    Pthread_create(&tid, NULL, loop, l);
+  }
+  freeaddrinfo(ai);
+  pthread_exit(NULL);
+}
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+
+# perf-gate.py - Runs a fixed suite of load scenarios through the proxy and
+# compares their throughput and p99 latency with the checked-in baseline of
+# the machine it runs on.  Exits with 1 if a scenario regressed beyond the
+# tolerance, or if there is no baseline for this machine, so it can gate
+# changes.
+#
+#     driver/perf-gate.py [-b BASELINE] [-m MACHINE] [-t TOLERANCE] [-d SECS] [--update]
+#
+# The proxy and driver/origin are started on free ports picked the way
+# driver/free-port.sh picks them, and driver/loadgen drives them.  Run it
+# after make, from anywhere.
+#
+# Numbers only hold for the machine they were taken on, so the baseline file
+# keeps them per machine, named by its CPU model and count unless -m names it.
+# --update adds or replaces this machine's numbers: run it on a known good tree
+# and commit the file, never to hide a regression.
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+from harness import TOP, PROXY, ORIGIN, LOADGEN, check_binaries, start_listener, stop
+
+BASELINE = os.path.join(TOP, "driver", "perf-baseline.json")
+
+# Relative change allowed by a new baseline file. p99 is noisier than throughput, but a tail twice as long is
+# a regression, not noise.
+TOLERANCE = {"throughput_rps": 0.25, "p99_us": 0.4}
+
+# Name, what it measures, loadgen arguments
+SCENARIOS = [
+    ("hit_storm", "small objects, all served from the cache",
+     ["-c", "32", "-m", ",".join("hit%d?size=1k" % i for i in range(8))]),
+    ("large_miss", "2M objects, over the object size limit so never cached",
+     ["-c", "8", "-m", "big?size=2m"]),
+    ("post_upload", "64K POST bodies relayed to the origin",
+     ["-c", "16", "-b", "65536", "-m", "POST:upload?size=64"]),
+    ("slow_origin", "open loop at 500/s, misses taking 20ms on average, 1% of them 200ms",
+     ["-c", "64", "-r", "500", "-m",
+      "fast?size=4k&cache=no-store*3,"
+      "slow?size=16k&delay=20&dist=exp&slow=0.01&slow_delay=200&cache=no-store"]),
+]
+
+
+def run_scenario(args, proxy_port, origin_port, duration):
+    out = subprocess.run([LOADGEN, "-d", str(duration), "-w", "1",
+                          "-x", "localhost:%d" % proxy_port] + args +
+                         ["localhost:%d" % origin_port],
+                         stdout=subprocess.PIPE, check=True)
+    return json.loads(out.stdout)
+
+
+def machine_name():
+    """Names the machine by its CPU model and count, what the numbers depend on most"""
+    model = "unknown cpu"
+    try:
+        with open("/proc/cpuinfo") as f:
+            m = re.search(r"^model name\s*:\s*(.*)$", f.read(), re.M)
+            if m:
+                model = m.group(1).strip()
+    except OSError:
+        pass
+    return "%s x%d" % (model, os.cpu_count() or 1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Proxy performance regression gate")
+    parser.add_argument("-b", "--baseline", default=BASELINE)
+    parser.add_argument("-m", "--machine", default=machine_name(),
+                        help="name of the machine's numbers in the baseline, its CPU by default")
+    parser.add_argument("-t", "--tolerance", type=float,
+                        help="allowed relative change of both metrics, "
+                             "instead of the baseline's own")
+    parser.add_argument("-d", "--duration", type=float, default=5,
+                        help="seconds each scenario is measured")
+    parser.add_argument("--update", action="store_true",
+                        help="write the results as the new baseline")
+    opts = parser.parse_args()
+
+    check_binaries(PROXY, ORIGIN, LOADGEN)
+
+    baseline = {"tolerance": TOLERANCE, "machines": {}}
+    if os.path.exists(opts.baseline):
+        with open(opts.baseline) as f:
+            baseline = json.load(f)
+    machine = baseline["machines"].get(opts.machine)
+    if machine is None and not opts.update:
+        print("No baseline for %s in %s: run %s --update on a known good tree and commit it"
+              % (opts.machine, opts.baseline, sys.argv[0]))
+        return 1
+
+    origin, origin_port = start_listener("origin", [ORIGIN])
+    proxy, proxy_port = start_listener("proxy", [PROXY])
+    results = {}
+    try:
+        for name, what, args in SCENARIOS:
+            r = run_scenario(args, proxy_port, origin_port, opts.duration)
+            results[name] = {"throughput_rps": r["throughput_rps"],
+                             "p99_us": r["latency_us"]["p99"],
+                             "errors": r["errors"]}
+            print("%-12s %10.1f req/s %10.1f us p99 %6d errors  (%s)"
+                  % (name, r["throughput_rps"], r["latency_us"]["p99"],
+                     r["errors"], what), flush=True)
+    finally:
+        stop(proxy, origin)
+
+    if opts.update:
+        # A run with errors says nothing of how fast the proxy is
+        errors = [name for name, r in results.items() if r["errors"]]
+        if errors:
+            print("No baseline written, errors in %s" % ", ".join(errors))
+            return 1
+        baseline["machines"][opts.machine] = {
+            "scenarios": {name: {k: v for k, v in r.items() if k != "errors"}
+                          for name, r in results.items()}}
+        with open(opts.baseline, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("Baseline of %s written to %s" % (opts.machine, opts.baseline))
+        return 0
+
+    tolerance = baseline["tolerance"]
+    if opts.tolerance is not None:
+        tolerance = {"throughput_rps": opts.tolerance, "p99_us": opts.tolerance}
+
+    # Less throughput or a longer p99 than the baseline allows, or any error, is a regression
+    failed = []
+    for name, r in results.items():
+        base = machine["scenarios"].get(name)
+        if base is None:
+            print("%s: no baseline, skipped" % name)
+            continue
+        floor = base["throughput_rps"] * (1 - tolerance["throughput_rps"])
+        ceiling = base["p99_us"] * (1 + tolerance["p99_us"])
+        if r["throughput_rps"] < floor:
+            failed.append("%s: %.1f req/s, below %.1f (baseline %.1f)"
+                          % (name, r["throughput_rps"], floor, base["throughput_rps"]))
+        if r["p99_us"] > ceiling:
+            failed.append("%s: p99 %.1f us, above %.1f (baseline %.1f)"
+                          % (name, r["p99_us"], ceiling, base["p99_us"]))
+        if r["errors"]:
+            failed.append("%s: %d errors" % (name, r["errors"]))
+
+    for f in failed:
+        print("REGRESSION " + f)
+    print("%d scenarios, %s" % (len(results), "FAILED" if failed else "all within the baseline"))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
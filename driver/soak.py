@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+
+# soak.py - Keeps the proxy under a long mix of valid, malformed and aborted
+# requests and watches it for leaks.  The load comes in rounds; after each one
+# the proxy is left idle for a moment, then its resident memory, open fds,
+# threads and accounted memory (proxy_memory_bytes) are sampled.  Exits with 1
+# if one of them is still growing once the warmup rounds are over, if valid
+# requests failed or if the proxy died.
+#
+#     driver/soak.py [-d SECS] [-r ROUND_SECS] [-w WARMUP_ROUNDS] [-o CSV]
+#
+# Valid requests come from driver/loadgen.  Malformed ones are the files of
+# driver/robustness_files, with TINYPORT pointing at driver/origin.  Aborted
+# ones are clients hanging up in the middle of their request or of the
+# response, and the origin closing in the middle of its body.
+
+import argparse
+import glob
+import json
+import os
+import random
+import re
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+from harness import TOP, PROXY, ORIGIN, LOADGEN, check_binaries, start_listener, stop
+
+ROBUSTNESS = os.path.join(TOP, "driver", "robustness_files")
+POST_HEADER = os.path.join(ROBUSTNESS, "header_for_post")
+SOCKET_TIMEOUT = 5
+QUIET_SECS = 1  # Idle time before a sample, for the requests of the round to be over
+ALL = 1 << 30  # Read until the proxy closes
+
+# Valid load, cache hits and misses of all framings and sizes
+MIX = ",".join(["hit%d?size=2k" % i for i in range(16)] + [
+    "miss?size=64k&cache=no-store*4",
+    "big?size=1m*2",
+    "chunked?size=32k&chunked=4096&cache=no-store*2",
+    "slow?size=4k&delay=20&dist=exp&cache=no-store*2",
+    "POST:upload?size=16*4",
+])
+
+# Metrics sampled, and how much the last third of the rounds may be above the first
+METRICS = [("rss_kb", "resident memory (KB)", 0.02),
+           ("fds", "open fds", 0),
+           ("threads", "threads", 0),
+           ("accounted", "accounted memory (bytes)", 0.02)]
+
+
+def exchange(port, data, read=ALL, linger=False):
+    """Sends data to the proxy and reads up to read bytes of the answer, all of it by default."""
+    s = socket.create_connection(("localhost", port), timeout=SOCKET_TIMEOUT)
+    try:
+        if linger:
+            # Closing sends a reset rather than a FIN
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, b"\1\0\0\0\0\0\0\0")
+        if data:
+            s.sendall(data)
+        out = b""
+        while read and len(out) < read:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            out += chunk
+        return out
+    except OSError:
+        return b""
+    finally:
+        s.close()
+
+
+def malformed(proxy_port, origin_port, stopping):
+    files = [f for f in sorted(glob.glob(os.path.join(ROBUSTNESS, "*"))) if f != POST_HEADER]
+    payloads = [open(f, "rb").read().replace(b"TINYPORT", str(origin_port).encode()) for f in files]
+    while not stopping.is_set():
+        for p in payloads:
+            exchange(proxy_port, p)
+
+
+def aborted(proxy_port, origin_port, stopping):
+    url = "http://localhost:%d/" % origin_port
+    header = open(POST_HEADER, "rb").read().replace(b"TINYPORT", str(origin_port).encode())
+
+    def get(path, version="1.1"):
+        return ("GET %s%s HTTP/%s\r\nHost: localhost\r\n\r\n" % (url, path, version)).encode()
+
+    kinds = [
+        # Clients going away before, while and after sending their request
+        lambda: exchange(proxy_port, b"", read=False),
+        lambda: exchange(proxy_port, b"GET " + url.encode(), read=False),
+        lambda: exchange(proxy_port, get("gone?size=4k&cache=no-store"), read=False, linger=True),
+        lambda: exchange(proxy_port, header + b"x" * 10240, read=False),
+        lambda: exchange(proxy_port, get("again?size=8k") * 3, read=100),
+        # Clients going away in the middle of the response
+        lambda: exchange(proxy_port, get("large?size=1m&cache=no-store"), read=4096, linger=True),
+        lambda: exchange(proxy_port, get("cached?size=256k"), read=4096, linger=True),
+        # The origin going away in the middle of the response
+        lambda: exchange(proxy_port, get("cut?size=256k&abort=1&abort_at=65536&cache=no-store")),
+        lambda: exchange(proxy_port, get("cutc?size=256k&chunked=8192&abort=1&cache=no-store")),
+        # Heads too large, hosts that don't resolve and a server that isn't there
+        lambda: exchange(proxy_port, get("huge", "1.0")[:-2] + b"X-Pad: " + b"x" * 70000 + b"\r\n\r\n"),
+        lambda: exchange(proxy_port, b"GET http://h%08x.invalid/ HTTP/1.0\r\n\r\n" % random.getrandbits(32)),
+        lambda: exchange(proxy_port, b"GET http://localhost:1/ HTTP/1.0\r\n\r\n"),
+    ]
+    while not stopping.is_set():
+        for kind in kinds:
+            kind()
+
+
+def stats(proxy_port):
+    """Fetches the proxy's stats, returns the total of proxy_memory_bytes"""
+    out = exchange(proxy_port, b"GET http://proxy.local/__stats HTTP/1.0\r\n\r\n")
+    return sum(int(m) for m in re.findall(rb"^proxy_memory_bytes\{[^}]*\} (\d+)", out, re.M))
+
+
+def sample(proxy, proxy_port):
+    with open("/proc/%d/status" % proxy.pid) as f:
+        status = f.read()
+    return {"rss_kb": int(re.search(r"VmRSS:\s+(\d+)", status).group(1)),
+            "fds": len(os.listdir("/proc/%d/fd" % proxy.pid)),
+            "threads": int(re.search(r"Threads:\s+(\d+)", status).group(1)),
+            "accounted": stats(proxy_port)}
+
+
+def run_round(secs, proxy_port, origin_port):
+    """Runs one round of load, returns loadgen's report"""
+    stopping = threading.Event()
+    threads = [threading.Thread(target=f, args=(proxy_port, origin_port, stopping))
+               for f in (malformed, malformed, aborted, aborted)]
+    for t in threads:
+        t.start()
+    out = subprocess.run([LOADGEN, "-c", "8", "-d", str(secs), "-w", "0", "-b", "8192", "-m", MIX,
+                          "-x", "localhost:%d" % proxy_port, "localhost:%d" % origin_port],
+                         stdout=subprocess.PIPE)
+    stopping.set()
+    for t in threads:
+        t.join()
+    return json.loads(out.stdout) if out.returncode == 0 else None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Proxy soak test")
+    parser.add_argument("-d", "--duration", type=float, default=600, help="seconds of load in all")
+    parser.add_argument("-r", "--round", type=float, default=10, help="seconds of load between samples")
+    parser.add_argument("-w", "--warmup", type=int, default=3,
+                        help="rounds left out of the trend, while the cache and pools fill")
+    parser.add_argument("-o", "--output", help="CSV file the samples are written to")
+    opts = parser.parse_args()
+
+    check_binaries(PROXY, ORIGIN, LOADGEN)
+    rounds = max(int(opts.duration / opts.round), opts.warmup + 3)
+    origin, origin_port = start_listener("origin", [ORIGIN])
+    proxy, proxy_port = start_listener("proxy", [PROXY, "-l", os.devnull])
+    samples, failed = [], []
+    csv = open(opts.output, "w") if opts.output else None
+    if csv:
+        csv.write("round,elapsed_s,requests,errors," + ",".join(m for m, _, _ in METRICS) + "\n")
+    start = time.time()
+    print("round elapsed requests errors " + " ".join(m for m, _, _ in METRICS), flush=True)
+    try:
+        for i in range(rounds):
+            report = run_round(opts.round, proxy_port, origin_port)
+            if proxy.poll() is not None:
+                failed.append("the proxy died in round %d" % i)
+                break
+            if report is None:
+                failed.append("loadgen failed in round %d" % i)
+                break
+            if report["errors"]:
+                failed.append("%d valid requests failed in round %d" % (report["errors"], i))
+            time.sleep(QUIET_SECS)
+            s = sample(proxy, proxy_port)
+            samples.append(s)
+            row = [i, int(time.time() - start), report["requests"], report["errors"]] + [s[m] for m, _, _ in METRICS]
+            print(" ".join(str(v) for v in row), flush=True)
+            if csv:
+                csv.write(",".join(str(v) for v in row) + "\n")
+    finally:
+        stop(proxy, origin)
+        if csv:
+            csv.close()
+
+    # Growth is sustained if the least of the last third is above the most of the first one, which
+    # values wandering within bounds (the cache, idle pooled connections) don't do for long
+    measured = samples[opts.warmup:]
+    if not failed and len(measured) >= 3:
+        third = len(measured) // 3
+        for m, what, allowed in METRICS:
+            first = max(s[m] for s in measured[:third])
+            last = min(s[m] for s in measured[-third:])
+            if last > first * (1 + allowed):
+                failed.append("%s grew from %d to at least %d" % (what, first, last))
+
+    for f in failed:
+        print("LEAK " + f if "grew" in f else "FAILED " + f)
+    print("%d rounds, %s" % (len(samples), "FAILED" if failed else "no growth"))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "memacct.h"
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+void arena_init (arena_t *a) {
+  arena_init_tagged (a, 0);
+}
+
+void arena_init_tagged (arena_t *a, int tag) {
+  a->chunks = NULL;
+  a->tag = tag;
+}
+
+static void arena_free (arena_t *a, arena_chunk_t *c) {
+  memacct_add (a->tag, -(long) (sizeof (arena_chunk_t) + c->size));
+  free (c);
+}
+
+/* Adds a chunk of at least n bytes in front of the others. */
+static arena_chunk_t *arena_grow (arena_t *a, size_t n) {
+  size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+  arena_chunk_t *c;
+
+  if (posix_memalign ((void **) &c, ARENA_ALIGN, sizeof (arena_chunk_t) + size) != 0)
+    return NULL;
+  memacct_add (a->tag, sizeof (arena_chunk_t) + size);
+  c->size = size;
+  c->used = 0;
+  c->next = a->chunks;
+  a->chunks = c;
+  return c;
+}
+
+void *arena_alloc (arena_t *a, size_t n) {
+  arena_chunk_t *c = a->chunks;
+  void *p;
+
+  n = ARENA_ROUND (n);
+  if (!c || c->size - c->used < n)
+    if (!(c = arena_grow (a, n)))
+      return NULL;
+
+  p = c->data + c->used;
+  c->used += n;
+  return p;
+}
+
+char *arena_strndup (arena_t *a, const char *s, size_t n) {
+  char *p = arena_alloc (a, n + 1);
+
+  if (p) {
+    memcpy (p, s, n);
+    p[n] = '\0';
+  }
+  return p;
+}
+
+void arena_reset (arena_t *a) {
+  arena_chunk_t *c = a->chunks;
+
+  if (!c)
+    return;
+
+  /* Only the first chunk is kept, if it has the default size */
+  while (c->next) {
+    arena_chunk_t *next = c->next;
+    arena_free (a, c);
+    c = next;
+  }
+  if (c->size != ARENA_CHUNK) {
+    arena_free (a, c);
+    c = NULL;
+  } else
+    c->used = 0;
+  a->chunks = c;
+}
+
+void arena_destroy (arena_t *a) {
+  arena_chunk_t *c = a->chunks;
+
+  while (c) {
+    arena_chunk_t *next = c->next;
+    arena_free (a, c);
+    c = next;
+  }
+  a->chunks = NULL;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+
+#define ARENA_CHUNK 16384     /* Bytes of the chunk an arena keeps across resets */
+#define ARENA_ALIGN 16        /* Alignment of every allocation */
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size, used;
+  char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+} arena_chunk_t;
+
+/*
+ * A bump allocator for data that all dies at once, such as everything built
+ * for one request.  Allocating is a pointer increment; nothing is freed on
+ * its own, arena_reset frees it all in one go.  Not thread-safe: each thread
+ * uses its own arena.
+ */
+typedef struct {
+  arena_chunk_t *chunks;     /* Current chunk first, the first one allocated last */
+  int tag;                   /* Its chunks are counted for this memacct tag */
+} arena_t;
+
+/*
+ * Prepares an empty arena, it allocates nothing until it is used.
+ */
+void    arena_init (arena_t *a);
+
+/*
+ * Like arena_init, counting the arena's chunks for memacct tag.
+ */
+void    arena_init_tagged (arena_t *a, int tag);
+
+/*
+ * Returns n bytes aligned on ARENA_ALIGN, valid until the next reset.
+ */
+void   *arena_alloc (arena_t *a, size_t n);
+
+/*
+ * Returns a 0-terminated copy of the n bytes at s.
+ */
+char   *arena_strndup (arena_t *a, const char *s, size_t n);
+
+/*
+ * Frees everything allocated from the arena.  Its first chunk is kept for the
+ * next use, unless it was oversized, so an arena reused for small requests
+ * never calls malloc again.
+ */
+void    arena_reset (arena_t *a);
+
+/*
+ * Frees the arena's memory, including the chunk kept by arena_reset.
+ */
+void    arena_destroy (arena_t *a);
@@ -1,4 +1,7 @@
+#include <poll.h>
 #include "csapp.h"
+#include "dns.h"
+#include "scan.h"
 
 /**************************
  * Error-handling functions
@@ -726,16 +729,10 @@ ssize_t rio_writen (int fd, const void *usrbuf, size_t n) {
 
 
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_refill - Refill the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes, 0 on EOF or -1 on error.
  */
-static ssize_t rio_read (rio_t *rp, char *usrbuf, size_t n) {
-  int cnt;
-
+static ssize_t rio_refill (rio_t *rp) {
   while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
     rp->rio_cnt = read (rp->rio_fd, rp->rio_buf,
                         sizeof (rp->rio_buf));
@@ -748,12 +745,26 @@ static ssize_t rio_read (rio_t *rp, char *usrbuf, size_t n) {
     else
       rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
   }
+  return rp->rio_cnt;
+}
 
-  /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-  cnt = n;
+/*
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+static ssize_t rio_read (rio_t *rp, char *usrbuf, size_t n) {
+  int cnt;
 
-  if (rp->rio_cnt < n)
-    cnt = rp->rio_cnt;
+  if ((cnt = rio_refill (rp)) <= 0)
+    return cnt;
+
+  /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
+  if (rp->rio_cnt > n)
+    cnt = n;
 
   memcpy (usrbuf, rp->rio_bufptr, cnt);
   rp->rio_bufptr += cnt;
@@ -792,31 +803,157 @@ ssize_t rio_readnb (rio_t *rp, void *usrbuf, size_t n) {
 }
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readsomeb - Read at most n bytes, returning as soon as some are
+ *    available (buffered). Useful to stream data as it arrives.
+ */
+ssize_t rio_readsomeb (rio_t *rp, void *usrbuf, size_t n) {
+  return rio_read (rp, usrbuf, n);
+}
+
+/*
+ * rio_fillb - Read more bytes into the internal buffer, after the unread
+ *    ones which are first moved to its start, so a caller can parse them in
+ *    place. Returns the number of bytes read, 0 on EOF, -1 on error with
+ *    errno set to ENOBUFS if the buffer is already full of unread bytes.
+ */
+ssize_t rio_fillb (rio_t *rp) {
+  ssize_t rc;
+
+  if (rp->rio_cnt < 0)
+    rp->rio_cnt = 0;
+  if (rp->rio_bufptr != rp->rio_buf) {
+    memmove (rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+  }
+  if (rp->rio_cnt == sizeof (rp->rio_buf)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  while ((rc = read (rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                     sizeof (rp->rio_buf) - rp->rio_cnt)) < 0)
+    if (errno != EINTR) /* Interrupted by sig handler return */
+      return -1;
+  rp->rio_cnt += rc;
+  return rc;
+}
+
+/*
+ * rio_peekb - Set *bufp to the unread bytes, refilling the internal buffer
+ *    first if there are none, and return their number: 0 on EOF, -1 on
+ *    error. They stay unread until rio_consumeb, so they can be written out
+ *    without being copied.
+ */
+ssize_t rio_peekb (rio_t *rp, char **bufp) {
+  ssize_t rc;
+
+  if ((rc = rio_refill (rp)) > 0)
+    *bufp = rp->rio_bufptr;
+  return rc;
+}
+
+/*
+ * rio_getlineb - Read a text line where it is in the internal buffer, without
+ *    copying it. *linep is valid until the next read from rp. Returns the
+ *    length of the line with its line feed, which the last line before EOF
+ *    may lack, 0 on EOF, or -1 on error with errno set to ENOBUFS if the
+ *    line is longer than the buffer.
+ */
+ssize_t rio_getlineb (rio_t *rp, char **linep) {
+  const char *eol;
+  size_t scanned = 0;
+  ssize_t rc, n;
+
+  while (1) {
+    if (rp->rio_cnt > 0 &&
+        (eol = scan_eol (rp->rio_bufptr + scanned, rp->rio_cnt - scanned))) {
+      n = eol - rp->rio_bufptr + 1;
+      break;
+    }
+    /* Bytes already scanned are not scanned again after the refill */
+    if (rp->rio_cnt > 0)
+      scanned = rp->rio_cnt;
+    if ((rc = rio_fillb (rp)) < 0)
+      return -1;
+    if (rc == 0) {
+      if (rp->rio_cnt <= 0)
+        return 0;         /* EOF, no data read */
+      n = rp->rio_cnt;    /* EOF, some data was read */
+      break;
+    }
+  }
+
+  *linep = rp->rio_bufptr;
+  rp->rio_bufptr += n;
+  rp->rio_cnt -= n;
+  return n;
+}
+
+/*
+ * rio_consumeb - Drop the first n unread bytes, parsed in place by the caller
+ */
+void rio_consumeb (rio_t *rp, size_t n) {
+  rp->rio_bufptr += n;
+  rp->rio_cnt -= n;
+}
+
+/*
+ * rio_unreadb - Put n bytes back in front of the unread ones, they will be
+ *    the next read. Returns 0, or -1 if they don't fit in the buffer.
+ */
+int rio_unreadb (rio_t *rp, const void *usrbuf, size_t n) {
+  if (rp->rio_cnt < 0)
+    rp->rio_cnt = 0;
+  if (n + rp->rio_cnt > sizeof (rp->rio_buf)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  memmove (rp->rio_buf + n, rp->rio_bufptr, rp->rio_cnt);
+  memcpy (rp->rio_buf, usrbuf, n);
+  rp->rio_bufptr = rp->rio_buf;
+  rp->rio_cnt += n;
+  return 0;
+}
+
+/*
+ * rio_readlineb - Robustly read a text line (buffered). The buffered bytes
+ *    are scanned for the line feed and copied at once.
  */
 ssize_t rio_readlineb (rio_t *rp, void *usrbuf, size_t maxlen) {
-  int n, rc;
-  char c, *bufp = usrbuf;
+  char *bufp = usrbuf;
+  const char *eol = NULL;
+  size_t n = 0, cnt;
+  ssize_t rc;
 
-  for (n = 1; n < maxlen; n++) {
-    if ((rc = rio_read (rp, &c, 1)) == 1) {
-      *bufp++ = c;
+  if (maxlen == 0)
+    return 0;
 
-      if (c == '\n') {
-        n++;
-        break;
-      }
-    } else if (rc == 0) {
-      if (n == 1)
-        return 0; /* EOF, no data read */
+  while (!eol && n + 1 < maxlen) {
+    if ((rc = rio_refill (rp)) < 0)
+      return -1;          /* Error */
+    else if (rc == 0) {
+      if (n == 0)
+        return 0;         /* EOF, no data read */
       else
-        break;    /* EOF, some data was read */
-    } else
-      return -1;	  /* Error */
+        break;            /* EOF, some data was read */
+    }
+
+    /* Copy up to the line feed, or as much as fits */
+    cnt = rp->rio_cnt;
+    if (cnt > maxlen - 1 - n)
+      cnt = maxlen - 1 - n;
+    if ((eol = scan_eol (rp->rio_bufptr, cnt)))
+      cnt = eol - rp->rio_bufptr + 1;
+
+    memcpy (bufp, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    bufp += cnt;
+    n += cnt;
   }
 
   *bufp = 0;
-  return n - 1;
+  return n;
 }
 
 /**********************************
@@ -861,53 +998,147 @@ ssize_t Rio_readlineb (rio_t *rp, void *usrbuf, size_t maxlen) {
 /********************************
  * Client/server helper functions
  ********************************/
+/* Milliseconds on the monotonic clock */
+static long now_ms () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
 /*
- * open_clientfd - Open connection to server at <hostname, port> and
- *     return a socket descriptor ready for reading and writing. This
- *     function is reentrant and protocol-independent.
+ * open_clientfd_timeout - Open connection to server at <hostname, port>
+ *     within timeout_ms milliseconds and return a (blocking) socket
+ *     descriptor ready for reading and writing.
+ *
+ *     Addresses are tried Happy Eyeballs style (RFC 8305): families are
+ *     interleaved and a new nonblocking connect is started every
+ *     CONNECT_ATTEMPT_DELAY ms, or as soon as the previous ones failed,
+ *     while the earlier ones are still in flight. The first to connect
+ *     wins and the others are abandoned, so one blackholed address costs
+ *     at most CONNECT_ATTEMPT_DELAY ms.
  *
  *     On error, returns:
  *       -2 for getaddrinfo error
- *       -1 with errno set for other errors.
+ *       -1 with errno set for other errors (ETIMEDOUT past the deadline).
  */
-int open_clientfd (char *hostname, char *port) {
-  int clientfd, rc;
-  struct addrinfo hints, *listp, *p;
-
-  /* Get a list of potential server addresses */
-  memset (&hints, 0, sizeof (struct addrinfo));
-  hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
-  hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
-  hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
-
-  if ((rc = getaddrinfo (hostname, port, &hints, &listp)) != 0) {
+int open_clientfd_timeout (char *hostname, char *port, int timeout_ms) {
+  dns_addr_t addrs[DNS_MAX_ADDRS], *order[DNS_MAX_ADDRS];
+  dns_addr_t *first[DNS_MAX_ADDRS], *other[DNS_MAX_ADDRS];
+  struct pollfd pfds[DNS_MAX_ADDRS];
+  int n, na, nb, rc, i, j, next = 0, inflight = 0, clientfd = -1, err = ECONNREFUSED;
+  long now, deadline, next_start;
+  socklen_t errlen;
+
+  /* Get a list of potential server addresses, usually from the resolution cache */
+  if ((n = dns_resolve (hostname, port, addrs, DNS_MAX_ADDRS, &rc)) < 0) {
     fprintf (stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror (rc));
     return -2;
   }
 
-  /* Walk the list for one that we can successfully connect to */
-  for (p = listp; p; p = p->ai_next) {
-    /* Create a socket descriptor */
-    if ((clientfd = socket (p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
-      continue; /* Socket failed, try the next */
+  /* Interleave the families, keeping the resolver's preference within each */
+  for (i = 0, na = 0, nb = 0; i < n; i++) {
+    if (addrs[i].family == addrs[0].family)
+      first[na++] = &addrs[i];
+    else
+      other[nb++] = &addrs[i];
+  }
+  for (i = 0, j = 0; j < n; i++) {
+    if (i < na)
+      order[j++] = first[i];
+    if (i < nb)
+      order[j++] = other[i];
+  }
 
-    /* Connect to the server */
-    if (connect (clientfd, p->ai_addr, p->ai_addrlen) != -1)
-      break; /* Success */
+  now = now_ms ();
+  deadline = now + timeout_ms;
+  next_start = now;
 
-    if (close (clientfd) < 0) { /* Connect failed, try another */
-      fprintf (stderr, "open_clientfd: close failed: %s\n", strerror (errno));
-      return -1;
+  while (clientfd < 0) {
+    now = now_ms ();
+
+    /* Start the next attempt when its turn came or nothing else is in flight */
+    if (next < n && (inflight == 0 || now >= next_start)) {
+      dns_addr_t *a = order[next++];
+      int fd;
+
+      next_start = now + CONNECT_ATTEMPT_DELAY;
+      if ((fd = socket (a->family, a->socktype | SOCK_NONBLOCK, a->protocol)) < 0) {
+        err = errno;
+        continue; /* Socket failed, try the next */
+      }
+      if (connect (fd, (SA *) &a->addr, a->addrlen) == 0) {
+        clientfd = fd; /* Connected right away (loopback) */
+        break;
+      }
+      if (errno != EINPROGRESS) {
+        err = errno;
+        close (fd);
+        continue; /* Connect failed, try another */
+      }
+      pfds[inflight].fd = fd;
+      pfds[inflight].events = POLLOUT;
+      inflight++;
+      continue;
+    }
+
+    if (inflight == 0) /* All connects failed */
+      break;
+    if (now >= deadline) {
+      err = ETIMEDOUT;
+      break;
+    }
+
+    /* Wait for an attempt to finish, the next one to start, or the deadline */
+    rc = deadline - now;
+    if (next < n && next_start - now < rc)
+      rc = next_start - now;
+    if (poll (pfds, inflight, rc) < 0 && errno != EINTR) {
+      err = errno;
+      break;
+    }
+
+    for (i = 0; i < inflight && clientfd < 0;) {
+      if (!pfds[i].revents) {
+        i++;
+        continue;
+      }
+      errlen = sizeof (rc);
+      if (getsockopt (pfds[i].fd, SOL_SOCKET, SO_ERROR, &rc, &errlen) == 0 && rc == 0) {
+        clientfd = pfds[i].fd;
+      } else {
+        err = rc ? rc : errno;
+        close (pfds[i].fd);
+      }
+      pfds[i] = pfds[--inflight];
     }
   }
 
-  /* Clean up */
-  freeaddrinfo (listp);
+  /* Abandon the attempts still in flight */
+  for (i = 0; i < inflight; i++)
+    close (pfds[i].fd);
 
-  if (!p) /* All connects failed */
+  if (clientfd < 0) {
+    errno = err;
     return -1;
-  else    /* The last connect succeeded */
-    return clientfd;
+  }
+
+  /* The caller uses blocking I/O */
+  fcntl (clientfd, F_SETFL, fcntl (clientfd, F_GETFL) & ~O_NONBLOCK);
+  return clientfd;
+}
+
+/*
+ * open_clientfd - Open connection to server at <hostname, port> and
+ *     return a socket descriptor ready for reading and writing. This
+ *     function is reentrant and protocol-independent. Gives up after
+ *     CONNECT_TIMEOUT ms.
+ *
+ *     On error, returns:
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors.
+ */
+int open_clientfd (char *hostname, char *port) {
+  return open_clientfd_timeout (hostname, port, CONNECT_TIMEOUT);
 }
 
 /*
@@ -39,6 +39,8 @@ typedef struct {
 
 /* Misc constants */
 #define	MAXLINE	 RIO_BUFSIZE  /* Max text line length */
+#define CONNECT_TIMEOUT 3000      /* Default ms open_clientfd waits for a connection */
+#define CONNECT_ATTEMPT_DELAY 250 /* Ms before racing the next address (RFC 8305) */
 
 /* Pthreads thread control wrappers */
 void Pthread_create(pthread_t *tidp, pthread_attr_t *attrp,
@@ -59,9 +61,16 @@ void rio_readinitb(rio_t *rp, int fd);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 ssize_t rio_readflushb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t rio_fillb(rio_t *rp);
+ssize_t rio_peekb(rio_t *rp, char **bufp);
+ssize_t rio_getlineb(rio_t *rp, char **linep);
+void rio_consumeb(rio_t *rp, size_t n);
+int rio_unreadb(rio_t *rp, const void *usrbuf, size_t n);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms);
 int open_listenfd(char *port);
 
 /* Wrappers */
@@ -1,78 +1,216 @@
 #include "dict.h"
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+#define DICT_MIN_SLOTS 16
+
+/* FNV-1a of the key with ASCII letters folded to lower case. */
+static unsigned dict_hash (const char *key, size_t key_len) {
+  unsigned h = 2166136261u;
+
+  for (size_t i = 0; i < key_len; i++) {
+    unsigned char c = key[i];
+    if (c >= 'A' && c <= 'Z')
+      c |= 0x20;
+    h = (h ^ c) * 16777619u;
+  }
+  return h;
+}
+
+static void *dict_alloc (const dict_t *dic, size_t n) {
+  return dic->arena ? arena_alloc (dic->arena, n) : malloc (n);
+}
+
+static void dict_free (const dict_t *dic, void *p) {
+  if (!dic->arena)
+    free (p);
+}
+
+static char *dict_strndup (const dict_t *dic, const char *s, size_t n) {
+  return dic->arena ? arena_strndup (dic->arena, s, n) : strndup (s, n);
+}
+
+static void dict_init (dict_t *dic, arena_t *arena) {
+  dic->entries = NULL;
+  dic->used = dic->cap = 0;
+  dic->index = NULL;
+  dic->nslots = 0;
+  dic->size = 0;
+  dic->arena = arena;
+}
 
 dict_t *dict_create () {
   dict_t *ret = malloc (sizeof (dict_t));
-  ret->dic_list = NULL;
-  ret->size = 0;
+  if (ret)
+    dict_init (ret, NULL);
+  return ret;
+}
+
+dict_t *dict_create_arena (arena_t *arena) {
+  dict_t *ret = arena_alloc (arena, sizeof (dict_t));
+  if (ret)
+    dict_init (ret, arena);
   return ret;
 }
 
 void dict_destroy (dict_t *dic) {
-  dict_list_t *el = dic->dic_list;
-
-  while (el) {
-    dict_list_t *next = el->next;
-    free (el->key);
-    free (el->val);
-    free (el);
-    el = next;
+  if (dic->arena)
+    return;
+  for (size_t i = 0; i < dic->used; i++) {
+    free (dic->entries[i].key);
+    free (dic->entries[i].val);
   }
-  dic->dic_list = NULL;
+  free (dic->entries);
+  free (dic->index);
   free (dic);
 }
 
-static dict_list_t *dict_find_elt (const dict_t *dic, const char *key) {
-  dict_list_t *el;
-
-  for (el = dic->dic_list; el && (strcasecmp (el->key, key) != 0);
-       el = el->next)
-    ;
-  return el;
+/* Returns the number of the entry for key, or -1 with *pslot set to the empty
+   slot where it would go in the index. */
+static long dict_find_elt (const dict_t *dic, const char *key, size_t key_len,
+                           unsigned h, size_t *pslot) {
+  size_t mask = dic->nslots - 1;
+
+  if (dic->nslots == 0)
+    return -1;
+
+  for (size_t i = h & mask;; i = (i + 1) & mask) {
+    int e = dic->index[i];
+    const dict_entry_t *el;
+
+    if (e < 0) {
+      if (pslot)
+        *pslot = i;
+      return -1;
+    }
+    el = &dic->entries[e];
+    if (el->key && el->hash == h && strncasecmp (el->key, key, key_len) == 0
+        && el->key[key_len] == '\0')
+      return e;
+  }
 }
 
-void dict_putn (dict_t *dic, const char *key, const char *val, size_t val_len) {
-  if (val == NULL) {
-    dict_del (dic, key);
-    return;
+/* Drops the deleted entries and rebuilds the index, large enough for twice
+   the live entries.  Returns -1, with the dict unchanged, if memory ran out. */
+static int dict_rehash (dict_t *dic) {
+  size_t nslots = DICT_MIN_SLOTS, n = 0;
+  dict_entry_t *entries;
+  int *index;
+
+  while (nslots * 2 / 3 < (dic->size + 1) * 2)
+    nslots <<= 1;
+
+  entries = dict_alloc (dic, nslots * 2 / 3 * sizeof (dict_entry_t));
+  index = dict_alloc (dic, nslots * sizeof (int));
+  if (!entries || !index) {
+    dict_free (dic, entries);
+    dict_free (dic, index);
+    return -1;
   }
-
-  dict_list_t *el = dict_find_elt (dic, key);
-
-  if (el) {
-    free (el->val);
-    el->val = malloc (val_len);
-    el->val_len = val_len;
-    memcpy (el->val, val, val_len);
-    return;
+  for (size_t i = 0; i < dic->used; i++)
+    if (dic->entries[i].key)
+      entries[n++] = dic->entries[i];
+  dict_free (dic, dic->entries);
+  dict_free (dic, dic->index);
+
+  dic->entries = entries;
+  dic->used = n;
+  dic->cap = nslots * 2 / 3;
+  dic->nslots = nslots;
+  dic->index = index;
+  memset (dic->index, 0xff, nslots * sizeof (int));
+  for (size_t e = 0; e < n; e++) {
+    size_t i = entries[e].hash & (nslots - 1);
+    while (dic->index[i] >= 0)
+      i = (i + 1) & (nslots - 1);
+    dic->index[i] = e;
   }
+  return 0;
+}
 
-  el = malloc (sizeof (dict_list_t));
+/* Appends a new entry, key and val are taken over.  Returns -1 if memory ran
+   out making room for it. */
+static int dict_append (dict_t *dic, char *key, unsigned h, char *val, size_t val_len,
+                        size_t slot) {
+  dict_entry_t *el;
 
-  el->key = strdup (key);
-  el->val = malloc (val_len);
+  if (dic->used == dic->cap) {
+    if (dict_rehash (dic) < 0)
+      return -1;
+    dict_find_elt (dic, key, strlen (key), h, &slot);
+  }
+  el = &dic->entries[dic->used];
+  el->key = key;
+  el->val = val;
   el->val_len = val_len;
-  memcpy (el->val, val, val_len);
-  el->next = dic->dic_list;
-  el->prev = NULL;
-  if (dic->dic_list)
-    dic->dic_list->prev = el;
-  dic->dic_list = el;
+  el->hash = h;
+  dic->index[slot] = dic->used++;
   dic->size++;
+  return 0;
 }
 
-void dict_put (dict_t *dic, const char *key, const char *val) {
-  dict_putn (dic, key, val, val ? strlen (val) + 1 : 0);
+/* Puts a copy of key and val, replacing an existing value if replace is set.
+   Returns 1 if the pair was added, 0 if not, -1 if memory ran out. */
+static int dict_set (dict_t *dic, const char *key, size_t key_len,
+                     const char *val, size_t val_len, size_t alloc_len, int replace) {
+  unsigned h = dict_hash (key, key_len);
+  size_t slot = 0;
+  long e = dict_find_elt (dic, key, key_len, h, &slot);
+  char *k, *v;
+
+  if (e >= 0 && !replace)
+    return 0;
+
+  if (!(v = dict_alloc (dic, alloc_len)))
+    return -1;
+  memcpy (v, val, val_len);
+  if (alloc_len > val_len)
+    v[val_len] = '\0';
+
+  if (e >= 0) {
+    dict_free (dic, dic->entries[e].val);
+    dic->entries[e].val = v;
+    dic->entries[e].val_len = alloc_len;
+    return 0;
+  }
+  if (!(k = dict_strndup (dic, key, key_len)) || dict_append (dic, k, h, v, alloc_len, slot) < 0) {
+    dict_free (dic, k);
+    dict_free (dic, v);
+    return -1;
+  }
+  return 1;
 }
 
-char *dict_getn (const dict_t *dic, const char *key, size_t *pval_len) {
-  dict_list_t *el = dict_find_elt (dic, key);
+int dict_putn (dict_t *dic, const char *key, const char *val, size_t val_len) {
+  if (val == NULL) {
+    dict_del (dic, key);
+    return 0;
+  }
+  return dict_set (dic, key, strlen (key), val, val_len, val_len, 1) < 0 ? -1 : 0;
+}
+
+int dict_putkn (dict_t *dic, const char *key, size_t key_len, const char *val, size_t val_len) {
+  return dict_set (dic, key, key_len, val, val_len, val_len + 1, 1) < 0 ? -1 : 0;
+}
+
+int dict_addkn (dict_t *dic, const char *key, size_t key_len, const char *val, size_t val_len) {
+  return dict_set (dic, key, key_len, val, val_len, val_len + 1, 0);
+}
 
-  if (pval_len && el)
-    *pval_len = el->val_len;
+int dict_put (dict_t *dic, const char *key, const char *val) {
+  return dict_putn (dic, key, val, val ? strlen (val) + 1 : 0);
+}
 
-  return el ? el->val : NULL;
+char *dict_getn (const dict_t *dic, const char *key, size_t *pval_len) {
+  size_t key_len = strlen (key);
+  long e = dict_find_elt (dic, key, key_len, dict_hash (key, key_len), NULL);
+
+  if (e < 0)
+    return NULL;
+  if (pval_len)
+    *pval_len = dic->entries[e].val_len;
+  return dic->entries[e].val;
 }
 
 char *dict_get (const dict_t *dic, const char *key) {
@@ -80,21 +218,16 @@ char *dict_get (const dict_t *dic, const char *key) {
 }
 
 void dict_del (dict_t *dic, const char *key) {
-  dict_list_t *el = dict_find_elt (dic, key);
+  size_t key_len = strlen (key);
+  long e = dict_find_elt (dic, key, key_len, dict_hash (key, key_len), NULL);
 
-  if (!el)
+  if (e < 0)
     return;
-  free (el->key);
-  free (el->val);
-  if (el->prev)
-    el->prev->next = el->next;
-  else
-    dic->dic_list = el->next;
-
-  if (el->next)
-    el->next->prev = el->prev;
-
+  /* The index keeps pointing at the entry, lookups probe past it until the
+     next rehash drops it. */
+  dict_free (dic, dic->entries[e].key);
+  dict_free (dic, dic->entries[e].val);
+  dic->entries[e].key = NULL;
+  dic->entries[e].val = NULL;
   dic->size--;
-
-  free (el);
 }
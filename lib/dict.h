@@ -1,14 +1,23 @@
 #pragma once
 
 #include <unistd.h>
+#include "arena.h"
 
 typedef struct dict dict_t;
 
 /*
- * Returns a new empty dictionary. It should be destroyed when not used anymore.
+ * Returns a new empty dictionary, or NULL if memory ran out. It should be
+ * destroyed when not used anymore.
  */
 dict_t *dict_create ();
 
+/*
+ * Returns a new empty dictionary whose memory, keys and values included, comes
+ * from arena.  It lives until the arena is reset; dict_destroy does nothing on
+ * it.  Returns NULL if the arena ran out of memory.
+ */
+dict_t *dict_create_arena (arena_t *arena);
+
 /*
  * Frees a dictionary.
  */
@@ -17,9 +26,10 @@ void    dict_destroy (dict_t *dic);
 /*
  * Put an element in a dictionary.  key is case insensitive, val is a string.
  *   If the key already exists, its value is updated.  If val is NULL, the pair
- *   is deleted.
+ *   is deleted.  Returns 0, or -1 with the dictionary unchanged if memory ran
+ *   out.
  */
-void    dict_put (dict_t *dic, const char *key, const char *val);
+int     dict_put (dict_t *dic, const char *key, const char *val);
 
 /*
  * Returns the value associated with key, or NULL if none.
@@ -43,7 +53,20 @@ static size_t  dict_size (const dict_t *dic);
 /*
  * Same as dict_put, but indicates the length of value.
  */
-void    dict_putn (dict_t *dic, const char *key, const char *val, size_t val_len);
+int     dict_putn (dict_t *dic, const char *key, const char *val, size_t val_len);
+
+/*
+ * Same as dict_put, but key and val are given with their lengths and need not
+ *   be 0-terminated.  Both are stored 0-terminated, as with dict_put.
+ */
+int     dict_putkn (dict_t *dic, const char *key, size_t key_len, const char *val, size_t val_len);
+
+/*
+ * Same as dict_putkn, but an existing value is kept: only the first value put
+ *   for a key counts.  Returns 1 if the pair was added, 0 if key was present,
+ *   -1 if memory ran out.
+ */
+int     dict_addkn (dict_t *dic, const char *key, size_t key_len, const char *val, size_t val_len);
 
 /*
  * Same as dict_get, but sets *pval_len to the length of the value.  If a value
@@ -54,7 +77,9 @@ char   *dict_getn (const dict_t *dic, const char *key, size_t *pval_len);
 
 /* ITERATION ****************************************************************************
  * dict_foreach: iterate through a dictionary, with key and val bound
- * successively to each key/value pair.  The variable len is set to the length of the value.
+ * successively to each key/value pair, in the order the keys were first put.
+ * The variable len is set to the length of the value.  The dictionary must
+ * not be changed while iterating.
  *
  * Example:
  *
@@ -66,7 +91,10 @@ char   *dict_getn (const dict_t *dic, const char *key, size_t *pval_len);
 #define dict_foreach(dic, code)                                         \
   do {                                                                  \
     const dict_t *dict_dic = dic;                                       \
-    for (const dict_list_t *dict_el = dict_dic->dic_list; dict_el; dict_el = dict_el->next) { \
+    for (size_t dict_i = 0; dict_i < dict_dic->used; dict_i++) {        \
+      const dict_entry_t *dict_el = &dict_dic->entries[dict_i];         \
+      if (dict_el->key == NULL)                                         \
+        continue;                                                       \
       const char *key __attribute__((unused)) = dict_el->key;           \
       const char *val __attribute__((unused)) = dict_el->val;           \
       size_t len __attribute__((unused)) = dict_el->val_len;            \
@@ -78,16 +106,26 @@ char   *dict_getn (const dict_t *dic, const char *key, size_t *pval_len);
 /* PRIVATE *******************************************************************
  * The rest of this file should be considered "private"; you should not access
  * the structures directly, but use the functions above.
+ *
+ * Entries are kept in an array in insertion order; a deleted entry keeps its
+ * place with a NULL key until the array is compacted.  Lookups go through an
+ * open-addressed (linear probing) index of entry numbers, keyed by a hash of
+ * the case-folded key that is computed once and stored in the entry.
  */
-typedef struct dict_list {
+typedef struct dict_entry {
     char *key, *val;
     size_t val_len;
-    struct dict_list *next, *prev;
-} dict_list_t;
+    unsigned hash;
+} dict_entry_t;
 
 typedef struct dict {
-    dict_list_t *dic_list;
+    dict_entry_t *entries;
+    size_t used;            /* Entries used, deleted ones included */
+    size_t cap;             /* Entries allocated, 2/3 of the index slots */
+    int *index;             /* Entry numbers, -1 for an empty slot */
+    size_t nslots;          /* A power of 2 */
     size_t size;
+    arena_t *arena;         /* Where memory comes from, NULL for malloc */
 } dict_t;
 
 static inline size_t dict_size (const dict_t *dic) { return dic->size; }
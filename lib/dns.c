@@ -0,0 +1,368 @@
+#include "csapp.h"
+#include "lock.h"
+#include "dns.h"
+
+#define DNS_BUCKETS 256
+#define DNS_REFRESH_QUEUE 64
+
+typedef struct dns_entry {
+  char *host;
+  dns_addr_t addrs[DNS_MAX_ADDRS];
+  int naddrs;
+  int error;          /* getaddrinfo error for a negative entry, 0 otherwise */
+  time_t expires;
+  int hits;           /* Lookups since the last resolution */
+  int refreshing;     /* Queued for the refresher thread */
+  int pinned;         /* From DNS_HOSTS_FILE, never expires */
+  struct dns_entry *next;
+} dns_entry_t;
+
+typedef struct {
+  lock_t lock;                /* Reported as "dns" */
+  dns_entry_t *entries;
+} dns_bucket_t;
+
+static dns_bucket_t buckets[DNS_BUCKETS];
+static int nentries;          /* In all buckets, updated atomically */
+static unsigned evict_hand;   /* Next bucket dns_evict takes an entry from */
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+
+/* Hosts waiting for a background refresh */
+static struct {
+  lock_t lock;                /* Reported as "dnsqueue" */
+  pthread_cond_t nonempty;
+  char *hosts[DNS_REFRESH_QUEUE];
+  int head, count;
+} refresh;
+
+static time_t dns_now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static dns_bucket_t *dns_bucket (const char *host) {
+  unsigned h = 2166136261u;
+
+  for (; *host; host++)
+    h = (h ^ (unsigned char) tolower (*host)) * 16777619u;
+  return &buckets[h % DNS_BUCKETS];
+}
+
+static void dns_free (dns_entry_t *e) {
+  free (e->host);
+  free (e);
+  __atomic_sub_fetch (&nentries, 1, __ATOMIC_RELAXED);
+}
+
+/* Bucket must be locked.  Creating an entry first frees the expired ones of
+   the bucket, so hosts looked up once, names made up by clients among them,
+   don't stay forever; dns_evict then keeps the total under DNS_MAX_ENTRIES.
+   Returns NULL if the entry was not found, or could not be created. */
+static dns_entry_t *dns_find (dns_bucket_t *b, const char *host, int create) {
+  dns_entry_t *e, **pe;
+  time_t now;
+
+  for (e = b->entries; e; e = e->next)
+    if (strcasecmp (e->host, host) == 0)
+      return e;
+  if (!create)
+    return NULL;
+
+  now = dns_now ();
+  for (pe = &b->entries; *pe;) {
+    e = *pe;
+    if (e->pinned || e->refreshing || now < e->expires) {
+      pe = &e->next;
+      continue;
+    }
+    *pe = e->next;
+    dns_free (e);
+  }
+
+  if (!(e = calloc (1, sizeof (dns_entry_t))))
+    return NULL;
+  if (!(e->host = strdup (host))) {
+    free (e);
+    return NULL;
+  }
+  e->next = b->entries;
+  b->entries = e;
+  __atomic_add_fetch (&nentries, 1, __ATOMIC_RELAXED);
+  return e;
+}
+
+/* While there are more than DNS_MAX_ENTRIES, frees the oldest entry of each
+   bucket in turn, so a client making up names can't grow the cache without
+   bound.  Entries are added in front, the oldest is the last one that is not
+   pinned or being refreshed.  No bucket must be locked by the caller. */
+static void dns_evict () {
+  for (int i = 0; i < DNS_BUCKETS &&
+       __atomic_load_n (&nentries, __ATOMIC_RELAXED) > DNS_MAX_ENTRIES; i++) {
+    dns_bucket_t *b = &buckets[__atomic_fetch_add (&evict_hand, 1, __ATOMIC_RELAXED) % DNS_BUCKETS];
+    dns_entry_t **pe, **oldest = NULL;
+
+    lock_acquire (&b->lock);
+    for (pe = &b->entries; *pe; pe = &(*pe)->next)
+      if (!(*pe)->pinned && !(*pe)->refreshing)
+        oldest = pe;
+    if (oldest) {
+      dns_entry_t *e = *oldest;
+      *oldest = e->next;
+      dns_free (e);
+    }
+    lock_release (&b->lock);
+  }
+}
+
+/* Asks the resolver; fills addrs and returns their number, or -1 and *err. */
+static int dns_lookup (const char *host, dns_addr_t *addrs, int *err) {
+  struct addrinfo hints, *listp, *p;
+  int n = 0;
+
+  memset (&hints, 0, sizeof (struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
+  hints.ai_flags = AI_ADDRCONFIG;   /* Recommended for connections */
+
+  if ((*err = getaddrinfo (host, NULL, &hints, &listp)) != 0)
+    return -1;
+
+  for (p = listp; p && n < DNS_MAX_ADDRS; p = p->ai_next, n++) {
+    addrs[n].family = p->ai_family;
+    addrs[n].socktype = p->ai_socktype;
+    addrs[n].protocol = p->ai_protocol;
+    addrs[n].addrlen = p->ai_addrlen;
+    memcpy (&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+  }
+  freeaddrinfo (listp);
+  return n;
+}
+
+/* Stores the outcome of a lookup in the cache.  Returns 0, or -1 if there
+   was no memory for a new entry. */
+static int dns_store (const char *host, dns_addr_t *addrs, int n, int err) {
+  dns_bucket_t *b = dns_bucket (host);
+  dns_entry_t *e;
+
+  lock_acquire (&b->lock);
+  if (!(e = dns_find (b, host, 1))) {
+    lock_release (&b->lock);
+    return -1;
+  }
+  if (!e->pinned) {
+    if (n > 0) {
+      memcpy (e->addrs, addrs, n * sizeof (dns_addr_t));
+      e->naddrs = n;
+      e->error = 0;
+      e->expires = dns_now () + DNS_TTL;
+    } else if (!e->refreshing || e->naddrs == 0) {
+      /* A failed refresh keeps serving the old addresses until they expire */
+      e->naddrs = 0;
+      e->error = err;
+      e->expires = dns_now () + DNS_NEG_TTL;
+    }
+    e->hits = 0;
+    e->refreshing = 0;
+  }
+  lock_release (&b->lock);
+  dns_evict ();
+  return 0;
+}
+
+/* Background thread resolving hot entries before they expire. */
+static void *dns_refresher (void *vargp) {
+  dns_addr_t addrs[DNS_MAX_ADDRS];
+  char *host;
+  int n, err;
+
+  pthread_detach (pthread_self ());
+  while (1) {
+    lock_acquire (&refresh.lock);
+    while (refresh.count == 0)
+      lock_wait (&refresh.lock, &refresh.nonempty);
+    host = refresh.hosts[refresh.head];
+    refresh.head = (refresh.head + 1) % DNS_REFRESH_QUEUE;
+    refresh.count--;
+    lock_release (&refresh.lock);
+
+    n = dns_lookup (host, addrs, &err);
+    dns_store (host, addrs, n, err);
+    free (host);
+  }
+  return NULL;
+}
+
+/* Queues host for the refresher; returns 0 if the queue is full. */
+static int dns_queue_refresh (const char *host) {
+  int queued = 0;
+
+  lock_acquire (&refresh.lock);
+  if (refresh.count < DNS_REFRESH_QUEUE &&
+      (refresh.hosts[(refresh.head + refresh.count) % DNS_REFRESH_QUEUE] = strdup (host))) {
+    refresh.count++;
+    queued = 1;
+    pthread_cond_signal (&refresh.nonempty);
+  }
+  lock_release (&refresh.lock);
+  return queued;
+}
+
+/* Adds "address name..." lines of the DNS_HOSTS_FILE as pinned entries. */
+static void dns_load_hosts (const char *path) {
+  FILE *fp = fopen (path, "r");
+  char line[MAXLINE], *tok, *save;
+  dns_addr_t a;
+
+  if (!fp) {
+    fprintf (stderr, "dns: cannot open %s: %s\n", path, strerror (errno));
+    return;
+  }
+
+  while (fgets (line, sizeof (line), fp)) {
+    if ((tok = strchr (line, '#')))
+      *tok = '\0';
+    if (!(tok = strtok_r (line, " \t\r\n", &save)))
+      continue;
+
+    memset (&a, 0, sizeof (a));
+    a.socktype = SOCK_STREAM;
+    a.protocol = IPPROTO_TCP;
+    if (inet_pton (AF_INET, tok, &((struct sockaddr_in *) &a.addr)->sin_addr) == 1) {
+      a.family = AF_INET;
+      a.addrlen = sizeof (struct sockaddr_in);
+    } else if (inet_pton (AF_INET6, tok, &((struct sockaddr_in6 *) &a.addr)->sin6_addr) == 1) {
+      a.family = AF_INET6;
+      a.addrlen = sizeof (struct sockaddr_in6);
+    } else {
+      fprintf (stderr, "dns: bad address in %s: %s\n", path, tok);
+      continue;
+    }
+    a.addr.ss_family = a.family;
+
+    while ((tok = strtok_r (NULL, " \t\r\n", &save))) {
+      dns_bucket_t *b = dns_bucket (tok);
+      dns_entry_t *e;
+
+      lock_acquire (&b->lock);
+      if (!(e = dns_find (b, tok, 1))) {
+        lock_release (&b->lock);
+        fprintf (stderr, "dns: out of memory for %s in %s\n", tok, path);
+        continue;
+      }
+      if (!e->pinned)
+        e->naddrs = 0;
+      if (e->naddrs < DNS_MAX_ADDRS)
+        e->addrs[e->naddrs++] = a;
+      e->pinned = 1;
+      e->error = 0;
+      lock_release (&b->lock);
+    }
+  }
+  fclose (fp);
+}
+
+static void dns_init () {
+  pthread_t tid;
+  char *hosts;
+
+  for (int i = 0; i < DNS_BUCKETS; i++) {
+    lock_init (&buckets[i].lock, "dns");
+    buckets[i].entries = NULL;
+  }
+  lock_init (&refresh.lock, "dnsqueue");
+  pthread_cond_init (&refresh.nonempty, NULL);
+  refresh.head = refresh.count = 0;
+
+  if ((hosts = getenv ("DNS_HOSTS_FILE")) && *hosts)
+    dns_load_hosts (hosts);
+
+  pthread_create (&tid, NULL, dns_refresher, NULL);
+}
+
+/* Copies at most max of the n addresses in src to addrs, with the port set. */
+static int dns_copy (const dns_addr_t *src, int n, dns_addr_t *addrs, int max, in_port_t port) {
+  if (n > max)
+    n = max;
+
+  for (int i = 0; i < n; i++) {
+    addrs[i] = src[i];
+    if (addrs[i].family == AF_INET)
+      ((struct sockaddr_in *) &addrs[i].addr)->sin_port = port;
+    else if (addrs[i].family == AF_INET6)
+      ((struct sockaddr_in6 *) &addrs[i].addr)->sin6_port = port;
+  }
+  return n;
+}
+
+int dns_resolve (const char *host, const char *port, dns_addr_t *addrs, int max,
+                 int *gai_err) {
+  dns_addr_t found[DNS_MAX_ADDRS];
+  dns_bucket_t *b;
+  dns_entry_t *e;
+  time_t now;
+  char *end;
+  long portnum;
+  int n, err;
+
+  pthread_once (&dns_once, dns_init);
+
+  /* Entries are per host, the port is patched in each copy */
+  portnum = strtol (port, &end, 10);
+  if (*port == '\0' || *end != '\0' || portnum < 0 || portnum > 65535) {
+    *gai_err = EAI_SERVICE;
+    return -1;
+  }
+
+  now = dns_now ();
+  b = dns_bucket (host);
+  lock_acquire (&b->lock);
+  e = dns_find (b, host, 0);
+  if (e && (e->pinned || now < e->expires)) {
+    if (e->error) {
+      *gai_err = e->error;
+      lock_release (&b->lock);
+      return -1;
+    }
+    n = dns_copy (e->addrs, e->naddrs, addrs, max, htons (portnum));
+    if (!e->pinned && !e->refreshing && ++e->hits >= DNS_HOT_HITS &&
+        now >= e->expires - DNS_REFRESH_AHEAD)
+      e->refreshing = dns_queue_refresh (host);
+    lock_release (&b->lock);
+    return n;
+  }
+  lock_release (&b->lock);
+
+  /* Miss or expired: resolve in this thread */
+  n = dns_lookup (host, found, &err);
+  if (dns_store (host, found, n, err) < 0) {
+    *gai_err = EAI_MEMORY;
+    return -1;
+  }
+  if (n < 0) {
+    *gai_err = err;
+    return -1;
+  }
+  return dns_copy (found, n, addrs, max, htons (portnum));
+}
+
+void dns_flush () {
+  pthread_once (&dns_once, dns_init);
+
+  for (int i = 0; i < DNS_BUCKETS; i++) {
+    dns_bucket_t *b = &buckets[i];
+    dns_entry_t **pe;
+
+    lock_acquire (&b->lock);
+    for (pe = &b->entries; *pe;) {
+      dns_entry_t *e = *pe;
+
+      if (e->pinned || e->refreshing) {
+        pe = &e->next;
+        continue;
+      }
+      *pe = e->next;
+      dns_free (e);
+    }
+    lock_release (&b->lock);
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <sys/socket.h>
+
+#define DNS_MAX_ADDRS 8        /* Addresses kept per host */
+#define DNS_TTL 30             /* Seconds a successful resolution is trusted */
+#define DNS_NEG_TTL 5          /* Seconds a failed resolution is remembered */
+#define DNS_REFRESH_AHEAD 10   /* Hot entries are refreshed this many seconds before they expire */
+#define DNS_HOT_HITS 4         /* Lookups since the last resolution for an entry to count as hot */
+#define DNS_MAX_ENTRIES 1024   /* Hosts cached, beyond which the oldest are evicted */
+
+/*
+ * One resolved address, enough to create a socket and connect it.
+ */
+typedef struct {
+  int family, socktype, protocol;
+  socklen_t addrlen;
+  struct sockaddr_storage addr;
+} dns_addr_t;
+
+/*
+ * Resolves host for a TCP connection to the numeric port and fills at most
+ * max addresses, in the order getaddrinfo returned them.  Results, including
+ * failures, are cached; hot entries are refreshed in the background before
+ * they expire so lookups never wait on the resolver for them.
+ *
+ * If the environment variable DNS_HOSTS_FILE names a file in /etc/hosts
+ * format, the names in it resolve to the given addresses and never expire.
+ *
+ * Returns the number of addresses, or -1 if host cannot be resolved, in which
+ * case *gai_err is set to the getaddrinfo error code, EAI_MEMORY if there was
+ * no memory left to cache the result.
+ */
+int dns_resolve (const char *host, const char *port, dns_addr_t *addrs, int max,
+                 int *gai_err);
+
+/*
+ * Forgets everything cached except the entries of DNS_HOSTS_FILE.
+ */
+void dns_flush ();
@@ -0,0 +1,75 @@
+#include <string.h>
+#include "hist.h"
+
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+void hist_reset (hist_t *h) {
+  memset (h, 0, sizeof (hist_t));
+}
+
+/* Values below 2 * HIST_SUB have a bucket each, above that every power of
+   two is split in HIST_SUB buckets. */
+int hist_bucket (uint64_t v) {
+  int e;
+
+  if (v < 2 * HIST_SUB)
+    return v;
+  if (v >> HIST_MAX_BITS)
+    return HIST_BUCKETS - 1;
+  e = 63 - __builtin_clzll (v);
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int) (v >> (e - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+uint64_t hist_bucket_max (int b) {
+  int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  uint64_t sub = (b & (HIST_SUB - 1)) + HIST_SUB;
+
+  if (b < 2 * HIST_SUB)
+    return b;
+  return ((sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/* Single writer: plain reads of its own counters, atomic stores so that
+   readers never see half of one. */
+#define HIST_BUMP(field, by) \
+  __atomic_store_n (&(field), (field) + (by), __ATOMIC_RELAXED)
+
+void hist_record (hist_t *h, uint64_t v) {
+  HIST_BUMP (h->buckets[hist_bucket (v)], 1);
+  HIST_BUMP (h->sum, v);
+  if (v > h->max)
+    __atomic_store_n (&h->max, v, __ATOMIC_RELAXED);
+  /* Last, so a reader finding count samples finds their buckets too */
+  __atomic_store_n (&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+void hist_merge (hist_t *dst, const hist_t *src) {
+  uint64_t max = __atomic_load_n (&src->max, __ATOMIC_RELAXED);
+
+  dst->count += __atomic_load_n (&src->count, __ATOMIC_ACQUIRE);
+  dst->sum += __atomic_load_n (&src->sum, __ATOMIC_RELAXED);
+  if (max > dst->max)
+    dst->max = max;
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    dst->buckets[b] += __atomic_load_n (&src->buckets[b], __ATOMIC_RELAXED);
+}
+
+uint64_t hist_quantile (const hist_t *h, double q) {
+  uint64_t total = 0, rank, seen = 0;
+
+  /* The buckets are summed rather than trusting count, which a merge of
+     counters read at different times may not match exactly. */
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    total += h->buckets[b];
+  if (total == 0)
+    return 0;
+  rank = (uint64_t) (q * total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank)
+      return hist_bucket_max (b) < h->max ? hist_bucket_max (b) : h->max;
+  }
+  return h->max;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4       /* 16 buckets per power of two, values are off by at most 1/16 */
+#define HIST_MAX_BITS 40      /* Values up to 2^40 (18 minutes in ns), larger ones count as the largest */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/*
+ * A histogram with logarithmic buckets, in the manner of HdrHistogram: the
+ * relative precision is the same whether values are nanoseconds or minutes,
+ * and recording is an index computation and an increment.
+ *
+ * One thread records into a histogram while others may read it without a
+ * lock: each counter is only written by that thread, with single atomic
+ * stores.  Readers see each counter whole, though not all of them as of the
+ * same instant.
+ */
+typedef struct {
+  uint64_t count;             /* Values recorded */
+  uint64_t sum;               /* Their sum, for the mean */
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+/*
+ * Empties h.
+ */
+void     hist_reset (hist_t *h);
+
+/*
+ * Records value v, only ever from the thread that owns h.
+ */
+void     hist_record (hist_t *h, uint64_t v);
+
+/*
+ * Adds the values recorded in src to dst.  src may be recorded into while
+ * this runs.
+ */
+void     hist_merge (hist_t *dst, const hist_t *src);
+
+/*
+ * Returns the value at quantile q (0.5 for the median, 0.999...) as the
+ * largest value of its bucket, or 0 if h is empty.
+ */
+uint64_t hist_quantile (const hist_t *h, double q);
+
+/*
+ * Returns the bucket counting v, and the largest value counted by bucket b.
+ */
+int      hist_bucket (uint64_t v);
+uint64_t hist_bucket_max (int b);
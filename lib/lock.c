@@ -0,0 +1,116 @@
+#include <string.h>
+#include <time.h>
+#include "lock.h"
+
+static int counting;          /* Set by lock_counting */
+static lock_t *locks;         /* Every lock, walked with locks_mutex held */
+static pthread_mutex_t locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long long lock_now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Only the holder writes the counters, the stores are atomic for readers
+   summing them without the lock. */
+#define LOCK_BUMP(field, by) \
+  __atomic_store_n (&(field), (field) + (by), __ATOMIC_RELAXED)
+
+void lock_counting (int on) {
+  counting = on;
+}
+
+void lock_init (lock_t *l, const char *name) {
+  lock_t *p;
+
+  pthread_mutex_init (&l->mutex, NULL);
+  l->name = name;
+  l->acquisitions = l->contended = l->wait_ns = l->max_hold_ns = 0;
+  pthread_mutex_lock (&locks_mutex);
+  /* Linking a lock already in the list again would make a cycle of it */
+  for (p = locks; p && p != l; p = p->next)
+    ;
+  if (p == NULL) {
+    l->next = locks;
+    locks = l;
+  }
+  pthread_mutex_unlock (&locks_mutex);
+}
+
+void lock_destroy (lock_t *l) {
+  pthread_mutex_lock (&locks_mutex);
+  for (lock_t **pl = &locks; *pl; pl = &(*pl)->next)
+    if (*pl == l) {
+      *pl = l->next;
+      break;
+    }
+  pthread_mutex_unlock (&locks_mutex);
+  pthread_mutex_destroy (&l->mutex);
+}
+
+void lock_acquire (lock_t *l) {
+  if (!counting) {
+    pthread_mutex_lock (&l->mutex);
+    return;
+  }
+  if (pthread_mutex_trylock (&l->mutex) == 0) {
+    l->held_since = lock_now ();
+  } else {
+    long long start = lock_now ();
+    pthread_mutex_lock (&l->mutex);
+    l->held_since = lock_now ();
+    LOCK_BUMP (l->contended, 1);
+    LOCK_BUMP (l->wait_ns, l->held_since - start);
+  }
+  LOCK_BUMP (l->acquisitions, 1);
+}
+
+/* Keeps the longest hold of l, which is about to be let go */
+static void lock_held (lock_t *l) {
+  uint64_t held = lock_now () - l->held_since;
+
+  if (held > l->max_hold_ns)
+    __atomic_store_n (&l->max_hold_ns, held, __ATOMIC_RELAXED);
+}
+
+void lock_release (lock_t *l) {
+  if (counting)
+    lock_held (l);
+  pthread_mutex_unlock (&l->mutex);
+}
+
+void lock_wait (lock_t *l, pthread_cond_t *cond) {
+  if (counting)
+    lock_held (l);
+  pthread_cond_wait (cond, &l->mutex);
+  if (counting)
+    l->held_since = lock_now ();
+}
+
+int lock_stats (lock_stats_t *stats, int max) {
+  int n = 0, i;
+
+  if (!counting)
+    return 0;
+  pthread_mutex_lock (&locks_mutex);
+  for (lock_t *l = locks; l; l = l->next) {
+    uint64_t hold = __atomic_load_n (&l->max_hold_ns, __ATOMIC_RELAXED);
+
+    for (i = 0; i < n && strcmp (stats[i].name, l->name) != 0; i++)
+      ;
+    if (i == n) {
+      if (n == max)
+        continue;
+      memset (&stats[n], 0, sizeof (lock_stats_t));
+      stats[n++].name = l->name;
+    }
+    stats[i].acquisitions += __atomic_load_n (&l->acquisitions, __ATOMIC_RELAXED);
+    stats[i].contended += __atomic_load_n (&l->contended, __ATOMIC_RELAXED);
+    stats[i].wait_ns += __atomic_load_n (&l->wait_ns, __ATOMIC_RELAXED);
+    if (hold > stats[i].max_hold_ns)
+      stats[i].max_hold_ns = hold;
+  }
+  pthread_mutex_unlock (&locks_mutex);
+  return n;
+}
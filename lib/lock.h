@@ -0,0 +1,64 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define LOCK_MAX_NAMES 16     /* Distinct names lock_stats can report */
+
+/*
+ * A mutex that can count how it is used: acquisitions, those that had to
+ * wait because another thread held it, the time spent waiting and the
+ * longest time it was held.  The counters are written by the thread holding
+ * the lock, so keeping them costs no atomic operation, only two clock reads.
+ * Counting is off unless lock_counting turned it on, the locks are then
+ * plain mutexes.  Locks are reported by name, all the locks with the same
+ * name together (e.g. every bucket of a hash table).
+ */
+typedef struct lock {
+  pthread_mutex_t mutex;
+  const char *name;
+  uint64_t acquisitions;
+  uint64_t contended;         /* Acquisitions that found the lock held */
+  uint64_t wait_ns;           /* Time spent waiting for it */
+  uint64_t max_hold_ns;       /* Longest time it was held */
+  long long held_since;
+  struct lock *next;          /* In the list of all locks */
+} lock_t;
+
+/* Counters of all the locks of one name */
+typedef struct {
+  const char *name;
+  uint64_t acquisitions, contended, wait_ns, max_hold_ns;
+} lock_stats_t;
+
+/*
+ * Turns the counters of every lock on or off.  Must be called before any
+ * lock is acquired.
+ */
+void lock_counting (int on);
+
+/*
+ * Prepares l, a static string name says what it protects.  Initializing a
+ * lock again is fine, its counters start over.
+ */
+void lock_init (lock_t *l, const char *name);
+
+/*
+ * Takes l out of the list of locks reported, before its memory is reused.
+ */
+void lock_destroy (lock_t *l);
+
+void lock_acquire (lock_t *l);
+void lock_release (lock_t *l);
+
+/*
+ * pthread_cond_wait on l, which the caller holds.  The time spent waiting
+ * for cond doesn't count as holding l.
+ */
+void lock_wait (lock_t *l, pthread_cond_t *cond);
+
+/*
+ * Sums the counters of the locks by name into stats, which has room for max
+ * names.  Returns the number of names, 0 if counting is off.
+ */
+int  lock_stats (lock_stats_t *stats, int max);
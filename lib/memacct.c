@@ -0,0 +1,35 @@
+#include <stdlib.h>
+#include "memacct.h"
+
+static long memacct[MEMACCT_TAGS];
+
+void memacct_add (int tag, long delta) {
+  __atomic_add_fetch (&memacct[tag], delta, __ATOMIC_RELAXED);
+}
+
+long memacct_bytes (int tag) {
+  return __atomic_load_n (&memacct[tag], __ATOMIC_RELAXED);
+}
+
+void *memacct_malloc (int tag, size_t n) {
+  void *p = malloc (n);
+
+  if (p)
+    memacct_add (tag, n);
+  return p;
+}
+
+void *memacct_realloc (int tag, void *p, size_t old_n, size_t n) {
+  void *q = realloc (p, n);
+
+  if (q)
+    memacct_add (tag, (long) n - (long) old_n);
+  return q;
+}
+
+void memacct_free (int tag, void *p, size_t n) {
+  if (p) {
+    free (p);
+    memacct_add (tag, -(long) n);
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+
+#define MEMACCT_TAGS 16       /* Tags 0 to MEMACCT_TAGS - 1, 0 is for untagged memory */
+
+/*
+ * Bytes in use per tag, for a program to tell which of its parts holds its
+ * memory.  The parts report what they allocate and free themselves, either
+ * with the wrappers below or, for arenas, by giving the arena a tag.
+ * Counting is a relaxed atomic add: allocations are already much slower.
+ */
+
+/*
+ * Adds delta bytes, negative when freed, to tag.
+ */
+void   memacct_add (int tag, long delta);
+
+/*
+ * Returns the bytes counted for tag.
+ */
+long   memacct_bytes (int tag);
+
+/*
+ * malloc, realloc and free counting n bytes, the size of the block, for tag.
+ */
+void  *memacct_malloc (int tag, size_t n);
+void  *memacct_realloc (int tag, void *p, size_t old_n, size_t n);
+void   memacct_free (int tag, void *p, size_t n);
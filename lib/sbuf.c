@@ -7,9 +7,10 @@
 void sbuf_init(sbuf_t *sp, int n)
 {
     sp->buf = calloc(n, sizeof(int));
+    sp->stamps = calloc(n, sizeof(long long));
     sp->n = n;                       /* Buffer holds max of n items */
     sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
-    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    lock_init(&sp->mutex, "sbuf");   /* Counted lock for locking */
     Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
     Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
 }
@@ -20,17 +21,29 @@ void sbuf_init(sbuf_t *sp, int n)
 void sbuf_deinit(sbuf_t *sp)
 {
     free(sp->buf);
+    free(sp->stamps);
+    lock_destroy(&sp->mutex);
 }
 /* $end sbuf_deinit */
 
+/* Monotonic clock in ns, to time how long items wait */
+static long long sbuf_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 /* Insert item onto the rear of shared buffer sp */
 /* $begin sbuf_insert */
 void sbuf_insert(sbuf_t *sp, int item)
 {
+    long long now = sbuf_now();             /* Read before locking */
     P(&sp->slots);                          /* Wait for available slot */
-    P(&sp->mutex);                          /* Lock the buffer */
+    lock_acquire(&sp->mutex);               /* Lock the buffer */
+    sp->stamps[(sp->rear + 1)%(sp->n)] = now;
     sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
-    V(&sp->mutex);                          /* Unlock the buffer */
+    lock_release(&sp->mutex);               /* Unlock the buffer */
     V(&sp->items);                          /* Announce available item */
 }
 /* $end sbuf_insert */
@@ -41,11 +54,26 @@ int sbuf_remove(sbuf_t *sp)
 {
     int item;
     P(&sp->items);                          /* Wait for available item */
-    P(&sp->mutex);                          /* Lock the buffer */
+    lock_acquire(&sp->mutex);               /* Lock the buffer */
     item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
-    V(&sp->mutex);                          /* Unlock the buffer */
+    lock_release(&sp->mutex);               /* Unlock the buffer */
     V(&sp->slots);                          /* Announce available slot */
     return item;
 }
 /* $end sbuf_remove */
+
+/* Like sbuf_remove, also setting *waited_ns to how long the item was in sp */
+int sbuf_remove_waited(sbuf_t *sp, long long *waited_ns)
+{
+    int item;
+    long long stamp;
+    P(&sp->items);                          /* Wait for available item */
+    lock_acquire(&sp->mutex);               /* Lock the buffer */
+    stamp = sp->stamps[(sp->front + 1)%(sp->n)];
+    item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
+    lock_release(&sp->mutex);               /* Unlock the buffer */
+    V(&sp->slots);                          /* Announce available slot */
+    *waited_ns = sbuf_now() - stamp;
+    return item;
+}
 /* $end sbufc */
@@ -1,12 +1,15 @@
 #ifndef __SBUF_H__
 #define __SBUF_H__
 
+#include "lock.h"
+
 typedef struct {
     int *buf;          /* Buffer array */
+    long long *stamps; /* When each item was inserted, in ns (CLOCK_MONOTONIC) */
     int n;             /* Maximum number of slots */
     int front;         /* buf[(front+1)%n] is first item */
     int rear;          /* buf[rear%n] is last item */
-    sem_t mutex;       /* Protects accesses to buf */
+    lock_t mutex;      /* Protects accesses to buf, reported as "sbuf" */
     sem_t slots;       /* Counts available slots */
     sem_t items;       /* Counts available items */
 } sbuf_t;
@@ -15,5 +18,6 @@ void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
+int sbuf_remove_waited(sbuf_t *sp, long long *waited_ns);
 
 #endif /* __SBUF_H__ */
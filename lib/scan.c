@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_any2_fn) (const char *, size_t, char, char);
+typedef const char *(*scan_ctl_fn) (const char *, size_t);
+
+static const char *scan_any2_scalar (const char *p, size_t n, char a, char b) {
+  for (; n > 0; p++, n--)
+    if (*p == a || *p == b)
+      return p;
+  return NULL;
+}
+
+static const char *scan_ctl_scalar (const char *p, size_t n) {
+  for (; n > 0; p++, n--) {
+    unsigned char c = *p;
+    if ((c < 0x20 && c != '\t') || c == 0x7f)
+      return p;
+  }
+  return NULL;
+}
+
+#ifdef SCAN_X86
+/* Bytes are compared 16 or 32 at a time, the tail shorter than a vector goes
+   through the scalar version. */
+
+static const char *scan_any2_sse2 (const char *p, size_t n, char a, char b) {
+  __m128i va = _mm_set1_epi8 (a), vb = _mm_set1_epi8 (b);
+
+  for (; n >= 16; p += 16, n -= 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+    int m = _mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (v, va),
+                                             _mm_cmpeq_epi8 (v, vb)));
+    if (m)
+      return p + __builtin_ctz (m);
+  }
+  return scan_any2_scalar (p, n, a, b);
+}
+
+/* There is no unsigned byte comparison: v < 0x20 is min(v, 0x1f) == v. */
+static const char *scan_ctl_sse2 (const char *p, size_t n) {
+  __m128i low = _mm_set1_epi8 (0x1f), tab = _mm_set1_epi8 ('\t');
+  __m128i del = _mm_set1_epi8 (0x7f);
+
+  for (; n >= 16; p += 16, n -= 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+    __m128i ctl = _mm_cmpeq_epi8 (_mm_min_epu8 (v, low), v);
+    ctl = _mm_andnot_si128 (_mm_cmpeq_epi8 (v, tab), ctl);
+    int m = _mm_movemask_epi8 (_mm_or_si128 (ctl, _mm_cmpeq_epi8 (v, del)));
+    if (m)
+      return p + __builtin_ctz (m);
+  }
+  return scan_ctl_scalar (p, n);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *scan_any2_avx2 (const char *p, size_t n, char a, char b) {
+  __m256i va = _mm256_set1_epi8 (a), vb = _mm256_set1_epi8 (b);
+
+  for (; n >= 32; p += 32, n -= 32) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) p);
+    unsigned m = _mm256_movemask_epi8 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, va),
+                                                        _mm256_cmpeq_epi8 (v, vb)));
+    if (m)
+      return p + __builtin_ctz (m);
+  }
+  return scan_any2_sse2 (p, n, a, b);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *scan_ctl_avx2 (const char *p, size_t n) {
+  __m256i low = _mm256_set1_epi8 (0x1f), tab = _mm256_set1_epi8 ('\t');
+  __m256i del = _mm256_set1_epi8 (0x7f);
+
+  for (; n >= 32; p += 32, n -= 32) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) p);
+    __m256i ctl = _mm256_cmpeq_epi8 (_mm256_min_epu8 (v, low), v);
+    ctl = _mm256_andnot_si256 (_mm256_cmpeq_epi8 (v, tab), ctl);
+    unsigned m = _mm256_movemask_epi8 (_mm256_or_si256 (ctl, _mm256_cmpeq_epi8 (v, del)));
+    if (m)
+      return p + __builtin_ctz (m);
+  }
+  return scan_ctl_sse2 (p, n);
+}
+#endif
+
+static scan_any2_fn scan_any2_impl = scan_any2_scalar;
+static scan_ctl_fn scan_ctl_impl = scan_ctl_scalar;
+static const char *scan_isa_name = "scalar";
+
+/* Picks the versions once, before main and any thread run. */
+__attribute__ ((constructor))
+static void scan_init () {
+#ifdef SCAN_X86
+  const char *want = getenv ("SCAN_ISA");
+
+  if (want && strcmp (want, "scalar") == 0)
+    return;
+
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2") && !(want && strcmp (want, "sse2") == 0)) {
+    scan_any2_impl = scan_any2_avx2;
+    scan_ctl_impl = scan_ctl_avx2;
+    scan_isa_name = "avx2";
+  } else if (__builtin_cpu_supports ("sse2")) {
+    scan_any2_impl = scan_any2_sse2;
+    scan_ctl_impl = scan_ctl_sse2;
+    scan_isa_name = "sse2";
+  }
+#endif
+}
+
+const char *scan_any2 (const char *p, size_t n, char a, char b) {
+  return scan_any2_impl (p, n, a, b);
+}
+
+const char *scan_ctl (const char *p, size_t n) {
+  return scan_ctl_impl (p, n);
+}
+
+const char *scan_isa () {
+  return scan_isa_name;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Byte scanners for the hot loops of the HTTP parsers.  Each one has a scalar,
+ * an SSE2 and an AVX2 version; the best one the CPU supports is picked when
+ * the program starts.  Setting the environment variable SCAN_ISA to "scalar",
+ * "sse2" or "avx2" forces a given version, if supported, e.g. to compare them.
+ */
+
+/*
+ * Returns a pointer to the first of the n bytes at p equal to a or b, or NULL
+ * if there is none.
+ */
+const char *scan_any2 (const char *p, size_t n, char a, char b);
+
+/*
+ * Returns a pointer to the first line feed in the n bytes at p, or NULL.
+ */
+static inline const char *scan_eol (const char *p, size_t n) {
+  return scan_any2 (p, n, '\n', '\n');
+}
+
+/*
+ * Returns a pointer to the first control character (below 0x20 except
+ * horizontal tab, or DEL) in the n bytes at p, or NULL if there is none.
+ */
+const char *scan_ctl (const char *p, size_t n);
+
+/*
+ * Name of the version in use: "scalar", "sse2" or "avx2".
+ */
+const char *scan_isa ();
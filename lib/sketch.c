@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sketch.h"
+
+/* Row i uses h1 + i * h2 (Kirsch and Mitzenmacher), both halves of the
+   caller's hash. */
+static size_t sketch_cell (const sketch_t *s, uint64_t hash, int row) {
+  uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+
+  return (size_t) row * s->width + ((h1 + (uint32_t) row * h2) & (s->width - 1));
+}
+
+int sketch_init (sketch_t *s, int width, int depth) {
+  s->width = width;
+  s->depth = depth;
+  s->ntop = 0;
+  s->cells = calloc ((size_t) width * depth, sizeof (uint64_t));
+  return s->cells ? 0 : -1;
+}
+
+uint64_t sketch_count (const sketch_t *s, uint64_t hash) {
+  uint64_t min = UINT64_MAX;
+
+  for (int r = 0; r < s->depth; r++) {
+    uint64_t c = s->cells[sketch_cell (s, hash, r)];
+    if (c < min)
+      min = c;
+  }
+  return min;
+}
+
+static void sketch_swap (sketch_t *s, int a, int b) {
+  sketch_top_t t = s->top[a];
+  s->top[a] = s->top[b];
+  s->top[b] = t;
+}
+
+/* The heap keeps its smallest estimate at top[0] */
+static void sketch_sift_down (sketch_t *s, int i) {
+  while (1) {
+    int l = 2 * i + 1, r = l + 1, min = i;
+    if (l < s->ntop && s->top[l].count < s->top[min].count)
+      min = l;
+    if (r < s->ntop && s->top[r].count < s->top[min].count)
+      min = r;
+    if (min == i)
+      return;
+    sketch_swap (s, i, min);
+    i = min;
+  }
+}
+
+static void sketch_sift_up (sketch_t *s, int i) {
+  while (i > 0 && s->top[(i - 1) / 2].count > s->top[i].count) {
+    sketch_swap (s, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+uint64_t sketch_add (sketch_t *s, uint64_t hash, const char *key, uint64_t n) {
+  uint64_t count = sketch_count (s, hash) + n;
+  int i;
+
+  /* Conservative update: a counter already above the new estimate was
+     raised by other keys, it is left alone. */
+  for (int r = 0; r < s->depth; r++) {
+    uint64_t *c = &s->cells[sketch_cell (s, hash, r)];
+    if (*c < count)
+      *c = count;
+  }
+
+  for (i = 0; i < s->ntop && s->top[i].hash != hash; i++)
+    ;
+  if (i < s->ntop) {
+    s->top[i].count = count;
+    sketch_sift_down (s, i);
+    return count;
+  }
+  if (s->ntop < SKETCH_TOP)
+    i = s->ntop++;
+  else if (count > s->top[0].count)
+    i = 0;
+  else
+    return count;
+  s->top[i].hash = hash;
+  s->top[i].count = count;
+  strncpy (s->top[i].key, key, SKETCH_KEY_MAX - 1);
+  s->top[i].key[SKETCH_KEY_MAX - 1] = '\0';
+  if (i == 0)
+    sketch_sift_down (s, 0);
+  else
+    sketch_sift_up (s, i);
+  return count;
+}
+
+static int sketch_top_cmp (const void *a, const void *b) {
+  const sketch_top_t *x = a, *y = b;
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+int sketch_top (const sketch_t *s, sketch_top_t *top) {
+  memcpy (top, s->top, s->ntop * sizeof (sketch_top_t));
+  qsort (top, s->ntop, sizeof (sketch_top_t), sketch_top_cmp);
+  return s->ntop;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SKETCH_TOP 16         /* Heaviest keys kept with their names */
+#define SKETCH_KEY_MAX 96     /* Longer names are cut, keys are told apart by their hash */
+
+/* A heavy key and its estimated total */
+typedef struct {
+  uint64_t hash;
+  uint64_t count;
+  char key[SKETCH_KEY_MAX];
+} sketch_top_t;
+
+/*
+ * A count-min sketch estimating the total added for any key in fixed
+ * memory, never below the true total, along with a min-heap of the
+ * SKETCH_TOP keys with the largest estimates.  Keys are given by a 64-bit
+ * hash computed by the caller, from which the depth row hashes are derived.
+ * Not thread-safe.
+ */
+typedef struct {
+  int width;                  /* Counters per row, a power of two */
+  int depth;                  /* Rows */
+  uint64_t *cells;
+  sketch_top_t top[SKETCH_TOP];
+  int ntop;
+} sketch_t;
+
+/*
+ * Prepares an empty sketch of depth rows of width counters.  Returns 0, or
+ * -1 if out of memory.
+ */
+int      sketch_init (sketch_t *s, int width, int depth);
+
+/*
+ * Adds n to the key of the given hash, whose name is key.  Returns its new
+ * estimated total.
+ */
+uint64_t sketch_add (sketch_t *s, uint64_t hash, const char *key, uint64_t n);
+
+/*
+ * Returns the estimated total of the key of the given hash.
+ */
+uint64_t sketch_count (const sketch_t *s, uint64_t hash);
+
+/*
+ * Copies the heaviest keys to top, largest first.  Returns their number.
+ */
+int      sketch_top (const sketch_t *s, sketch_top_t *top);
@@ -0,0 +1,128 @@
+#include <csapp.h>
+#include <memacct.h>
+#include "proxy.h"
+#include "accesslog.h"
+
+static int log_fd = -1;
+static log_ring_t *rings; 		// Every worker's ring, only ever prepended to
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Prototype functions */
+static void *log_thread(void*);
+static size_t log_format(char*, size_t, const log_record_t*);
+static void log_write(const char*, size_t);
+
+/* Formats r as a line of the common log format, followed by the duration, the cache outcome and the time
+ * spent parsing, in the cache, connecting, waiting for the first byte and relaying the body, all in us.
+ * Returns its length.
+ */
+static size_t log_format(char *buf, size_t size, const log_record_t *r) {
+  static time_t last; 		// Requests of the same second share the formatted date
+  static char date[32];
+  static const char *outcomes[] = { "-", "HIT", "MISS", "UNCACHEABLE" };
+  struct tm tm;
+  int n;
+
+  if (r->time != last) {
+    last = r->time;
+    localtime_r(&r->time, &tm);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+  }
+  n = snprintf(buf, size, "%s - - [%s] \"%s %s\" %d %zu %u %s %u %u %u %u %u\n", r->client, date, r->method,
+               r->uri, r->status, r->bytes_out, r->duration_us, outcomes[r->cache], r->parse_us, r->cache_us,
+               r->connect_us, r->ttfb_us, r->body_us);
+  return (n > 0 && (size_t) n < size) ? n : 0;
+}
+
+static void log_write(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(log_fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return; 			// Nothing better to do with a log that can't be written
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/* Moves records from the rings to the file, formatting them in one buffer written when it fills up or the
+ * rings are empty.
+ */
+static void *log_thread(void *vargp) {
+  char *batch = memacct_malloc(MEM_STATS, LOG_BATCH_SIZE);
+  size_t len = 0;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    int drained = 0;
+    for (log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+      unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      for (unsigned tail = ring->tail; tail != head; tail++) {
+        if (LOG_BATCH_SIZE - len < sizeof(log_record_t) + 64) {
+          log_write(batch, len);
+          len = 0;
+        }
+        len += log_format(batch + len, LOG_BATCH_SIZE - len, &ring->records[tail % LOG_RING_SIZE]);
+        // The worker may reuse the record once tail moved past it
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        drained++;
+      }
+    }
+    if (len > 0) {
+      log_write(batch, len);
+      len = 0;
+    }
+    if (drained == 0) {
+      usleep(LOG_IDLE_MS * 1000);
+    }
+  }
+  return NULL;
+}
+
+int accesslog_init(const char *path) {
+  pthread_t tid;
+
+  if ((log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+    return -1;
+  }
+  Pthread_create(&tid, NULL, log_thread, NULL);
+  return 0;
+}
+
+log_ring_t *accesslog_register(void) {
+  log_ring_t *ring;
+
+  if (log_fd < 0) {
+    return NULL;
+  }
+  ring = calloc(1, sizeof(log_ring_t));
+  memacct_add(MEM_STATS, sizeof(log_ring_t));
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_lock);
+  return ring;
+}
+
+log_record_t *accesslog_reserve(log_ring_t *ring) {
+  if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return &ring->records[ring->head % LOG_RING_SIZE];
+}
+
+void accesslog_commit(log_ring_t *ring) {
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t accesslog_dropped(void) {
+  uint64_t dropped = 0;
+  for (log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  return dropped;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 128 	// Records a worker can have waiting for the log thread, a power of two
+#define LOG_URI_MAX 128 	// Longer uris are cut
+#define LOG_BATCH_SIZE (64 * 1024) // Bytes the log thread formats before writing them at once
+#define LOG_IDLE_MS 50 		// How long the log thread sleeps when every ring is empty
+
+/* What the cache did for a request */
+typedef enum {
+  LOG_CACHE_NONE, 		// The request never got to the cache: refused, failed or for the proxy itself
+  LOG_CACHE_HIT,
+  LOG_CACHE_MISS, 		// Fetched from the server and kept
+  LOG_CACHE_UNCACHEABLE 	// Fetched from the server and not kept: a POST, or a response that can't be shared
+} log_cache_t;
+
+/* One request of the access log, filled in place in the ring */
+typedef struct {
+  time_t time; 			// When the request was answered
+  unsigned duration_us;
+  log_cache_t cache;
+  unsigned parse_us, cache_us; 	// Time spent in each phase of the request, see stats.h, 0 if it didn't go
+  unsigned connect_us, ttfb_us, body_us; // through it. Connect is 0 on a pooled connection.
+  int status; 			// 0 if the request got no response
+  size_t bytes_out;
+  char method[8];
+  char client[46]; 		// Address of the client, as text
+  char uri[LOG_URI_MAX];
+} log_record_t;
+
+/* Records of one worker on their way to the log thread. The worker is the only one to move head and the
+ * log thread the only one to move tail, so neither takes a lock. A worker finding its ring full drops the
+ * record rather than wait.
+ */
+typedef struct log_ring {
+  log_record_t records[LOG_RING_SIZE];
+  unsigned head; 		// Next record to fill
+  unsigned tail; 		// Next record to write out
+  uint64_t dropped;
+  struct log_ring *next; 	// In the list of all rings
+} log_ring_t;
+
+/* Opens path for appending and starts the thread writing the log to it. Returns 0, or -1 if it can't be opened. */
+int accesslog_init(const char *path);
+
+/* Gives the calling worker its own ring, or NULL if there is no access log */
+log_ring_t *accesslog_register(void);
+
+/* Returns the record to fill for a new request, or NULL if the ring is full */
+log_record_t *accesslog_reserve(log_ring_t *ring);
+
+/* Hands the record returned by accesslog_reserve over to the log thread */
+void accesslog_commit(log_ring_t *ring);
+
+/* Records dropped by all workers so far */
+uint64_t accesslog_dropped(void);
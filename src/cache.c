@@ -0,0 +1,303 @@
+#include <csapp.h>
+#include <lock.h>
+#include <memacct.h>
+#include <sys/uio.h>
+#include "proxy.h"
+#include "cache.h"
+
+/* A cached response. The key and the bytes live in the same allocation as the object. */
+typedef struct cache_obj {
+  uint64_t hash; 		// Of key, given by the request that added it
+  char *key;
+  char *data;
+  size_t len; 			// Bytes of data, what counts against max_cache_size
+  size_t split; 		// Where the Connection header goes
+  time_t expires; 		// When it goes stale, 0 if it doesn't
+  int refs; 			// Readers writing it out right now, it is only freed when there are none
+  int evicted; 			// No longer in the cache, the last reader frees it
+  int referenced; 		// Hit since CACHE_CLOCK last passed over it
+  struct cache_obj *next; 	// In its bucket
+  struct cache_obj *newer, *older; // In its shard's eviction list, newest first
+} cache_obj_t;
+
+typedef struct {
+  lock_t lock;
+  cache_obj_t *buckets[CACHE_BUCKETS];
+  cache_obj_t *newest, *oldest;
+  size_t objects;
+  unsigned long evictions; 	// To make room, not counting replaced objects
+} cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static size_t cache_used; 	// Bytes of all cached objects, updated atomically
+static cache_config_t config = { CACHE_LRU, MAX_CACHE_SIZE, MAX_OBJECT_SIZE };
+static const char *policy_names[CACHE_POLICIES] = { "lru", "fifo", "clock" };
+
+/* Prototype functions */
+static cache_shard_t *cache_shard(uint64_t);
+static cache_obj_t **cache_bucket(cache_shard_t*, uint64_t);
+static cache_obj_t *cache_find(cache_shard_t*, const http_key_t*);
+static void cache_unlink(cache_shard_t*, cache_obj_t*);
+static void cache_push(cache_shard_t*, cache_obj_t*);
+static void cache_obj_free(cache_obj_t*);
+static void cache_evict(cache_shard_t*, cache_obj_t*);
+static cache_obj_t *cache_victim(cache_shard_t*);
+static void cache_make_room(cache_shard_t*);
+static int cache_writev(int, struct iovec*, int);
+
+/* The low bits of the hash pick the shard, the next ones the bucket in it */
+static cache_shard_t *cache_shard(uint64_t hash) {
+  return &shards[hash % CACHE_SHARDS];
+}
+
+static cache_obj_t **cache_bucket(cache_shard_t *s, uint64_t hash) {
+  return &s->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+/* Looks key up in its shard, which must be locked */
+static cache_obj_t *cache_find(cache_shard_t *s, const http_key_t *key) {
+  for (cache_obj_t *o = *cache_bucket(s, key->hash); o; o = o->next) {
+    if (o->hash == key->hash && strcmp(o->key, key->str) == 0) {
+      return o;
+    }
+  }
+  return NULL;
+}
+
+/* Takes o out of its shard's eviction list */
+static void cache_unlink(cache_shard_t *s, cache_obj_t *o) {
+  if (o->newer) {
+    o->newer->older = o->older;
+  } else {
+    s->newest = o->older;
+  }
+  if (o->older) {
+    o->older->newer = o->newer;
+  } else {
+    s->oldest = o->newer;
+  }
+}
+
+/* Puts o at the newest end of its shard's eviction list */
+static void cache_push(cache_shard_t *s, cache_obj_t *o) {
+  o->newer = NULL;
+  o->older = s->newest;
+  if (s->newest) {
+    s->newest->newer = o;
+  } else {
+    s->oldest = o;
+  }
+  s->newest = o;
+}
+
+/* Frees o, counting its header for the index and the rest for the objects */
+static void cache_obj_free(cache_obj_t *o) {
+  memacct_add(MEM_CACHE_INDEX, -(long) sizeof(cache_obj_t));
+  memacct_add(MEM_CACHE_OBJECTS, -(long) (strlen(o->key) + 1 + o->len));
+  free(o);
+}
+
+/* Removes o from the cache, the shard must be locked. A reader still writing it out frees it when done. */
+static void cache_evict(cache_shard_t *s, cache_obj_t *o) {
+  cache_obj_t **pp = cache_bucket(s, o->hash);
+
+  while (*pp != o) {
+    pp = &(*pp)->next;
+  }
+  *pp = o->next;
+  cache_unlink(s, o);
+  s->objects--;
+  __atomic_sub_fetch(&cache_used, o->len, __ATOMIC_RELAXED);
+  if (o->refs == 0) {
+    cache_obj_free(o);
+  } else {
+    o->evicted = 1;
+  }
+}
+
+/* Returns the object of a non-empty shard to evict next, which must be locked. CACHE_CLOCK gives the
+ * objects hit since it last looked at them another round at the newest end.
+ */
+static cache_obj_t *cache_victim(cache_shard_t *s) {
+  if (config.policy == CACHE_CLOCK) {
+    while (s->oldest->referenced) {
+      cache_obj_t *o = s->oldest;
+      o->referenced = 0;
+      cache_unlink(s, o);
+      cache_push(s, o);
+    }
+  }
+  return s->oldest;
+}
+
+/* Evicts until the cache fits in max_cache_size, from the shard being added to first then from the others.
+ * Only one shard is locked at a time.
+ */
+static void cache_make_room(cache_shard_t *first) {
+  int start = first - shards;
+
+  for (int i = 0; i < CACHE_SHARDS && __atomic_load_n(&cache_used, __ATOMIC_RELAXED) > config.max_cache_size; i++) {
+    cache_shard_t *s = &shards[(start + i) % CACHE_SHARDS];
+    lock_acquire(&s->lock);
+    while (s->oldest && __atomic_load_n(&cache_used, __ATOMIC_RELAXED) > config.max_cache_size) {
+      cache_evict(s, cache_victim(s));
+      s->evictions++;
+    }
+    lock_release(&s->lock);
+  }
+}
+
+/* Writes all of the iovecs to fd, going on after short writes */
+static int cache_writev(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t rc = writev(fd, iov, n);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (; n > 0 && (size_t) rc >= iov->iov_len; iov++, n--) {
+      rc -= iov->iov_len;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return 0;
+}
+
+void cache_init(void) {
+  memacct_add(MEM_CACHE_INDEX, sizeof(shards));
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    lock_init(&shards[i].lock, "cache");
+  }
+}
+
+void cache_configure(const cache_config_t *c) {
+  config = *c;
+}
+
+int cache_policy_by_name(const char *name) {
+  for (int p = 0; p < CACHE_POLICIES; p++) {
+    if (strcmp(name, policy_names[p]) == 0) {
+      return p;
+    }
+  }
+  return -1;
+}
+
+const char *cache_policy_name(cache_policy_t policy) {
+  return policy_names[policy];
+}
+
+void cache_clear(void) {
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    cache_shard_t *s = &shards[i];
+    lock_acquire(&s->lock);
+    while (s->oldest) {
+      cache_evict(s, s->oldest);
+    }
+    s->evictions = 0;
+    lock_release(&s->lock);
+  }
+}
+
+int cache_write_if_cached(const http_key_t *key, int fd, const char *insert, size_t *written) {
+  cache_shard_t *s = cache_shard(key->hash);
+  cache_obj_t *o;
+  int rc;
+
+  lock_acquire(&s->lock);
+  if ((o = cache_find(s, key)) == NULL) {
+    lock_release(&s->lock);
+    return 1;
+  }
+  // A stale object is a miss, the response fetched instead replaces it
+  if (o->expires && time(NULL) >= o->expires) {
+    cache_evict(s, o);
+    lock_release(&s->lock);
+    return 1;
+  }
+  if (config.policy == CACHE_LRU) {
+    cache_unlink(s, o);
+    cache_push(s, o);
+  } else if (config.policy == CACHE_CLOCK) {
+    o->referenced = 1;
+  }
+  o->refs++;
+  lock_release(&s->lock);
+
+  // A slow client only holds on to the object, not to the shard
+  struct iovec iov[] = {
+    { o->data, o->split }, { (char *) insert, strlen(insert) }, { o->data + o->split, o->len - o->split },
+  };
+  rc = cache_writev(fd, iov, 3);
+  *written = o->len + strlen(insert);
+
+  lock_acquire(&s->lock);
+  if (--o->refs == 0 && o->evicted) {
+    cache_obj_free(o);
+  }
+  lock_release(&s->lock);
+  return rc;
+}
+
+void cache_add_to_cache(const http_key_t *key, const char *buf, size_t buf_len, size_t split, time_t expires) {
+  cache_shard_t *s = cache_shard(key->hash);
+  cache_obj_t *o, *old, **bucket;
+
+  if (buf_len > config.max_object_size || split > buf_len) {
+    return;
+  }
+  // Object, key and bytes in one allocation
+  if ((o = malloc(sizeof(cache_obj_t) + key->len + 1 + buf_len)) == NULL) {
+    return;
+  }
+  memacct_add(MEM_CACHE_INDEX, sizeof(cache_obj_t));
+  memacct_add(MEM_CACHE_OBJECTS, key->len + 1 + buf_len);
+  o->hash = key->hash;
+  o->key = (char *) (o + 1);
+  memcpy(o->key, key->str, key->len + 1);
+  o->data = o->key + key->len + 1;
+  memcpy(o->data, buf, buf_len);
+  o->len = buf_len;
+  o->split = split;
+  o->expires = expires;
+  o->refs = 0;
+  o->evicted = 0;
+  o->referenced = 0;
+
+  // The bytes are counted before they are in, so concurrent adds make room for each other
+  __atomic_add_fetch(&cache_used, buf_len, __ATOMIC_RELAXED);
+  cache_make_room(s);
+
+  lock_acquire(&s->lock);
+  // Two misses on the same key both add it, the last response wins
+  if ((old = cache_find(s, key)) != NULL) {
+    cache_evict(s, old);
+  }
+  bucket = cache_bucket(s, key->hash);
+  o->next = *bucket;
+  *bucket = o;
+  cache_push(s, o);
+  s->objects++;
+  lock_release(&s->lock);
+}
+
+void cache_stats(cache_stats_t *stats) {
+  stats->bytes = __atomic_load_n(&cache_used, __ATOMIC_RELAXED);
+  stats->max_bytes = config.max_cache_size;
+  stats->objects = stats->evictions = 0;
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    lock_acquire(&shards[i].lock);
+    stats->objects += shards[i].objects;
+    stats->evictions += shards[i].evictions;
+    lock_release(&shards[i].lock);
+  }
+}
+
+size_t cache_max_object_size(void) {
+  return config.max_object_size;
+}
@@ -1,17 +1,73 @@
 #pragma once
 
-#define MAX_CACHE_SIZE (1024 * 1024)
+#include <stddef.h>
+#include <time.h>
+#include "http.h"
+
+#define MAX_CACHE_SIZE (1024 * 1024) 	// Defaults of cache_config_t
 #define MAX_OBJECT_SIZE (512 * 1024)
+#define CACHE_SHARDS 16 	// Each with its own lock and eviction list, an object's shard is picked by its key hash
+#define CACHE_BUCKETS 64 	// Hash buckets per shard
+
+/* Responses to GET requests kept in memory, keyed by the request's normalized target (see http_make_key) so
+ * equivalent uris share one object. The key's hash picks the shard and the bucket, it is never recomputed.
+ * An object is stored with a split where the proxy puts its own Connection header, which depends on the client.
+ * Together the objects hold at most max_cache_size bytes, those a shard's policy picks go first. An object
+ * may have an expiry time, after which a lookup finds it stale and evicts it.
+ */
+
+/* Which object of a shard is evicted first */
+typedef enum {
+  CACHE_LRU, 			// The least recently used
+  CACHE_FIFO, 			// The oldest, hits do not count
+  CACHE_CLOCK, 			// The oldest not hit since it was last passed over (second chance), hits only set a bit
+  CACHE_POLICIES
+} cache_policy_t;
+
+typedef struct {
+  cache_policy_t policy;
+  size_t max_cache_size; 	// Bytes of all objects
+  size_t max_object_size; 	// Larger responses are not cached
+} cache_config_t;
+
+/* Totals of all shards, for the stats endpoint */
+typedef struct {
+  size_t bytes; 		// Bytes of the cached objects, at most max_cache_size
+  size_t max_bytes; 		// max_cache_size of the configuration in use
+  size_t objects;
+  unsigned long evictions; 	// Objects evicted to make room since the start
+} cache_stats_t;
+
+/* Initialize the cache, must be called once before any worker thread starts. It starts with LRU,
+ * MAX_CACHE_SIZE and MAX_OBJECT_SIZE.
+ */
+void cache_init(void);
 
-/* Recommended: write the cache functions in cache.c, add cache.c to SOURCES in
- * src/Makefile, and implement the following functions:
- *
- * void cache_init ():
- * Initialize the cache dictionary, defined as a global variable in cache.c.
- *
- * int cache_write_if_cached (const char *uri, int fd):
- * If uri is found in the cache, write it to fd and return 0, otherwise return 1.
- *
- * void cache_add_to_cache (const char *uri, const char *buf, size_t buf_len):
- * Add the pair (uri, buf) to the cache, possibly evicting old cached objects.
+/* Changes the policy and sizes, while no other thread uses the cache. Cached objects are kept, the next add
+ * makes room if they no longer fit.
  */
+void cache_configure(const cache_config_t *config);
+
+/* Returns the policy named name (lru, fifo, clock), or -1 if there is none */
+int cache_policy_by_name(const char *name);
+const char *cache_policy_name(cache_policy_t policy);
+
+/* Empties the cache and zeroes its counters, while no other thread uses it */
+void cache_clear(void);
+
+/* If key is cached, write it to fd with insert between its two parts and return 0 with *written set to the
+ * bytes written, otherwise return 1. Returns -1 if writing to fd failed. The shard is not locked while writing.
+ */
+int cache_write_if_cached(const http_key_t *key, int fd, const char *insert, size_t *written);
+
+/* Add a copy of the buf_len bytes of buf under key, split at split, possibly evicting old cached objects.
+ * It is served until expires (wall clock), or as long as it stays in the cache if expires is 0.
+ * An object already cached under key is replaced.
+ */
+void cache_add_to_cache(const http_key_t *key, const char *buf, size_t buf_len, size_t split, time_t expires);
+
+/* Sums the shards' counters, locking each in turn */
+void cache_stats(cache_stats_t *stats);
+
+/* Returns max_object_size of the configuration in use, the largest response worth keeping for the cache */
+size_t cache_max_object_size(void);
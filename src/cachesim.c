@@ -0,0 +1,352 @@
+/*
+ * cachesim - Replays a request trace against the proxy's cache offline, for each eviction policy and several
+ * cache and object sizes, and reports the hit ratio, the byte hit ratio, the evictions and the requests per
+ * second. The cache is cache.c itself, hits are written to /dev/null as they would be to a client.
+ *
+ * The trace is read from a file, either an access log of the proxy (its -l) or lines of "URI SIZE", or generated:
+ *   zipf     Requests for OBJECTS objects whose popularity follows a Zipf law of exponent ALPHA
+ *   scan     The same, with SCAN_FRACTION of the requests going once each to objects never seen again
+ *   diurnal  The same, with the popular objects drifting over 24 periods as interests change over a day
+ * Generated objects have sizes spread evenly on a log scale from 256 bytes to 1M.
+ *
+ * -w writes the trace as "URI SIZE" lines. Generated uris are paths on driver/origin, which serves an object of
+ * that size, so driver/loadgen -t can replay the trace live through the proxy.
+ *
+ * usage: cachesim [-g zipf|scan|diurnal] [-n REQUESTS] [-k OBJECTS] [-a ALPHA] [-f SCAN_FRACTION]
+ *                 [-p POLICIES] [-c CACHE_SIZES] [-o OBJECT_SIZES] [-w TRACE_OUT] [TRACE_FILE]
+ * POLICIES and SIZES are comma-separated lists, sizes may end in k or m.
+ */
+#include <csapp.h>
+#include <arena.h>
+#include <math.h>
+#include "http.h"
+#include "cache.h"
+
+#define DIURNAL_PERIODS 24
+#define MIN_OBJECT_BYTES 256 		// Of the generated objects
+#define MAX_OBJECT_BYTES (1 << 20)
+#define SIM_HOST "origin" 		// Of uris without one
+#define MAX_CONFIGS 16 			// Sizes given to each of -c and -o
+
+typedef struct {
+  http_key_t key;
+  size_t size; 				// Of its last response in the trace
+} object_t;
+
+typedef struct {
+  int obj;
+  size_t size; 				// Bytes of the response
+  int cacheable; 			// A GET answered 200
+} request_t;
+
+static arena_t arena; 			// The keys
+static object_t *objects;
+static int nobjects, max_objects;
+static int *index_slots; 		// Open addressing on the key hash, -1 for empty
+static int nslots;
+static request_t *requests;
+static long nrequests, max_requests;
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+/* Prototype functions */
+static void usage(const char*);
+static long long now_ns(void);
+static double uniform(void);
+static int parse_list(char*, long*, int);
+static int intern(const char*, size_t);
+static void add_request(int, size_t, int);
+static void read_trace(const char*);
+static void generate(const char*, long, int, double, double);
+static void write_trace(const char*);
+static void simulate(cache_policy_t, size_t, size_t);
+
+static void usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-g zipf|scan|diurnal] [-n REQUESTS] [-k OBJECTS] [-a ALPHA] [-f SCAN_FRACTION]\n"
+          "       [-p POLICIES] [-c CACHE_SIZES] [-o OBJECT_SIZES] [-w TRACE_OUT] [TRACE_FILE]\n", progname);
+  exit(1);
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* A number in [0, 1) from xorshift64*, the same trace for the same arguments */
+static double uniform(void) {
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return ((seed * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+/* Parses a comma-separated list of sizes with an optional k or m suffix. Returns how many there were. */
+static int parse_list(char *s, long *values, int max) {
+  char *save, *tok;
+  int n = 0;
+
+  for (tok = strtok_r(s, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save)) {
+    char *end;
+    long v = strtol(tok, &end, 10);
+
+    if (*end == 'k' || *end == 'K') {
+      v <<= 10;
+    } else if (*end == 'm' || *end == 'M') {
+      v <<= 20;
+    }
+    values[n++] = v;
+  }
+  return n;
+}
+
+/* Returns the object of the uri's cache key, made as the proxy makes it, or -1 if the uri is malformed */
+static int intern(const char *uri, size_t len) {
+  slice_t u = { uri, len }, host, port, path;
+  static const slice_t default_host = { SIM_HOST, sizeof(SIM_HOST) - 1 };
+  http_key_t key;
+  size_t i;
+
+  if (http_parse_uri(&u, &host, &port, &path) < 0) {
+    return -1;
+  }
+  if (host.len == 0) {
+    host = default_host;
+  }
+  if (http_make_key(&arena, &host, port.len ? atoi(port.ptr) : 8080, 8080, &path, 0, &key) < 0) {
+    return -1;
+  }
+
+  // Grown to stay at most half full
+  if (2 * (nobjects + 1) > nslots) {
+    nslots = nslots ? 2 * nslots : 1024;
+    free(index_slots);
+    index_slots = malloc(nslots * sizeof(int));
+    memset(index_slots, 0xff, nslots * sizeof(int));
+    for (int o = 0; o < nobjects; o++) {
+      for (i = objects[o].key.hash & (nslots - 1); index_slots[i] >= 0; i = (i + 1) & (nslots - 1));
+      index_slots[i] = o;
+    }
+  }
+  for (i = key.hash & (nslots - 1); index_slots[i] >= 0; i = (i + 1) & (nslots - 1)) {
+    object_t *o = &objects[index_slots[i]];
+    if (o->key.hash == key.hash && strcmp(o->key.str, key.str) == 0) {
+      return index_slots[i];
+    }
+  }
+  if (nobjects == max_objects) {
+    max_objects = max_objects ? 2 * max_objects : 1024;
+    objects = realloc(objects, max_objects * sizeof(object_t));
+  }
+  objects[nobjects].key = key;
+  objects[nobjects].size = 0;
+  index_slots[i] = nobjects;
+  return nobjects++;
+}
+
+static void add_request(int obj, size_t size, int cacheable) {
+  if (nrequests == max_requests) {
+    max_requests = max_requests ? 2 * max_requests : 4096;
+    requests = realloc(requests, max_requests * sizeof(request_t));
+  }
+  requests[nrequests++] = (request_t) { obj, size, cacheable };
+  objects[obj].size = size;
+}
+
+/* Reads an access log, whose lines have "METHOD URI" STATUS BYTES, or lines of URI SIZE */
+static void read_trace(const char *path) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  char *line = NULL;
+  size_t cap = 0;
+
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  while (getline(&line, &cap, f) > 0) {
+    char *uri, *p;
+    size_t size;
+    int status = 200, get = 1, obj;
+
+    if ((p = strchr(line, '"')) != NULL) {
+      get = strncmp(p + 1, "GET ", 4) == 0;
+      uri = strchr(p + 1, ' ');
+      if (!uri || (p = strchr(++uri, '"')) == NULL || sscanf(p + 1, "%d %zu", &status, &size) != 2) {
+        continue;
+      }
+    } else {
+      uri = line + strspn(line, " \t");
+      p = uri + strcspn(uri, " \t\n");
+      if (sscanf(p, "%zu", &size) != 1) {
+        continue;
+      }
+    }
+    if ((obj = intern(uri, p - uri)) >= 0) {
+      add_request(obj, size, get && status == 200 && size > 0);
+    }
+  }
+  free(line);
+  if (f != stdin) {
+    fclose(f);
+  }
+}
+
+static void generate(const char *kind, long n, int k, double alpha, double scan_fraction) {
+  double *cdf = malloc(k * sizeof(double)), sum = 0;
+  size_t *sizes = malloc(k * sizeof(size_t));
+  int scanned = 0; 			// Objects the scans went through
+  char uri[64];
+
+  for (int i = 0; i < k; i++) {
+    cdf[i] = sum += 1 / pow(i + 1, alpha);
+    sizes[i] = MIN_OBJECT_BYTES * pow((double) MAX_OBJECT_BYTES / MIN_OBJECT_BYTES, uniform());
+  }
+  for (long r = 0; r < n; r++) {
+    double u = uniform() * sum;
+    int lo = 0, hi = k - 1, id, len;
+    size_t size;
+
+    if (strcmp(kind, "scan") == 0 && uniform() < scan_fraction) {
+      id = k + scanned++;
+      size = MIN_OBJECT_BYTES * pow((double) MAX_OBJECT_BYTES / MIN_OBJECT_BYTES, uniform());
+    } else {
+      while (lo < hi) { 		// The first rank whose cdf reaches u
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      id = lo;
+      if (strcmp(kind, "diurnal") == 0) {
+        // The ranking moves on by a step each period, a quarter of the objects over the day
+        id = (lo + (r * DIURNAL_PERIODS / n) * k / (4 * DIURNAL_PERIODS)) % k;
+      }
+      size = sizes[id];
+    }
+    len = snprintf(uri, sizeof(uri), "/obj/%d?size=%zu", id, size);
+    add_request(intern(uri, len), size, 1);
+  }
+  free(cdf);
+  free(sizes);
+}
+
+static void write_trace(const char *path) {
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  for (long r = 0; r < nrequests; r++) {
+    fprintf(f, "%s %zu\n", objects[requests[r].obj].key.str, requests[r].size);
+  }
+  fclose(f);
+}
+
+/* Replays the whole trace on an empty cache with the given settings and prints one line of results */
+static void simulate(cache_policy_t policy, size_t cache_size, size_t object_size) {
+  static char *payload; 		// Bytes of the added objects, they are never looked at
+  static size_t payload_size;
+  cache_config_t config = { policy, cache_size, object_size };
+  unsigned long hits = 0;
+  uint64_t bytes = 0, hit_bytes = 0;
+  cache_stats_t stats;
+  long long start, ns;
+  int devnull = open("/dev/null", O_WRONLY);
+
+  if (object_size > payload_size) {
+    payload = realloc(payload, payload_size = object_size);
+    memset(payload, 'x', object_size);
+  }
+  cache_configure(&config);
+  cache_clear();
+
+  start = now_ns();
+  for (long r = 0; r < nrequests; r++) {
+    request_t *req = &requests[r];
+    object_t *o = &objects[req->obj];
+    size_t written;
+
+    bytes += req->size;
+    if (cache_write_if_cached(&o->key, devnull, "", &written) == 0) {
+      hits++;
+      hit_bytes += req->size;
+    } else if (req->cacheable && req->size <= object_size) {
+      cache_add_to_cache(&o->key, payload, req->size, 0, 0);
+    }
+  }
+  ns = now_ns() - start;
+  cache_stats(&stats);
+  close(devnull);
+
+  printf("%-6s %12zu %12zu %10ld %9.4f %9.4f %10lu %12.0f\n", cache_policy_name(policy), cache_size, object_size,
+         nrequests, (double) hits / nrequests, bytes ? (double) hit_bytes / bytes : 0.0, stats.evictions,
+         nrequests * 1e9 / ns);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  char *kind = "zipf", *trace_out = NULL;
+  char default_policies[] = "lru,fifo,clock", *policies = default_policies, *save, *tok;
+  long n = 1000000, cache_sizes[MAX_CONFIGS] = { MAX_CACHE_SIZE }, object_sizes[MAX_CONFIGS] = { MAX_OBJECT_SIZE };
+  int k = 10000, ncache = 1, nobject = 1, opt;
+  double alpha = 0.9, scan_fraction = 0.3;
+  uint64_t unique_bytes = 0;
+
+  while ((opt = getopt(argc, argv, "g:n:k:a:f:p:c:o:w:")) != -1) {
+    switch (opt) {
+    case 'g': kind = optarg; break;
+    case 'n': n = atol(optarg); break;
+    case 'k': k = atoi(optarg); break;
+    case 'a': alpha = atof(optarg); break;
+    case 'f': scan_fraction = atof(optarg); break;
+    case 'p': policies = optarg; break;
+    case 'c': ncache = parse_list(optarg, cache_sizes, MAX_CONFIGS); break;
+    case 'o': nobject = parse_list(optarg, object_sizes, MAX_CONFIGS); break;
+    case 'w': trace_out = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc - 1 || n <= 0 || k <= 0 || ncache == 0 || nobject == 0
+      || (strcmp(kind, "zipf") != 0 && strcmp(kind, "scan") != 0 && strcmp(kind, "diurnal") != 0)) {
+    usage(argv[0]);
+  }
+
+  arena_init(&arena);
+  cache_init();
+  if (optind == argc - 1) {
+    read_trace(argv[optind]);
+  } else {
+    generate(kind, n, k, alpha, scan_fraction);
+  }
+  if (nrequests == 0) {
+    fprintf(stderr, "empty trace\n");
+    exit(1);
+  }
+  if (trace_out) {
+    write_trace(trace_out);
+  }
+  for (int o = 0; o < nobjects; o++) {
+    unique_bytes += objects[o].size;
+  }
+  printf("# %ld requests for %d objects of %llu bytes\n", nrequests, nobjects, (unsigned long long) unique_bytes);
+  printf("%-6s %12s %12s %10s %9s %9s %10s %12s\n", "policy", "cache_size", "object_size", "requests", "hits",
+         "byte_hits", "evictions", "requests/s");
+
+  for (tok = strtok_r(policies, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    int policy = cache_policy_by_name(tok);
+
+    if (policy < 0) {
+      fprintf(stderr, "%s: no such policy\n", tok);
+      exit(1);
+    }
+    for (int c = 0; c < ncache; c++) {
+      for (int o = 0; o < nobject; o++) {
+        simulate(policy, cache_sizes[c], object_sizes[o]);
+      }
+    }
+  }
+  return 0;
+}
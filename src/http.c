@@ -0,0 +1,559 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <scan.h>
+#include "http.h"
+
+/* Parser states */
+#define HTTP_REQUEST_LINE 0
+#define HTTP_HEADERS 1
+#define HTTP_DONE 2
+
+static int http_tchar(int c);
+static const char *http_find_eol(const char*, size_t);
+static void http_rebase(http_request_t*, const char*);
+static int http_request_line(http_request_t*, const char*, const char*);
+static int http_header_line(http_request_t*, const char*, const char*);
+static int http_parse_authority(const char*, const char*, slice_t*, slice_t*);
+static int http_unreserved(int);
+static int http_hexval(int);
+static size_t http_normalize_escapes(char*, const char*, size_t);
+static size_t http_remove_dots(char*, const char*, size_t);
+static int http_param_cmp(const void*, const void*);
+static size_t http_sort_params(arena_t*, char*, const char*, size_t);
+
+/* Characters allowed in a method or a header name (RFC 7230 token) */
+static int http_tchar(int c) {
+  return isalnum(c) || (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/* Finds the next line feed in the n bytes at p */
+static const char *http_find_eol(const char *p, size_t n) {
+  return scan_eol(p, n);
+}
+
+/* The bytes were moved to buf since the previous call, move the slices found so far along with them */
+static void http_rebase(http_request_t *req, const char *buf) {
+#define HTTP_REBASE(s) if ((s).ptr) { (s).ptr = buf + ((s).ptr - req->base); }
+  HTTP_REBASE(req->method);
+  HTTP_REBASE(req->uri);
+  HTTP_REBASE(req->version);
+  for (int i = 0; i < req->nheaders; i++) {
+    HTTP_REBASE(req->headers[i].name);
+    HTTP_REBASE(req->headers[i].value);
+  }
+#undef HTTP_REBASE
+}
+
+/* Splits "method uri [version]" between p and end */
+static int http_request_line(http_request_t *req, const char *p, const char *end) {
+  slice_t *parts[3] = { &req->method, &req->uri, &req->version };
+  int n = 0;
+
+  if (scan_ctl(p, end - p)) {
+    return -1;
+  }
+  while (p < end) {
+    const char *start;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    if (n == 3) {
+      return -1;
+    }
+    // The uri can be long, its end is found a vector at a time
+    start = p;
+    if ((p = scan_any2(start, end - start, ' ', '\t')) == NULL) {
+      p = end;
+    }
+    parts[n]->ptr = start;
+    parts[n]->len = p - start;
+    n++;
+  }
+  if (n < 2) {
+    return -1;
+  }
+  for (size_t i = 0; i < req->method.len; i++) {
+    if (!http_tchar((unsigned char) req->method.ptr[i])) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Splits "name: value" between p and end, the value is trimmed of its surrounding whitespace */
+static int http_header_line(http_request_t *req, const char *p, const char *end) {
+  http_header_t *h;
+  const char *colon = scan_any2(p, end - p, ':', ':');
+
+  // No header name, or a continuation line, which RFC 7230 lets us reject
+  if (colon == NULL || colon == p) {
+    return -1;
+  }
+  for (const char *q = p; q < colon; q++) {
+    if (!http_tchar((unsigned char) *q)) {
+      return -1;
+    }
+  }
+  h = &req->headers[req->nheaders];
+  h->name.ptr = p;
+  h->name.len = colon - p;
+
+  for (p = colon + 1; p < end && (*p == ' ' || *p == '\t'); p++);
+  while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+    end--;
+  }
+  if (scan_ctl(p, end - p)) {
+    return -1;
+  }
+  h->value.ptr = p;
+  h->value.len = end - p;
+  req->nheaders++;
+  return 0;
+}
+
+void http_request_init(http_request_t *req, http_header_t *headers, int max_headers) {
+  req->method.ptr = req->uri.ptr = req->version.ptr = NULL;
+  req->method.len = req->uri.len = req->version.len = 0;
+  req->headers = headers;
+  req->nheaders = 0;
+  req->max_headers = max_headers;
+  req->head_len = 0;
+  req->base = NULL;
+  req->pos = req->line = 0;
+  req->state = HTTP_REQUEST_LINE;
+}
+
+void http_request_grow(http_request_t *req, http_header_t *headers, int max_headers) {
+  memcpy(headers, req->headers, req->nheaders * sizeof(http_header_t));
+  req->headers = headers;
+  req->max_headers = max_headers;
+}
+
+int http_parse_request(http_request_t *req, const char *buf, size_t len) {
+  const char *line, *eol, *end;
+
+  if (req->base && buf != req->base) {
+    http_rebase(req, buf);
+  }
+  req->base = buf;
+
+  // Each complete line is parsed once, a partial one is only scanned for its end again from where it stopped
+  while (req->state != HTTP_DONE) {
+    if (req->pos >= len || (eol = http_find_eol(buf + req->pos, len - req->pos)) == NULL) {
+      req->pos = len;
+      return HTTP_PARSE_AGAIN;
+    }
+    line = buf + req->line;
+    end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+    // A header field with no room for it, the next call finds this line end again right away
+    if (req->state == HTTP_HEADERS && end != line && req->nheaders == req->max_headers) {
+      req->pos = eol - buf;
+      return HTTP_PARSE_FULL;
+    }
+    req->pos = req->line = eol - buf + 1;
+
+    if (req->state == HTTP_REQUEST_LINE) {
+      // Empty lines before a request line are tolerated (RFC 7230 3.5)
+      if (end == line) {
+        continue;
+      }
+      if (http_request_line(req, line, end) < 0) {
+        return HTTP_PARSE_ERROR;
+      }
+      req->state = HTTP_HEADERS;
+    } else if (end == line) {
+      req->head_len = req->pos;
+      req->state = HTTP_DONE;
+    } else if (http_header_line(req, line, end) < 0) {
+      return HTTP_PARSE_ERROR;
+    }
+  }
+  return HTTP_PARSE_DONE;
+}
+
+/* Splits host[:port] between p and end, an IPv6 address is given in brackets which are not part of host */
+static int http_parse_authority(const char *p, const char *end, slice_t *host, slice_t *port) {
+  const char *q;
+
+  if (p < end && *p == '[') {
+    if ((q = memchr(p, ']', end - p)) == NULL) {
+      return -1;
+    }
+    host->ptr = p + 1;
+    host->len = q - p - 1;
+    q++;
+  } else {
+    for (q = p; q < end && *q != ':'; q++);
+    host->ptr = p;
+    host->len = q - p;
+  }
+  if (host->len == 0) {
+    return -1;
+  }
+
+  port->ptr = NULL;
+  port->len = 0;
+  if (q == end) {
+    return 0;
+  }
+  if (*q != ':') {
+    return -1;
+  }
+  // An empty port after the colon means the default one
+  port->ptr = ++q;
+  port->len = end - q;
+  if (port->len > 5) {
+    return -1;
+  }
+  for (; q < end; q++) {
+    if (!isdigit((unsigned char) *q)) {
+      return -1;
+    }
+  }
+  if (port->len > 0 && (strtol(port->ptr, NULL, 10) <= 0 || strtol(port->ptr, NULL, 10) > 65535)) {
+    return -1;
+  }
+  return 0;
+}
+
+int http_parse_uri(const slice_t *uri, slice_t *host, slice_t *port, slice_t *path) {
+  const char *p = uri->ptr, *end = uri->ptr + uri->len, *auth_end;
+
+  host->ptr = port->ptr = NULL;
+  host->len = port->len = 0;
+
+  // Origin form, the host comes from the Host header
+  if (uri->len > 0 && *p == '/') {
+    *path = *uri;
+    return 0;
+  }
+
+  if (uri->len < 7 || strncasecmp(p, "http://", 7) != 0) {
+    return -1;
+  }
+  p += 7;
+  for (auth_end = p; auth_end < end && *auth_end != '/' && *auth_end != '?'; auth_end++);
+  path->ptr = auth_end;
+  path->len = end - auth_end;
+
+  // Credentials have no business in a request to a proxy
+  if (memchr(p, '@', auth_end - p)) {
+    return -1;
+  }
+  return http_parse_authority(p, auth_end, host, port);
+}
+
+int http_parse_host(const slice_t *value, slice_t *host, slice_t *port) {
+  return http_parse_authority(value->ptr, value->ptr + value->len, host, port);
+}
+
+int http_has_token(const slice_t *list, const char *token) {
+  slice_t t = { token, strlen(token) };
+  return http_has_token_slice(list, &t);
+}
+
+int http_has_token_slice(const slice_t *list, const slice_t *token) {
+  size_t n = token->len;
+  const char *p = list->ptr, *end = list->ptr + list->len;
+
+  while (p < end) {
+    const char *start, *stop;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+    for (start = p; p < end && *p != ','; p++);
+    for (stop = p; stop > start && (stop[-1] == ' ' || stop[-1] == '\t'); stop--);
+    if ((size_t) (stop - start) == n && strncasecmp(start, token->ptr, n) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+long http_directive_secs(const slice_t *list, const char *directive) {
+  size_t n = strlen(directive);
+  const char *p = list->ptr, *end = list->ptr + list->len;
+
+  while (p < end) {
+    const char *start;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+    for (start = p; p < end && *p != ','; p++);
+    if ((size_t) (p - start) > n && start[n] == '=' && strncasecmp(start, directive, n) == 0) {
+      long secs = 0;
+      const char *q = start + n + 1;
+      if (q == p || !isdigit((unsigned char) *q)) {
+        return -1;
+      }
+      // Values too large to hold are as good as forever
+      for (; q < p && isdigit((unsigned char) *q) && secs < 1L << 31; q++) {
+        secs = secs * 10 + (*q - '0');
+      }
+      return secs;
+    }
+  }
+  return -1;
+}
+
+int http_parse_date(const slice_t *value, time_t *t) {
+  static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char buf[40], month[4], *m;
+  struct tm tm;
+
+  if (value->len >= sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, value->ptr, value->len);
+  buf[value->len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min,
+             &tm.tm_sec) != 6 || strlen(month) != 3 || (m = strstr(months, month)) == NULL || (m - months) % 3) {
+    return -1;
+  }
+  tm.tm_mon = (m - months) / 3;
+  tm.tm_year -= 1900;
+  *t = timegm(&tm);
+  return 0;
+}
+
+int http_parse_status(const char *line, size_t len, int *minor, int *status) {
+  if (len < 12 || strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char) line[7]) || line[8] != ' ') {
+    return -1;
+  }
+  for (int i = 9; i < 12; i++) {
+    if (!isdigit((unsigned char) line[i])) {
+      return -1;
+    }
+  }
+  if (len > 12 && line[12] != ' ' && line[12] != '\r' && line[12] != '\n') {
+    return -1;
+  }
+  *minor = line[7] - '0';
+  *status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+  return 0;
+}
+
+int http_parse_header(const char *line, size_t len, slice_t *name, slice_t *value) {
+  const char *end = line + len, *colon, *p;
+
+  while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+    end--;
+  }
+  if ((colon = scan_any2(line, end - line, ':', ':')) == NULL || colon == line) {
+    return -1;
+  }
+  name->ptr = line;
+  name->len = colon - line;
+  for (p = colon + 1; p < end && (*p == ' ' || *p == '\t'); p++);
+  value->ptr = p;
+  value->len = end - p;
+  return 0;
+}
+
+int http_parse_length(const slice_t *value, long *len) {
+  long n = 0;
+
+  // All digits, and few enough of them not to overflow
+  if (value->len == 0 || value->len > 18) {
+    return -1;
+  }
+  for (size_t i = 0; i < value->len; i++) {
+    if (value->ptr[i] < '0' || value->ptr[i] > '9') {
+      return -1;
+    }
+    n = 10 * n + (value->ptr[i] - '0');
+  }
+  *len = n;
+  return 0;
+}
+
+int slice_caseeq(const slice_t *s, const char *str) {
+  return strlen(str) == s->len && strncasecmp(s->ptr, str, s->len) == 0;
+}
+
+/* Unreserved characters (RFC 3986), an escape of one of them means the character itself */
+static int http_unreserved(int c) {
+  return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static int http_hexval(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/* Copies the n bytes at p to out with their escapes normalized, returns the bytes written (at most n) */
+static size_t http_normalize_escapes(char *out, const char *p, size_t n) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t o = 0;
+  int hi, lo;
+
+  for (size_t i = 0; i < n; i++) {
+    if (p[i] == '%' && i + 2 < n && (hi = http_hexval(p[i + 1])) >= 0 && (lo = http_hexval(p[i + 2])) >= 0) {
+      if (http_unreserved(hi * 16 + lo)) {
+        out[o++] = hi * 16 + lo;
+      } else {
+        out[o++] = '%';
+        out[o++] = hex[hi];
+        out[o++] = hex[lo];
+      }
+      i += 2;
+    } else {
+      out[o++] = p[i];
+    }
+  }
+  return o;
+}
+
+/* Copies the path of n bytes at in to out without its "." and ".." segments (RFC 3986 5.2.4), an empty path
+ * becomes "/". Returns the bytes written, at most n or 1.
+ */
+static size_t http_remove_dots(char *out, const char *in, size_t n) {
+  size_t o = 0, i = 0, j;
+
+  if (n > 0 && in[0] != '/') {
+    memcpy(out, in, n);
+    return n;
+  }
+  // Each round looks at one slash and the segment behind it
+  for (; i < n; i = j) {
+    for (j = i + 1; j < n && in[j] != '/'; j++);
+    if (j - i == 2 && in[i + 1] == '.') {
+      // Dropped, but a last one still leaves a directory
+      if (j == n) {
+        out[o++] = '/';
+      }
+    } else if (j - i == 3 && in[i + 1] == '.' && in[i + 2] == '.') {
+      // Goes back up over the previous segment, never above the root
+      while (o > 0 && out[o - 1] != '/') {
+        o--;
+      }
+      if (o > 0) {
+        o--;
+      }
+      if (j == n) {
+        out[o++] = '/';
+      }
+    } else {
+      memcpy(out + o, in + i, j - i);
+      o += j - i;
+    }
+  }
+  if (o == 0) {
+    out[o++] = '/';
+  }
+  return o;
+}
+
+static int http_param_cmp(const void *a, const void *b) {
+  const slice_t *x = a, *y = b;
+  int c = memcmp(x->ptr, y->ptr, x->len < y->len ? x->len : y->len);
+  return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+/* Copies the query of n bytes at in to out with its &-separated parameters sorted, returns n */
+static size_t http_sort_params(arena_t *arena, char *out, const char *in, size_t n) {
+  size_t count = 1, k = 0, o = 0, start = 0;
+  slice_t *params;
+
+  for (size_t i = 0; i < n; i++) {
+    count += (in[i] == '&');
+  }
+  if (count == 1 || (params = arena_alloc(arena, count * sizeof(slice_t))) == NULL) {
+    memcpy(out, in, n);
+    return n;
+  }
+  for (size_t i = 0; i <= n; i++) {
+    if (i == n || in[i] == '&') {
+      params[k].ptr = in + start;
+      params[k++].len = i - start;
+      start = i + 1;
+    }
+  }
+  qsort(params, count, sizeof(slice_t), http_param_cmp);
+  for (k = 0; k < count; k++) {
+    if (k > 0) {
+      out[o++] = '&';
+    }
+    memcpy(out + o, params[k].ptr, params[k].len);
+    o += params[k].len;
+  }
+  return o;
+}
+
+int http_make_key(arena_t *arena, const slice_t *host, int port, int default_port, const slice_t *path,
+                  int sort_query, http_key_t *key) {
+  const char *end = path->ptr + path->len, *query = NULL, *frag;
+  size_t path_len = path->len, query_len = 0, n;
+  int bracket = memchr(host->ptr, ':', host->len) != NULL; 	// IPv6 address, bracketed as in the uri
+  char *p, *tmp;
+
+  // Everything after # is for the client alone
+  if (path_len > 0 && (frag = memchr(path->ptr, '#', path_len)) != NULL) {
+    end = frag;
+    path_len = end - path->ptr;
+  }
+  if (path_len > 0 && (query = memchr(path->ptr, '?', path_len)) != NULL) {
+    path_len = query - path->ptr;
+    query_len = end - query - 1;
+  }
+
+  // http:// [host]:65535 / path ? query and the 0
+  key->str = p = arena_alloc(arena, 7 + host->len + 8 + path_len + 1 + query_len + 2);
+  tmp = arena_alloc(arena, path_len + query_len + 1);
+  if (p == NULL || tmp == NULL) {
+    key->str = NULL; 			// No key to count the request under
+    return -1;
+  }
+  memcpy(p, "http://", 7);
+  p += 7;
+  if (bracket) {
+    *p++ = '[';
+  }
+  for (size_t i = 0; i < host->len; i++) {
+    *p++ = tolower((unsigned char) host->ptr[i]);
+  }
+  if (bracket) {
+    *p++ = ']';
+  }
+  if (port != default_port) {
+    p += sprintf(p, ":%d", port);
+  }
+
+  // Escapes go first, so an escaped dot is a dot when the segments are looked at
+  n = http_normalize_escapes(tmp, path->ptr, path_len);
+  p += http_remove_dots(p, tmp, n);
+  if (query) {
+    *p++ = '?';
+    n = http_normalize_escapes(tmp, query + 1, query_len);
+    if (sort_query) {
+      p += http_sort_params(arena, p, tmp, n);
+    } else {
+      memcpy(p, tmp, n);
+      p += n;
+    }
+  }
+  *p = '\0';
+
+  key->len = p - key->str;
+  key->hash = http_hash64(key->str, key->len);
+  return 0;
+}
+
+uint64_t http_hash64(const char *p, size_t n) {
+  uint64_t h = 14695981039346656037ull;
+
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ (unsigned char) p[i]) * 1099511628211ull;
+  }
+  return h;
+}
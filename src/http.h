@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <arena.h>
+
+/* Return values of http_parse_request */
+#define HTTP_PARSE_DONE 0 	// Request line and headers are complete
+#define HTTP_PARSE_AGAIN 1 	// Need more bytes, call again with the same request and a longer buffer
+#define HTTP_PARSE_ERROR -1 	// Malformed request
+#define HTTP_PARSE_FULL 2 	// No room left for header fields, call again after http_request_grow
+
+/* A piece of the buffer being parsed, not 0-terminated */
+typedef struct {
+  const char *ptr;
+  size_t len;
+} slice_t;
+
+typedef struct {
+  slice_t name, value; 		// Value without its surrounding whitespace
+} http_header_t;
+
+/* A request head parsed in place. Slices point into the buffer given to http_parse_request and are
+ * only valid while it is.
+ */
+typedef struct {
+  slice_t method; 		// GET
+  slice_t uri; 			// http://localhost:8080/home.html
+  slice_t version; 		// HTTP/1.1, empty if the request line has none
+  http_header_t *headers; 	// Given by the caller
+  int nheaders, max_headers;
+  size_t head_len; 		// Bytes of request line and headers, including the final empty line
+
+  /* Parser state, private */
+  const char *base; 		// Buffer of the previous call, to move the slices if it moved
+  size_t pos; 			// Next byte to look at
+  size_t line; 			// Start of the line being read
+  int state;
+} http_request_t;
+
+/* Prepares req for a new request, whose header fields go in the max_headers of headers */
+void http_request_init(http_request_t *req, http_header_t *headers, int max_headers);
+
+/* Moves the header fields parsed so far to headers, which has room for more of them */
+void http_request_grow(http_request_t *req, http_header_t *headers, int max_headers);
+
+/* Parses the request head at the start of buf, len bytes of which are available. The parser resumes
+ * where the previous call stopped, so a buffer that grew is never rescanned from the start. buf may move
+ * between calls as long as it holds the same bytes at the same offsets.
+ */
+int http_parse_request(http_request_t *req, const char *buf, size_t len);
+
+/* Splits an absolute URI (http://host[:port]/path) or an origin-form one (/path) into its parts.
+ * Missing parts are left empty, an empty path is "/" on the wire. Returns 0, or -1 if uri is malformed.
+ */
+int http_parse_uri(const slice_t *uri, slice_t *host, slice_t *port, slice_t *path);
+
+/* Splits a Host header value (host[:port]) into its parts, port is left empty if absent.
+ * Returns 0, or -1 if value is malformed.
+ */
+int http_parse_host(const slice_t *value, slice_t *host, slice_t *port);
+
+/* Checks whether a comma-separated header value such as Connection lists token, ignoring case */
+int http_has_token(const slice_t *list, const char *token);
+
+/* Same as http_has_token, with the token given as a slice */
+int http_has_token_slice(const slice_t *list, const slice_t *token);
+
+/* Finds directive=N in a comma-separated header value such as Cache-Control, ignoring case.
+ * Returns N, or -1 if the directive is absent or not a number of seconds.
+ */
+long http_directive_secs(const slice_t *list, const char *directive);
+
+/* Parses an HTTP-date in its preferred format, "Sun, 06 Nov 1994 08:49:37 GMT".
+ * Returns 0 with *t set, or -1 if value is not one.
+ */
+int http_parse_date(const slice_t *value, time_t *t);
+
+/* Parses the status line of a response, "HTTP/1.x code reason", given with its length.
+ * Returns 0 with *minor and *status set, or -1 if it is not one.
+ */
+int http_parse_status(const char *line, size_t len, int *minor, int *status);
+
+/* Splits a header line of a response at its colon, the line ending and the whitespace around the value
+ * are left out. Unlike http_parse_request nothing else is checked, the line is only relayed.
+ * Returns 0, or -1 if the line has no header name.
+ */
+int http_parse_header(const char *line, size_t len, slice_t *name, slice_t *value);
+
+/* Parses a Content-Length value, which is nothing but decimal digits.
+ * Returns 0 with *len set, or -1 if value is not one.
+ */
+int http_parse_length(const slice_t *value, long *len);
+
+/* Case-insensitive comparison of a slice with a 0-terminated string */
+int slice_caseeq(const slice_t *s, const char *str);
+
+/* Canonical form of a request's target, naming what it asks for independently of how it was spelled.
+ * Its hash is computed once per request and reused by everything keyed on the target (cache shard and
+ * entry, metrics), none of which hash it again.
+ */
+typedef struct {
+  char *str; 			// http://host[:port]/path[?query], 0-terminated
+  size_t len;
+  uint64_t hash; 		// 64-bit FNV-1a of str
+} http_key_t;
+
+/* Builds the key of the target host:port + path in the arena. The host is lowercased and the port left out
+ * when it is default_port. In the path and query, escapes of unreserved characters are decoded and the others
+ * get uppercase hex digits, then "." and ".." segments are removed. The fragment is dropped, and the query
+ * parameters are sorted if sort_query is set. Returns 0, or -1 if the arena is out of memory.
+ */
+int http_make_key(arena_t *arena, const slice_t *host, int port, int default_port, const slice_t *path,
+                  int sort_query, http_key_t *key);
+
+/* 64-bit FNV-1a of the n bytes at p, the hash of http_key_t */
+uint64_t http_hash64(const char *p, size_t n);
@@ -0,0 +1,307 @@
+/*
+ * microbench - Microbenchmarks of the proxy's hot paths, without the network: the request parser, the header dict,
+ * the worker queue and rio. Each benchmark is repeated until it has run for BENCH_MIN_NS, then reported in
+ * ns per operation and bytes per second.
+ *
+ * usage: microbench [NAME_PREFIX], e.g. microbench sbuf
+ */
+#include <csapp.h>
+#include <dict.h>
+#include <sbuf.h>
+#include <arena.h>
+#include "http.h"
+
+#define BENCH_MIN_NS 200000000LL // Each benchmark runs at least this long
+#define BENCH_HEADERS 32
+#define RIO_FILE_SIZE (8 << 20)
+#define SBUF_ITEMS 400000 	// Items through the queue per run
+#define SBUF_SIZE 1024 		// As the proxy's
+
+/* A request as a browser sends it */
+static const char browser_request[] =
+  "GET http://www.example.com:8080/articles/2023/index.html?page=2&sort=date HTTP/1.1\r\n"
+  "Host: www.example.com:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Referer: http://www.example.com:8080/articles/2023/\r\n"
+  "Cookie: session=8f2a9c1e7b3d4f60a1b2c3d4e5f60718; theme=dark; consent=yes; _ga=GA1.1.123456789.1690000000\r\n"
+  "Connection: keep-alive\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "If-Modified-Since: Tue, 01 Aug 2023 10:00:00 GMT\r\n"
+  "If-None-Match: \"5f3e-60283a1c9e440\"\r\n"
+  "\r\n";
+
+/* A request as curl or the driver sends it */
+static const char small_request[] =
+  "GET http://localhost:8080/home.html HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: curl/8.0.1\r\n"
+  "Accept: */*\r\n"
+  "\r\n";
+
+/* A request line alone */
+static const char line_request[] = "GET http://localhost:8080/home.html HTTP/1.0\r\n\r\n";
+
+typedef struct {
+  const char *name;
+  long long ops; 			// Done by the last run
+  size_t bytes; 			// Processed by the last run
+} bench_t;
+
+static const char *filter;
+
+/* Prototype functions */
+static long long now_ns(void);
+static void report(const char*, long long, long long, size_t);
+static void run(const char*, void (*)(bench_t*, long long), long long);
+static void bench_parse(bench_t*, long long);
+static void bench_parse_headers(bench_t*, long long);
+static void bench_dict_put(bench_t*, long long);
+static void bench_dict_get(bench_t*, long long);
+static void *sbuf_producer(void*);
+static void *sbuf_consumer(void*);
+static void bench_sbuf(bench_t*, long long);
+static void bench_rio(bench_t*, long long);
+
+static const char *parse_input; 	// Request of the parse benchmarks
+static int dict_entries; 			// Entries of the dict benchmarks
+static int sbuf_threads; 		// Producers, and as many consumers
+static sbuf_t sbuf;
+static int rio_fd; 			// A file of lines of rio_line_len bytes
+static int rio_line_len;
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char *name, long long ns, long long ops, size_t bytes) {
+  printf("%-36s %12.1f ns/op %12.1f MB/s %12lld ops\n", name, (double) ns / ops,
+         bytes ? bytes * 1e3 / ns : 0.0, ops);
+  fflush(stdout);
+}
+
+/* Runs fn for n operations, with n growing until a run takes BENCH_MIN_NS */
+static void run(const char *name, void (*fn)(bench_t*, long long), long long n) {
+  bench_t b = { name };
+  long long start, ns;
+
+  if (filter && strncmp(name, filter, strlen(filter)) != 0) {
+    return;
+  }
+  while (1) {
+    b.ops = b.bytes = 0;
+    start = now_ns();
+    fn(&b, n);
+    ns = now_ns() - start;
+    if (ns >= BENCH_MIN_NS) {
+      break;
+    }
+    n = ns < BENCH_MIN_NS / 16 ? n * 16 : n * 2;
+  }
+  report(name, ns, b.ops, b.bytes);
+}
+
+/* http_parse_request on a whole request, given at once */
+static void bench_parse(bench_t *b, long long n) {
+  http_header_t headers[BENCH_HEADERS];
+  http_request_t req;
+  size_t len = strlen(parse_input);
+
+  for (long long i = 0; i < n; i++) {
+    http_request_init(&req, headers, BENCH_HEADERS);
+    if (http_parse_request(&req, parse_input, len) != HTTP_PARSE_DONE) {
+      fprintf(stderr, "%s: parse failed\n", b->name);
+      exit(1);
+    }
+  }
+  b->ops = n;
+  b->bytes = n * len;
+}
+
+/* Parsing and then copying the header fields into a dict in the request's arena, as serve_request does */
+static void bench_parse_headers(bench_t *b, long long n) {
+  http_header_t headers[BENCH_HEADERS];
+  http_request_t req;
+  arena_t arena;
+  size_t len = strlen(parse_input);
+
+  arena_init(&arena);
+  for (long long i = 0; i < n; i++) {
+    dict_t *dict;
+
+    http_request_init(&req, headers, BENCH_HEADERS);
+    http_parse_request(&req, parse_input, len);
+    dict = dict_create_arena(&arena);
+    for (int h = 0; h < req.nheaders; h++) {
+      dict_addkn(dict, headers[h].name.ptr, headers[h].name.len, headers[h].value.ptr, headers[h].value.len);
+    }
+    dict_put(dict, "Connection", "keep-alive");
+    if (!dict_get(dict, "Host")) {
+      exit(1);
+    }
+    arena_reset(&arena);
+  }
+  arena_destroy(&arena);
+  b->ops = n;
+  b->bytes = n * len;
+}
+
+/* Fills a malloc'ed dict with dict_entries entries, n times in all. The bytes are those of the keys and values. */
+static void bench_dict_put(bench_t *b, long long n) {
+  char key[32];
+  long long done = 0;
+
+  while (done < n) {
+    dict_t *dict = dict_create();
+
+    for (int i = 0; i < dict_entries; i++) {
+      b->bytes += sprintf(key, "X-Header-%d", i) + sizeof("some value");
+      dict_put(dict, key, "some value");
+    }
+    dict_destroy(dict);
+    done += dict_entries;
+  }
+  b->ops = done;
+}
+
+/* Looks up every entry of a dict of dict_entries entries, n times in all. The bytes are those of the keys. */
+static void bench_dict_get(bench_t *b, long long n) {
+  dict_t *dict = dict_create();
+  char (*keys)[32] = malloc(dict_entries * sizeof(*keys));
+  long long done = 0;
+
+  for (int i = 0; i < dict_entries; i++) {
+    sprintf(keys[i], "X-Header-%d", i);
+    dict_put(dict, keys[i], "some value");
+  }
+  while (done < n) {
+    for (int i = 0; i < dict_entries; i++) {
+      if (!dict_get(dict, keys[i])) {
+        exit(1);
+      }
+      b->bytes += strlen(keys[i]);
+    }
+    done += dict_entries;
+  }
+  dict_destroy(dict);
+  free(keys);
+  b->ops = done;
+}
+
+static void *sbuf_producer(void *vargp) {
+  long long n = *(long long*) vargp;
+
+  for (long long i = 0; i < n; i++) {
+    sbuf_insert(&sbuf, i);
+  }
+  return NULL;
+}
+
+static void *sbuf_consumer(void *vargp) {
+  long long n = *(long long*) vargp;
+
+  for (long long i = 0; i < n; i++) {
+    sbuf_remove(&sbuf);
+  }
+  return NULL;
+}
+
+/* n items through the queue from sbuf_threads producers to as many consumers */
+static void bench_sbuf(bench_t *b, long long n) {
+  pthread_t tids[2 * 64];
+  long long each = n / sbuf_threads;
+
+  sbuf_init(&sbuf, SBUF_SIZE);
+  for (int i = 0; i < sbuf_threads; i++) {
+    Pthread_create(&tids[2 * i], NULL, sbuf_consumer, &each);
+    Pthread_create(&tids[2 * i + 1], NULL, sbuf_producer, &each);
+  }
+  for (int i = 0; i < 2 * sbuf_threads; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+  sbuf_deinit(&sbuf);
+  b->ops = each * sbuf_threads;
+  b->bytes = b->ops * sizeof(int);
+}
+
+/* Reads the lines of the file with rio_readlineb, n lines in all */
+static void bench_rio(bench_t *b, long long n) {
+  char line[MAXLINE];
+  rio_t rio;
+  long long done = 0;
+  ssize_t len;
+
+  while (done < n) {
+    lseek(rio_fd, 0, SEEK_SET);
+    rio_readinitb(&rio, rio_fd);
+    while (done < n && (len = rio_readlineb(&rio, line, MAXLINE)) > 0) {
+      b->bytes += len;
+      done++;
+    }
+  }
+  b->ops = done;
+}
+
+int main(int argc, char **argv) {
+  static const int dict_sizes[] = { 8, 64, 512, 4096 };
+  static const int line_lens[] = { 32, 128, 1024 };
+  char name[64], path[] = "/tmp/benchXXXXXX";
+
+  filter = argc > 1 ? argv[1] : NULL;
+
+  parse_input = line_request;
+  run("parse_request/line", bench_parse, 1000);
+  parse_input = small_request;
+  run("parse_request/small", bench_parse, 1000);
+  parse_input = browser_request;
+  run("parse_request/browser", bench_parse, 1000);
+  parse_input = small_request;
+  run("parse_request_headers/small", bench_parse_headers, 1000);
+  parse_input = browser_request;
+  run("parse_request_headers/browser", bench_parse_headers, 1000);
+
+  for (int i = 0; i < sizeof(dict_sizes) / sizeof(dict_sizes[0]); i++) {
+    dict_entries = dict_sizes[i];
+    sprintf(name, "dict_put/%d", dict_entries);
+    run(name, bench_dict_put, 4096);
+    sprintf(name, "dict_get/%d", dict_entries);
+    run(name, bench_dict_get, 4096);
+  }
+
+  for (sbuf_threads = 1; sbuf_threads <= 64; sbuf_threads *= 2) {
+    sprintf(name, "sbuf/%d+%d", sbuf_threads, sbuf_threads);
+    run(name, bench_sbuf, SBUF_ITEMS);
+  }
+
+  for (int i = 0; i < sizeof(line_lens) / sizeof(line_lens[0]); i++) {
+    char *buf = malloc(RIO_FILE_SIZE);
+
+    rio_line_len = line_lens[i];
+    sprintf(name, "rio_readlineb/%d", rio_line_len);
+    if (filter && strncmp(name, filter, strlen(filter)) != 0) {
+      free(buf);
+      continue;
+    }
+    // A file in the page cache: what is measured is rio, not the disk
+    if ((rio_fd = mkstemp(path)) < 0) {
+      perror("mkstemp");
+      exit(1);
+    }
+    unlink(path);
+    for (int j = 0; j < RIO_FILE_SIZE; j++) {
+      buf[j] = j % rio_line_len == rio_line_len - 1 ? '\n' : 'a' + j % 26;
+    }
+    rio_writen(rio_fd, buf, RIO_FILE_SIZE);
+    free(buf);
+    run(name, bench_rio, 10000);
+    close(rio_fd);
+    strcpy(path, "/tmp/benchXXXXXX");
+  }
+  return 0;
+}
@@ -0,0 +1,223 @@
+#include <csapp.h>
+#include <lock.h>
+#include <memacct.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "proxy.h"
+#include "pool.h"
+
+/* An idle connection waiting in the pool */
+typedef struct {
+  int fd;
+  time_t created; 		// When it was opened
+  time_t idle_since; 		// When it was last given back
+} pool_conn_t;
+
+/* Idle connections to one origin, most recently released last */
+typedef struct pool_origin {
+  char *host;
+  char *port;
+  pool_conn_t idle[POOL_MAX_IDLE];
+  int nidle;
+  struct pool_origin *next;
+} pool_origin_t;
+
+/* Each bucket has its own lock so threads talking to different origins rarely contend */
+typedef struct {
+  lock_t lock;
+  pool_origin_t *origins;
+} pool_bucket_t;
+
+static pool_bucket_t buckets[POOL_BUCKETS];
+static int idle_total; 		// Idle connections in all buckets, kept under POOL_MAX_IDLE_TOTAL
+
+/* Seconds on a clock that doesn't jump when the wall clock is changed */
+static time_t pool_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* FNV-1a over the lowercased host and the port */
+static unsigned pool_hash(const char *host, const char *port) {
+  unsigned h = 2166136261u;
+  for (; *host; host++) {
+    h = (h ^ (unsigned char) tolower(*host)) * 16777619u;
+  }
+  h = (h ^ ':') * 16777619u;
+  for (; *port; port++) {
+    h = (h ^ (unsigned char) *port) * 16777619u;
+  }
+  return h % POOL_BUCKETS;
+}
+
+/* Finds the origin entry for host:port in bucket b, creating it if create is set. Bucket must be locked. */
+static pool_origin_t *pool_find(pool_bucket_t *b, const char *host, const char *port, int create) {
+  pool_origin_t *o;
+  for (o = b->origins; o; o = o->next) {
+    if (strcasecmp(o->host, host) == 0 && strcmp(o->port, port) == 0) {
+      return o;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  o = calloc(1, sizeof(pool_origin_t));
+  o->host = strdup(host);
+  o->port = strdup(port);
+  memacct_add(MEM_POOL, sizeof(pool_origin_t) + strlen(host) + 1 + strlen(port) + 1);
+  o->next = b->origins;
+  b->origins = o;
+  return o;
+}
+
+/* An idle connection is healthy if it is young enough and the server hasn't closed it or sent anything unasked */
+static int pool_healthy(pool_conn_t *c, time_t now) {
+  struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+
+  if (now - c->created >= POOL_MAX_AGE || now - c->idle_since >= POOL_IDLE_TIMEOUT) {
+    return 0;
+  }
+  // Readable means EOF, RST or stray bytes: none of which we can use for a new request
+  return poll(&pfd, 1, 0) == 0;
+}
+
+/* Frees an origin entry without idle connections */
+static void pool_free_origin(pool_origin_t *o) {
+  memacct_add(MEM_POOL, -(long) (sizeof(pool_origin_t) + strlen(o->host) + 1 + strlen(o->port) + 1));
+  free(o->host);
+  free(o->port);
+  free(o);
+}
+
+/* Every POOL_SWEEP_INTERVAL, closes the idle connections pool_acquire would not hand out and frees the
+ * origins left without any. Otherwise those of an origin no longer asked for stay open, often half-closed
+ * by the server, and its entry stays forever.
+ */
+static void *pool_sweeper(void *vargp) {
+  Pthread_detach(pthread_self());
+  while (1) {
+    sleep(POOL_SWEEP_INTERVAL);
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+      pool_bucket_t *b = &buckets[i];
+      pool_origin_t **po;
+      time_t now = pool_now();
+
+      lock_acquire(&b->lock);
+      for (po = &b->origins; *po;) {
+        pool_origin_t *o = *po;
+        int kept = 0;
+        for (int j = 0; j < o->nidle; j++) {
+          if (pool_healthy(&o->idle[j], now)) {
+            o->idle[kept++] = o->idle[j];
+          } else {
+            close(o->idle[j].fd);
+            __atomic_sub_fetch(&idle_total, 1, __ATOMIC_RELAXED);
+          }
+        }
+        o->nidle = kept;
+        if (kept == 0) {
+          *po = o->next;
+          pool_free_origin(o);
+        } else {
+          po = &o->next;
+        }
+      }
+      lock_release(&b->lock);
+    }
+  }
+  return NULL;
+}
+
+void pool_init(void) {
+  pthread_t tid;
+
+  memacct_add(MEM_POOL, sizeof(buckets));
+  for (int i = 0; i < POOL_BUCKETS; i++) {
+    lock_init(&buckets[i].lock, "pool");
+    buckets[i].origins = NULL;
+  }
+  Pthread_create(&tid, NULL, pool_sweeper, NULL);
+}
+
+int pool_acquire(upstream_t *up, char *host, char *port) {
+  pool_bucket_t *b = &buckets[pool_hash(host, port)];
+  pool_origin_t *o;
+  time_t now = pool_now();
+  int fd;
+
+  lock_acquire(&b->lock);
+  o = pool_find(b, host, port, 0);
+  // Take the most recently used connection first, it is the least likely to have been closed by the server
+  while (o && o->nidle > 0) {
+    pool_conn_t c = o->idle[--o->nidle];
+    __atomic_sub_fetch(&idle_total, 1, __ATOMIC_RELAXED);
+    if (pool_healthy(&c, now)) {
+      lock_release(&b->lock);
+      up->fd = c.fd;
+      up->reused = 1;
+      up->created = c.created;
+      return 0;
+    }
+    close(c.fd);
+  }
+  lock_release(&b->lock);
+
+  // Nothing idle for this origin, open a fresh connection
+  if ((fd = open_clientfd(host, port)) < 0) {
+    return fd;
+  }
+  // A request body follows its head in a second write, which must not wait for the head's ack
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+  up->fd = fd;
+  up->reused = 0;
+  up->created = now;
+  return 0;
+}
+
+void pool_release(upstream_t *up, char *host, char *port, int reusable) {
+  pool_bucket_t *b;
+  pool_origin_t *o;
+  time_t now = pool_now();
+  int evict = -1;
+
+  if (!reusable || now - up->created >= POOL_MAX_AGE) {
+    close(up->fd);
+    up->fd = -1;
+    return;
+  }
+
+  b = &buckets[pool_hash(host, port)];
+  lock_acquire(&b->lock);
+  o = pool_find(b, host, port, 0);
+  // The pool is full, only an origin with its max idle connections can still swap its oldest for this one
+  if ((o == NULL || o->nidle < POOL_MAX_IDLE) &&
+      __atomic_load_n(&idle_total, __ATOMIC_RELAXED) >= POOL_MAX_IDLE_TOTAL) {
+    lock_release(&b->lock);
+    close(up->fd);
+    up->fd = -1;
+    return;
+  }
+  if (o == NULL) {
+    o = pool_find(b, host, port, 1);
+  }
+  // Origin already has the max idle connections, drop the one idle for the longest
+  if (o->nidle == POOL_MAX_IDLE) {
+    evict = o->idle[0].fd;
+    memmove(&o->idle[0], &o->idle[1], (POOL_MAX_IDLE - 1) * sizeof(pool_conn_t));
+    o->nidle--;
+  }
+  o->idle[o->nidle].fd = up->fd;
+  o->idle[o->nidle].created = up->created;
+  o->idle[o->nidle].idle_since = now;
+  o->nidle++;
+  if (evict < 0) {
+    __atomic_add_fetch(&idle_total, 1, __ATOMIC_RELAXED);
+  }
+  lock_release(&b->lock);
+
+  if (evict >= 0) {
+    close(evict);
+  }
+  up->fd = -1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <time.h>
+
+#define POOL_BUCKETS 256 	// Number of hash buckets used to find an origin's idle list
+#define POOL_MAX_IDLE 8 	// Max idle connections kept per origin (host:port)
+#define POOL_IDLE_TIMEOUT 30 	// Seconds an idle connection may sit in the pool
+#define POOL_MAX_AGE 300 	// Seconds after which a connection is never reused
+#define POOL_MAX_IDLE_TOTAL 1024 // Max idle connections kept for all origins together
+#define POOL_SWEEP_INTERVAL 5 	// Seconds between sweeps closing the connections that can no longer be used
+
+/* An upstream connection handed out by the pool */
+typedef struct {
+  int fd; 			// Connected socket to the origin
+  int reused; 			// 1 if it came from the pool, 0 if freshly opened
+  time_t created; 		// When the connection was opened (for POOL_MAX_AGE)
+} upstream_t;
+
+/* Initialize the pool and start its sweeper thread, must be called once before any worker thread starts */
+void pool_init(void);
+
+/* Hand out a healthy idle connection to host:port, or open a new one with open_clientfd.
+ * Returns 0 on success, otherwise the error code of open_clientfd.
+ */
+int pool_acquire(upstream_t *up, char *host, char *port);
+
+/* Give the connection back to the pool if reusable is set and it is still young enough, otherwise close it */
+void pool_release(upstream_t *up, char *host, char *port, int reusable);
@@ -1,411 +1,1104 @@
 #include <stdio.h>
 #include <csapp.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include <sbuf.h>
 #include <dict.h>
+#include <arena.h>
+#include <memacct.h>
+#include <lock.h>
+#include <scan.h>
 #include "proxy.h"
 #include "cache.h"
+#include "pool.h"
+#include "wheel.h"
+#include "http.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "topk.h"
 
 #define DEFAULT_PORT 8080
 #define NTHREADS 64
 #define SBUFSIZE 1024
+#define CLIENT_IDLE_TIMEOUT 15 	// Seconds a kept-alive client connection may wait for its next request
+#define HEADER_TIMEOUT 10 		// Seconds a client has to send its request line and headers
+#define BODY_TIMEOUT 15 		// Seconds a request or response body may go without progress
+#define UPSTREAM_TTFB_TIMEOUT 30 	// Seconds the server has to start answering once it has the request
+#define MAX_REQUESTS_PER_CONN 100 	// Requests served on one client connection before it is closed
+#define MAX_HEAD_SIZE (64 * 1024) 	// Default for -H, the largest request line and headers accepted from a client,
+ 					// and the longest line of a response head
+#define HEAD_SPILL_SIZE (2 * RIO_BUFSIZE) // First size of the buffer a head too large for rio moves to, doubled as needed
+#define REQ_HEADERS 32 			// Header fields a request has room for at first, doubled as needed
+#define WORKER_STACK_SIZE (128 * 1024) 	// Workers keep their buffers in their connection context, not on the stack
 sbuf_t sbuf; // Global thread connection buffer
+static size_t max_head_size = MAX_HEAD_SIZE; // Requests with a larger head get a 431, responses with a longer line are cut off
+static int sort_query; // Set by -q: uris whose query parameters only differ in order share a cache entry
+static int report_secs; // Set by -s: seconds between latency reports on stderr
+static char *access_log; // Set by -l: file the access log is appended to
+
+/* Which sockets get shut down when a connection's deadline expires */
+#define DEADLINE_CLIENT 1
+#define DEADLINE_HOST 2
+
+/* Client connection served by a worker, its deadline is shared with the timer wheel thread.
+ * Each worker owns one context on the heap and reuses it for every connection it serves: only the
+ * fields below the buffers are reset, the buffers are overwritten as data comes in.
+ */
+typedef struct {
+  int fd; 			// Client connection
+  int host_fd; 			// Server connection used by the current request, -1 if none
+  int deadline_fds; 		// DEADLINE_CLIENT and/or DEADLINE_HOST
+  int expired; 			// Set by the wheel thread when the deadline passed
+  time_t armed_at; 		// When the deadline was last pushed back
+  wtimer_t deadline;
+  arena_t arena; 		// Memory for the request being served, grows as needed and is reset for each one
+  rio_t rio; 			// Client rio, kept across requests so pipelined bytes are not lost
+  rio_t host_rio; 		// Server rio of the current request
+  http_key_t key; 		// Normalized target of the current request, in the arena
+  char *capture; 		// Copy of the response being relayed for the cache, NULL if it is not kept
+  size_t capture_len, capture_size;
+  size_t capture_split; 	// Where our Connection header was left out of the copy
+  time_t expires; 		// When the copy goes stale, 0 if the response didn't say
+  stats_thread_t *stats; 	// The worker's own latency histograms
+  long long started_at; 	// When the first byte of the current request was there
+  long long sent_at; 		// When the server had the whole request
+  long long body_at; 		// When the response headers were relayed
+  log_cache_t cache; 		// What the cache did for the current request
+  int method; 			// METHOD_GET, METHOD_POST or METHOD_OTHER, of the current request
+  int status; 			// Of the response to the current request, 0 until there is one
+  size_t bytes_in, bytes_out; 	// Of the current request, from and to the client
+  log_ring_t *log; 		// The worker's access log records, NULL if there is no log
+  log_record_t *record; 	// Record of the current request, filled as it is served, NULL if not logged
+  char client[INET6_ADDRSTRLEN]; // Address of the client, only filled in for the log
+  topk_batch_t topk; 		// Requests not yet added to the heavy hitter sketches
+} conn_t;
 
 /* Prototype functions */
 static void usage(const char*);
 static void *thread(void*);
-static void add_to_buf(dict_t*, char*);
-static void parse_header_and_val(dict_t*, char*);
-static void clienterror(int, char*, char*, char*, char*);
-static int serve_client(int);
-static int parse_request_headers(rio_t*, dict_t*, char*, size_t);
-static int parse_request(int, char*, char*, char*, char*);
-static int forward_to_server(int, rio_t*, char*, char*, char*, char*, char*);
+static char *build_request(arena_t*, const char*, const slice_t*, dict_t*, size_t*);
+static void clienterror(conn_t*, char*, char*, char*, char*);
+static int out_of_memory(conn_t*);
+static int is_hop_by_hop(const http_request_t*, const slice_t*);
+static void serve_connection(conn_t*, int);
+static void conn_expired(void*);
+static void conn_deadline(conn_t*, int, int);
+static void conn_progress(conn_t*);
+static void conn_nodeadline(conn_t*);
+static int serve_client(conn_t*, rio_t*, int*);
+static int serve_request(conn_t*, rio_t*, http_request_t*, int*);
+static int read_request_head(conn_t*, rio_t*, http_request_t*);
+static ssize_t read_line(conn_t*, rio_t*, char**);
+static int is_blank(const char*, ssize_t);
+static int forward_to_server(conn_t*, rio_t*, char*, char*, char*, size_t, char*, long, int*);
+static int relay_bytes(conn_t*, rio_t*, int, size_t);
+static int relay_response(conn_t*, rio_t*, int*, int*);
+static int client_write(conn_t*, const char*, size_t);
+static void capture_drop(conn_t*);
+static void client_cork(conn_t*, int);
+static int serve_stats(conn_t*, int);
+static void count_request(conn_t*);
+static void log_start(conn_t*, http_request_t*);
+static void log_request(conn_t*);
+static void conn_phase(conn_t*, int, long long);
 
 /* Usage function to assist in format on command line */
 static void usage (const char *progname) {
-  fprintf (stderr, "usage: %s PORT\n", progname);
+  fprintf (stderr, "usage: %s [-q] [-s REPORT_SECS] [-l ACCESS_LOG] [-H MAX_HEADER_BYTES] [-E lru|fifo|clock] [-L] PORT\n", progname);
   exit (1);
 }
 
-/* Prints diagnostic information to client on error */
-static void clienterror(int connected_fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-  char buf[MAXLINE];
-  sprintf(buf, "\r\n");
-  rio_writen(connected_fd, buf, strlen (buf));
-  sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-  rio_writen (connected_fd, buf, strlen (buf));
-  sprintf(buf, "%s: %s\r\n", longmsg, cause);
-  rio_writen(connected_fd, buf, strlen (buf));
+/* Prints diagnostic information to client on error. The pieces are gathered by writev rather than
+ * formatted in a buffer, the cause can be as long as a host name.
+ */
+static void clienterror(conn_t *conn, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+  ssize_t n;
+  struct iovec iov[] = {
+    { "\r\n", 2 },
+    { errnum, strlen(errnum) }, { ": ", 2 }, { shortmsg, strlen(shortmsg) }, { "\r\n", 2 },
+    { longmsg, strlen(longmsg) }, { ": ", 2 }, { cause, strlen(cause) }, { "\r\n", 2 },
+  };
+  conn->status = atoi(errnum);
+  if ((n = writev(conn->fd, iov, sizeof(iov) / sizeof(iov[0]))) > 0) {
+    conn->bytes_out += n;
+  }
   return;
 }
 
-/* Simple function which formats headers in the buf before request is sent to the server */
-static void add_to_buf(dict_t *dictionary, char *buf) {
-  dict_foreach(dictionary,
-  {
-    strcat(buf, key);
-    strcat(buf, ":");
-    strcat(buf, " ");
-    strcat(buf, val);
-  )};
-  return;
+/* Refuses the current request with a 500 when memory for it ran out, returns -1 for serve_request */
+static int out_of_memory(conn_t *conn) {
+  clienterror(conn, "request", "500", "Internal Server Error", "Out of memory for the");
+  return -1;
 }
 
-/* Parses a buffer line read from the client and adds the header and val to a dictionary */
-static void parse_header_and_val(dict_t *headers, char* buf) {
-  char header_key[MAXLINE];
-  char header_val[MAXLINE];
-  char *temp_pos, *temp_pos2;
-  int key_len, val_len;
-
-  temp_pos = strpbrk(buf, ":"); 	// Find when we get to colon
-  temp_pos2 = temp_pos + 2; 		// Move forward two to get rid of colon and space before val
-	
-  key_len = temp_pos - buf;
-  val_len = strlen(temp_pos2);
-  strncpy(header_key, buf, key_len);
-  header_key[key_len] = '\0';
-  strncpy(header_val, temp_pos2, val_len);
-
-  // Append CLRF to header_val
-  header_val[val_len] = '\n';
-  header_val[val_len - 1] = '\r';
-
-  // Put header_key and header_val in dict
-  if (dict_get(headers, header_key)) {
-  } 
-  else {
-    dict_put(headers, header_key, header_val);
+/* Checks whether a request header only concerns the client's connection to the proxy, so is not forwarded:
+ * the hop-by-hop headers, and those the client's Connection headers name.
+ */
+static int is_hop_by_hop(const http_request_t *req, const slice_t *name) {
+  static const char *hop[] = { "Connection", "Proxy-Connection", "Keep-Alive", "TE", "Trailer",
+                               "Transfer-Encoding", "Upgrade", "Proxy-Authorization" };
+
+  for (size_t i = 0; i < sizeof(hop) / sizeof(hop[0]); i++) {
+    if (slice_caseeq(name, hop[i])) {
+      return 1;
+    }
   }
-  return;
+  for (int i = 0; i < req->nheaders; i++) {
+    const http_header_t *h = &req->headers[i];
+    if ((slice_caseeq(&h->name, "Connection") || slice_caseeq(&h->name, "Proxy-Connection")) &&
+        http_has_token_slice(&h->value, name)) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
-/* Parses headers from request, places them in a dictionary for reference later */
-static int parse_request_headers(rio_t *rp, dict_t *headers, char *host, size_t curr_buf_size) {
-  char buf[MAXLINE];
+/* Formats the request line and headers to send to the server in one buffer from the arena. It is sized
+ * first so each byte is then copied once, *plen is set to its length. Returns NULL if the arena is out
+ * of memory.
+ */
+static char *build_request(arena_t *arena, const char *method, const slice_t *path, dict_t *headers, size_t *plen) {
+  size_t method_len = strlen(method);
+  size_t size = method_len + path->len + strlen(" / HTTP/1.1\r\n\r\n");
+  char *buf, *p;
+
+  dict_foreach(headers,
+  {
+    size += strlen(key) + len + 3; 	// ": " and CRLF, len counts the 0
+  });
+  if ((p = buf = arena_alloc(arena, size)) == NULL) {
+    return NULL;
+  }
+
+  // Request line with correct format to send to server GET /path HTTP/1.1
+  memcpy(p, method, method_len);
+  p += method_len;
+  *p++ = ' ';
+  if (path->len == 0 || path->ptr[0] != '/') {
+    *p++ = '/';
+  }
+  memcpy(p, path->ptr, path->len);
+  p += path->len;
+  memcpy(p, " HTTP/1.1\r\n", 11); 	// Server is always spoken to in HTTP/1.1 so its connection can be pooled
+  p += 11;
+
+  dict_foreach(headers,
+  {
+    size_t key_len = strlen(key);
+    memcpy(p, key, key_len);
+    p += key_len;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, val, len - 1);
+    p += len - 1;
+    *p++ = '\r';
+    *p++ = '\n';
+  });
+  *p++ = '\r'; 				// CRLF as the end of a request
+  *p++ = '\n';
+
+  *plen = p - buf;
+  return buf;
+}
+
+/* Reads the client's request line and headers and parses them where they are, in rio's buffer. A head larger
+ * than that buffer is moved to a spill buffer from the request's arena, which grows until max_head_size.
+ * Returns 0 with the head consumed from rio, -1 if the client went away, or the 400 or 431 status the
+ * request has to be refused with, 500 if the arena ran out of memory.
+ */
+static int read_request_head(conn_t *conn, rio_t *rio, http_request_t *req) {
+  char *spill = NULL; 			// Holds a head too large for rio's buffer
+  size_t spill_len = 0, spill_size = 0;
   size_t len;
-  int n;
-  // Put headers we don't want to change now into dict then into buf
-  dict_put(headers, "Connection", "close\r\n");
-  dict_put(headers, "Proxy-Connection", "close\r\n");
-  dict_put(headers, "User-Agent", USER_AGENT);
-  // Headers should exist, mostly a robustness test
-  if (dict_get(headers, "Connection") ||
-    dict_get(headers, "Proxy-Connection") ||
-    dict_get(headers, "User-Agent")) {
-  } else {
-    add_to_buf(headers, buf);
-  }
-
-  // Calc current buf size so we cannot exceed n bytes for header storage
-  len = strlen(buf);
-  len += curr_buf_size;
-  n = strlen(buf) + curr_buf_size;
-  len += rio_readlineb(rp, buf, MAXLINE);
-
-  // Loop until we find CLRF and or when the line read exceeds MAXLINE bytes
-  while ((strcmp(buf, "\r\n") != 0) && (len < MAXLINE)) {
-    colon = strchr(buf, ':'); 
-    // Only add to dict when headers are in complete form of (header_key: header_val)
-    if (len < MAXLINE && colon != NULL) {
-      parse_header_and_val(headers, buf);
-      n += strlen(buf);
-      len += rio_readlineb(rp, buf, MAXLINE);
+  int started = rio->rio_cnt > 0; 	// Bytes of this request already came in, pipelined behind the previous one
+  int rc;
+  ssize_t n;
+  http_header_t *headers;
+
+  if ((headers = arena_alloc(&conn->arena, REQ_HEADERS * sizeof(http_header_t))) == NULL) {
+    return 500;
+  }
+  http_request_init(req, headers, REQ_HEADERS);
+  if (started) {
+    conn->started_at = stats_now();
+  }
+  while (1) {
+    len = spill ? spill_len : (rio->rio_cnt > 0 ? rio->rio_cnt : 0);
+    rc = http_parse_request(req, spill ? spill : rio->rio_bufptr, len);
+    if (rc == HTTP_PARSE_DONE) {
+      break;
+    }
+    if (rc == HTTP_PARSE_ERROR) {
+      return 400;
+    }
+    if (rc == HTTP_PARSE_FULL) {
+      int max = 2 * req->max_headers;
+      if ((headers = arena_alloc(&conn->arena, max * sizeof(http_header_t))) == NULL) {
+        return 500;
+      }
+      http_request_grow(req, headers, max);
+      continue;
+    }
+    if (len >= max_head_size) {
+      return 431;
+    }
+
+    if (spill == NULL && rio->rio_cnt < RIO_BUFSIZE) {
+      // Read more behind what rio holds, the parser picks up where it stopped
+      n = rio_fillb(rio);
     } else {
+      // rio's buffer is full of this head, carry on in a buffer of our own. The parser follows the bytes
+      // each time they move to a larger one.
+      if (spill_len == spill_size) {
+        char *bigger;
+        spill_size = spill_size ? 2 * spill_size : HEAD_SPILL_SIZE;
+        if (spill_size > max_head_size) {
+          spill_size = max_head_size;
+        }
+        if ((bigger = arena_alloc(&conn->arena, spill_size)) == NULL) {
+          return 500;
+        }
+        if (spill) {
+          memcpy(bigger, spill, spill_len);
+        } else {
+          memcpy(bigger, rio->rio_bufptr, rio->rio_cnt);
+          spill_len = rio->rio_cnt;
+          rio_consumeb(rio, rio->rio_cnt);
+        }
+        spill = bigger;
+      }
+      if ((n = rio_readsomeb(rio, spill + spill_len, spill_size - spill_len)) > 0) {
+        spill_len += n;
+      }
+    }
+    if (n <= 0) {
       return -1;
     }
+    // Request started, the rest of the headers have to follow soon
+    if (!started) {
+      conn_deadline(conn, HEADER_TIMEOUT, DEADLINE_CLIENT);
+      conn->started_at = stats_now();
+      started = 1;
+    }
   }
-  // Get last line we read and put header in dict if read is close to MAXLINE bytes
-  if (MAXLINE - n < 120 && strcmp(buf, "\r\n") != 0) {
-    parse_header_and_val(headers, buf);
-    return -2;
+  if (req->head_len > max_head_size) {
+    return 431;
+  }
+  conn_phase(conn, PHASE_PARSE, stats_now() - conn->started_at);
+
+  // Bytes after the head are the body or the next request. Those read into the spill buffer all came with
+  // the last read, so they fit back in rio along with what it still holds.
+  if (spill) {
+    rio_unreadb(rio, spill + req->head_len, spill_len - req->head_len);
   } else {
-    return 0;
+    rio_consumeb(rio, req->head_len);
   }
+  return 0;
 }
 
-/* Parses uri from request, makes sure it contains the necessary beginning and stores each component in its own string */
-static int parse_request(int connected_fd, char *uri, char *host, char *port, char *path) {
-  // Simple request in curl
-  if (strcmp(uri, "/") == 0) {
-    strcpy(path, "/");
-    return 0;
+/* Writes n bytes of the response to the client, and to the copy kept for the cache while there is one.
+ * A response larger than the cache's max_object_size is not kept.
+ */
+static int client_write(conn_t *conn, const char *buf, size_t n) {
+  conn->bytes_out += n;
+  if (conn->capture) {
+    size_t max_size = cache_max_object_size();
+    if (conn->capture_len + n > max_size) {
+      capture_drop(conn);
+    } else {
+      if (conn->capture_len + n > conn->capture_size) {
+        char *bigger;
+        size_t size = 2 * conn->capture_size;
+        while (size < conn->capture_len + n) {
+          size *= 2;
+        }
+        if (size > max_size) {
+          size = max_size;
+        }
+        if ((bigger = memacct_realloc(MEM_RELAY, conn->capture, conn->capture_size, size)) == NULL) {
+          capture_drop(conn);
+          return rio_writen(conn->fd, (void *) buf, n);
+        }
+        conn->capture = bigger;
+        conn->capture_size = size;
+      }
+      memcpy(conn->capture + conn->capture_len, buf, n);
+      conn->capture_len += n;
+    }
   }
-  char *temp_pos, *temp_pos2, *temp_pos3, *temp_pos4, *temp_port;
-  int host_length, port_length;
-  char http_front[7];
+  return rio_writen(conn->fd, (void *) buf, n);
+}
 
-  strncpy(http_front, uri, 7);
-  http_front[7] = '\0';
+/* The response is not going to the cache */
+static void capture_drop(conn_t *conn) {
+  memacct_free(MEM_RELAY, conn->capture, conn->capture_size);
+  conn->capture = NULL;
+}
 
-  // If the URL doesn't start with http:// then error 
-  if (strcmp(http_front, "http://") != 0) {
-    return -1;
-  }
+/* Holds back partial segments to the client while set, so the head of a response relayed line by line goes
+ * out in full segments when it is cleared. The client socket has TCP_NODELAY otherwise.
+ */
+static void client_cork(conn_t *conn, int on) {
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* Relays n bytes from a robust reader to fd, writing each piece straight from the reader's buffer as soon
+ * as it arrives. The connection's body deadline is pushed back as long as bytes keep moving.
+ */
+static int relay_bytes(conn_t *conn, rio_t *from, int to_fd, size_t n) {
+  char *bufp;
+  ssize_t rc;
 
-  // Need temp_host storage as headers end with CLRF 
-  char temp_host[MAXLINE];
-  memset(temp_host, 0, MAXLINE);	
-  temp_pos = strstr(uri, "//"); 	// Get us to // in the uri
-  temp_pos += 2; 			// We move two spots ahead now we just have the host, port, and path leftover to read
-
-  // Finds the end of host when ':', '/' '/0' or CLRF char found
-  temp_pos2 = strpbrk(temp_pos, " :/\r\n\0");
-  host_length = temp_pos2 - temp_pos;
-  strncpy(temp_host, temp_pos, host_length);
-  host[host_length] = '\0';
-
-  // Check to see if there is a port num specified
-  if (*temp_pos2 == ':') {
-    temp_pos3 = temp_pos2 + 1;
-    temp_port = temp_pos3;
-    temp_pos4 = strchr(temp_pos, '/');
-    strcpy(path, temp_pos4);
-    port_length = temp_pos4 - temp_pos3;
-    temp_port[port_length] = '\0';
-    strncpy(port, temp_pos3, port_length);
-
-    // Simple error check on port number to see if its not a string or negative
-    if (atoi(port) <= 0) {
+  while (n > 0) {
+    if ((rc = rio_peekb(from, &bufp)) <= 0) {
       return -1;
     }
+    if ((size_t) rc > n) {
+      rc = n;
+    }
+    if ((to_fd == conn->fd ? client_write(conn, bufp, rc) : rio_writen(to_fd, bufp, rc)) < 0) {
+      return -1;
+    }
+    rio_consumeb(from, rc);
+    n -= rc;
+    conn_progress(conn);
   }
-  // Otherwise we just have the path and can tack on the default port of 8080
-  else if(*temp_pos2 == '/') {
-    strcpy(path, temp_pos2);
-    sprintf(port, "%d", DEFAULT_PORT);
-  }
-  strncpy(host, temp_host, MAXLINE); // Before leaving function copy temp_host into real host reference
   return 0;
 }
 
-/* Forwards request from client to server then writes server reply to client buffer */ 
-static int forward_to_server(int client_fd, rio_t *client_rio, char *host, char *port, char *buf, char *method, char *c_len) {
-  char temp_buf[MAXLINE];
-  int host_fd;
-  rio_t host_rio;
-  size_t n;
-  host_fd = open_clientfd(host, port); // Open a connection to the host on port_num
+/* Reads a line from the server where it is in rio's buffer, valid until the next read. A line longer than that
+ * buffer, such as a large Set-Cookie, is moved to a spill buffer from the request's arena, which grows until
+ * max_head_size as for request heads. A line the server cut short by closing, or a longer one, is an error.
+ */
+static ssize_t read_line(conn_t *conn, rio_t *rio, char **line) {
+  char *spill = NULL;
+  size_t len = 0, size = 0;
+  const char *eol;
+  ssize_t n = rio_getlineb(rio, line);
 
-  // If file descriptor for host is an error close connection
-  if (host_fd <= 0) {
-    clienterror(host_fd, host, "503", "Server Unreachable", "Cannot find host");
-    return -1;
+  if (n >= 0 || errno != ENOBUFS) {
+    return (n > 0 && (*line)[n - 1] != '\n') ? -1 : n;
   }
+  // rio's buffer is full of this line, carry on in a buffer of our own
+  while (1) {
+    if (len == size) {
+      char *bigger;
+      if (size >= max_head_size) {
+        return -1;
+      }
+      size = size ? 2 * size : HEAD_SPILL_SIZE;
+      if (size > max_head_size) {
+        size = max_head_size;
+      }
+      if (size <= RIO_BUFSIZE || (bigger = arena_alloc(&conn->arena, size)) == NULL) {
+        return -1;
+      }
+      if (spill) {
+        memcpy(bigger, spill, len);
+      } else {
+        memcpy(bigger, rio->rio_bufptr, rio->rio_cnt);
+        len = rio->rio_cnt;
+        rio_consumeb(rio, rio->rio_cnt);
+      }
+      spill = bigger;
+    }
+    // At most a buffer's worth, so what comes after the line fits back in rio
+    if ((n = rio_readsomeb(rio, spill + len, size - len < RIO_BUFSIZE ? size - len : RIO_BUFSIZE)) <= 0) {
+      return -1;
+    }
+    if ((eol = scan_eol(spill + len, n)) != NULL) {
+      size_t end = eol - spill + 1;
+      rio_unreadb(rio, spill + end, len + n - end);
+      *line = spill;
+      return end;
+    }
+    len += n;
+  }
+}
+
+/* Checks whether a line read by read_line is the empty line ending headers or trailers */
+static int is_blank(const char *line, ssize_t n) {
+  return n == 1 || (n == 2 && line[0] == '\r');
+}
+
+/* Reads the response from the server and writes it to the client. The connection headers are hop-by-hop
+ * so the server's are dropped and replaced by ours, then the body is relayed using its framing
+ * (chunked, Content-Length, or until the server closes).
+ * Returns 1 if the server is willing to take another request on this connection, 0 if it must be closed
+ * and -1 on error. *replied is set as soon as something was written to the client. *keep_client says
+ * whether the client connection stays open, it is cleared when the body can only end by closing it.
+ * While conn->capture is set the final response is copied there, without our Connection header, and the
+ * copy is dropped unless the response can be cached.
+ */
+static int relay_response(conn_t *conn, rio_t *host_rio, int *replied, int *keep_client) {
+  int client_fd = conn->fd;
+  char *line, *val;
+  slice_t name, value;
+  int minor, status, keep_alive, chunked;
+  long c_len, chunk_size;
+  long max_age, s_maxage; 		// From Cache-Control, -1 if absent
+  time_t expires, date, now;
+  int has_expires;
+  ssize_t n;
+
+  *replied = 0;
+  client_cork(conn, 1);
+  do {
+    // Status line should be HTTP/1.x code reason
+    if ((n = read_line(conn, host_rio, &line)) <= 0) {
+      return -1;
+    }
+    if (http_parse_status(line, n, &minor, &status) < 0) {
+      return -1;
+    }
+    // The server started answering, from now on either side stalling ends the request
+    if (!*replied) {
+      conn_phase(conn, PHASE_TTFB, stats_now() - conn->sent_at);
+      conn_deadline(conn, BODY_TIMEOUT, DEADLINE_CLIENT | DEADLINE_HOST);
+    }
+    conn->capture_len = 0; 		// Only the final response is kept, not the interim ones
+    if (client_write(conn, line, n) < 0) {
+      return -1;
+    }
+    *replied = 1;
+
+    keep_alive = (minor >= 1); // HTTP/1.1 servers keep the connection open unless they say otherwise
+    chunked = 0;
+    c_len = -1;
+    max_age = s_maxage = -1;
+    expires = date = 0;
+    has_expires = 0;
+
+    // Loop through the headers until the CLRF that ends them, each is relayed from rio's buffer
+    while ((n = read_line(conn, host_rio, &line)) > 0 && !is_blank(line, n)) {
+      if (http_parse_header(line, n, &name, &value) < 0) {
+        return -1;
+      }
+      if (slice_caseeq(&name, "Connection") || slice_caseeq(&name, "Proxy-Connection") || slice_caseeq(&name, "Keep-Alive")) {
+        if (http_has_token(&value, "close")) {
+          keep_alive = 0;
+        } else if (http_has_token(&value, "keep-alive")) {
+          keep_alive = 1;
+        }
+        continue;
+      }
+      if (slice_caseeq(&name, "Transfer-Encoding") && http_has_token(&value, "chunked")) {
+        chunked = 1;
+      } else if (slice_caseeq(&name, "Content-Length")) {
+        c_len = strtol(value.ptr, NULL, 10); // The line ends with its line feed, so this stops there
+      } else if (slice_caseeq(&name, "Set-Cookie") || slice_caseeq(&name, "Vary") || (slice_caseeq(&name, "Cache-Control") &&
+          (http_has_token(&value, "no-store") || http_has_token(&value, "private") || http_has_token(&value, "no-cache")))) {
+        capture_drop(conn); 		// Not to be shared with other clients, or not with all of them
+      } else if (slice_caseeq(&name, "Cache-Control")) {
+        max_age = http_directive_secs(&value, "max-age");
+        s_maxage = http_directive_secs(&value, "s-maxage");
+      } else if (slice_caseeq(&name, "Expires")) {
+        has_expires = 1;
+        if (http_parse_date(&value, &expires) < 0) {
+          expires = 0; 		// An invalid date means already expired
+        }
+      } else if (slice_caseeq(&name, "Date")) {
+        http_parse_date(&value, &date);
+      }
+      if (client_write(conn, line, n) < 0) {
+        return -1;
+      }
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    // Interim 1xx responses are followed by the real one
+    if (status >= 100 && status < 200) {
+      if (client_write(conn, "\r\n", 2) < 0) {
+        return -1;
+      }
+    }
+  } while (status >= 100 && status < 200);
 
-  // Write request and headers to server (both GET and POST need this to be done)
-  if ((rio_writen(host_fd, buf, strlen(buf))) < 0) {
+  // A body without framing ends when the connection closes, so the client's has to close too
+  if (!chunked && c_len < 0 && status != 204 && status != 304) {
+    *keep_client = 0;
+  }
+  // Only complete responses with framing are kept, a cached one is replayed on kept-alive connections
+  if (status != 200 || (!chunked && c_len < 0)) {
+    capture_drop(conn);
+  }
+  // A shared cache goes by s-maxage, then max-age, then Expires counted from the server's Date. A response
+  // with none of them is kept as long as it stays in the cache, one that is already stale is not kept.
+  now = time(NULL);
+  conn->expires = 0;
+  if (s_maxage >= 0 || max_age >= 0 || has_expires) {
+    long lifetime = s_maxage >= 0 ? s_maxage : max_age >= 0 ? max_age : (long) (expires - (date ? date : now));
+    if (lifetime <= 0) {
+      capture_drop(conn);
+    }
+    conn->expires = now + lifetime;
+  }
+  conn->capture_split = conn->capture_len;
+  conn->status = status;
+  val = *keep_client ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  if (rio_writen(client_fd, val, strlen(val)) < 0) {
     return -1;
   }
+  client_cork(conn, 0);
+  conn->bytes_out += strlen(val);
+  conn->body_at = stats_now();
+
+  // These never have a body
+  if (status == 204 || status == 304) {
+    return keep_alive;
+  }
+
+  if (chunked) {
+    // Each chunk is a hex size line then the data and a CLRF, a 0 size chunk ends the body
+    while (1) {
+      if ((n = read_line(conn, host_rio, &line)) <= 0 || client_write(conn, line, n) < 0) {
+        return -1;
+      }
+      chunk_size = strtol(line, NULL, 16);
+      if (chunk_size < 0) {
+        return -1;
+      }
+      if (chunk_size == 0) {
+        break;
+      }
+      if (relay_bytes(conn, host_rio, client_fd, chunk_size + 2) < 0) {
+        return -1;
+      }
+    }
+    // Trailers, if any, until the final CLRF
+    do {
+      if ((n = read_line(conn, host_rio, &line)) <= 0 || client_write(conn, line, n) < 0) {
+        return -1;
+      }
+    } while (!is_blank(line, n));
+    return keep_alive;
+  }
 
-  // If method is POST we need the payload_size to read and write to the server
-  if (strcmp(method, "POST") == 0) {
-    void *data[MAXLINE];
-    size_t payload_size = atoi(c_len); // Determine payload size
-			
-    // Read in payload, store in data of payload_size
-    if ((n = rio_readnb(client_rio, data, payload_size)) < 0) {
+  if (c_len >= 0) {
+    if (relay_bytes(conn, host_rio, client_fd, c_len) < 0) {
       return -1;
     }
-		
-    // Write payload to server 
-    if ((rio_writen(host_fd, data, n)) < 0) {
+    return keep_alive;
+  }
+
+  // No framing, the body ends when the server closes the connection
+  while ((n = rio_peekb(host_rio, &line)) > 0) {
+    if (client_write(conn, line, n) < 0) {
       return -1;
     }
+    rio_consumeb(host_rio, n);
+    conn_progress(conn);
   }
+  return 0;
+}
 
-  rio_readinitb(&host_rio, host_fd); // Robust reader initialize with host file descriptor
+/* Forwards request from client to server then writes server reply to client buffer, followed by the body_len
+ * bytes of its body. The upstream connection comes from the pool and goes back to it when the server allows it.
+ */
+static int forward_to_server(conn_t *conn, rio_t *client_rio, char *host, char *port, char *buf, size_t len, char *method, long body_len, int *keep_client) {
+  upstream_t up;
+  rio_t *host_rio = &conn->host_rio;
+  int is_post = (strcmp(method, "POST") == 0);
+  int valid, replied;
+  long long t;
 
-  // Read response from server and write back to client in MAXLINE bytes read per line
-  while ((n = rio_readlineb(&host_rio, temp_buf, MAXLINE)) != 0) {
-    rio_writen(client_fd, temp_buf, n);
-  }	
-  close(host_fd);
-  return 0;
+  // A pooled connection may have been closed by the server in the meantime, in which case we retry once on another
+  for (int attempt = 0; attempt < 2; attempt++) {
+    // If we cannot get a connection to the host report it now, the caller has nothing to add
+    t = stats_now();
+    if (pool_acquire(&up, host, port) < 0) {
+      stats_add(&conn->stats->connect_errors, 1);
+      clienterror(conn, host, "503", "Server Unreachable", "Cannot find host");
+      *keep_client = 0;
+      return -2;
+    }
+    if (!up.reused) {
+      conn_phase(conn, PHASE_CONNECT, stats_now() - t);
+    }
+
+    conn->host_fd = up.fd;
+    conn_deadline(conn, BODY_TIMEOUT, DEADLINE_CLIENT | DEADLINE_HOST);
+
+    // Write request and headers to server (both GET and POST need this to be done)
+    if ((rio_writen(up.fd, buf, len)) < 0) {
+      conn_nodeadline(conn);
+      pool_release(&up, host, port, 0);
+      if (up.reused && !conn->expired) {
+        continue;
+      }
+      return -1;
+    }
+
+    // Stream the payload of Content-Length bytes to the server
+    if (body_len > 0 && relay_bytes(conn, client_rio, up.fd, body_len) < 0) {
+      conn_nodeadline(conn);
+      pool_release(&up, host, port, 0);
+      return -1;
+    }
+    if (body_len > 0) {
+      conn->bytes_in += body_len;
+    }
+
+    // Server has the whole request, it only has so long to start answering
+    conn->sent_at = stats_now();
+    conn_deadline(conn, UPSTREAM_TTFB_TIMEOUT, DEADLINE_HOST);
+    rio_readinitb(host_rio, up.fd); // Robust reader initialize with host file descriptor
+    valid = relay_response(conn, host_rio, &replied, keep_client);
+    conn_nodeadline(conn);
+    if (valid < 0) {
+      client_cork(conn, 0); 		// The response may have failed with its head still held back
+    }
+    if (valid >= 0) {
+      conn_phase(conn, PHASE_BODY, stats_now() - conn->body_at);
+      conn->cache = conn->capture ? LOG_CACHE_MISS : LOG_CACHE_UNCACHEABLE;
+    }
+    if (valid >= 0 && conn->capture) {
+      cache_add_to_cache(&conn->key, conn->capture, conn->capture_len, conn->capture_split, conn->expires);
+    }
+
+    // Server never answered in time, tell the client
+    if (valid == -1 && !replied && conn->expired) {
+      pool_release(&up, host, port, 0);
+      clienterror(conn, host, "504", "Gateway Timeout", "No answer from");
+      *keep_client = 0;
+      return -2;
+    }
+
+    // Server closed a pooled connection without answering, a GET can safely be sent again
+    if (valid == -1 && !replied && up.reused && !is_post) {
+      pool_release(&up, host, port, 0);
+      continue;
+    }
+
+    // Bytes left after the response would be read as the next one, so such connections are not reused
+    pool_release(&up, host, port, valid == 1 && host_rio->rio_cnt == 0);
+    // A response cut short cannot be followed by another on the same client connection
+    if (valid == -1) {
+      *keep_client = 0;
+    }
+    return (valid == -1 && !replied) ? -1 : 0;
+  }
+  return -1;
 }
 
 /* Thread routine which assigns a new thread to handle connection from client */
 static void *thread(void *vargp) {
+  conn_t *conn = malloc(sizeof(conn_t)); // This worker's connection context, see conn_t
+  long long waited;
+  memacct_add(MEM_CONNS, sizeof(conn_t) - 2 * RIO_BUFSIZE - sizeof(topk_batch_t));
+  memacct_add(MEM_RELAY, 2 * RIO_BUFSIZE); 		// The client and server rio buffers
+  memacct_add(MEM_STATS, sizeof(topk_batch_t));
+  conn->deadline.armed = 0;
+  conn->capture = NULL;
+  conn->stats = stats_register();
+  conn->log = accesslog_register();
+  conn->topk.n = 0;
+  arena_init_tagged(&conn->arena, MEM_REQUESTS);
   Pthread_detach(pthread_self());
   while (1) {
-    int connected_fd = sbuf_remove(&sbuf);
-    serve_client(connected_fd);
+    int connected_fd = sbuf_remove_waited(&sbuf, &waited);
+    stats_phase(conn->stats, PHASE_QUEUE, waited);
+    serve_connection(conn, connected_fd);
     close(connected_fd);
   }
   return NULL;
 }
 
-/* Main proxy routine, will read in input and parse the method, uri, and protocol version, in first line of request.
- * Then calls several functions: Check if uri provided is valid. Check if headers, if any, are valid. And then, 
- * send a request to the server and read the response back to the client.
+/* Called by the timer wheel thread when a connection's deadline passes. Shutting the sockets down
+ * wakes the worker blocked on them with an EOF or error, which it handles like a disconnect.
+ */
+static void conn_expired(void *arg) {
+  conn_t *conn = arg;
+  conn->expired = 1;
+  if (conn->deadline_fds & DEADLINE_CLIENT) {
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+  if ((conn->deadline_fds & DEADLINE_HOST) && conn->host_fd >= 0) {
+    shutdown(conn->host_fd, SHUT_RDWR);
+  }
+}
+
+/* Gives the connection secs seconds before the sockets in which are shut down */
+static void conn_deadline(conn_t *conn, int secs, int which) {
+  struct timespec ts;
+  // Disarm first so the wheel thread doesn't see which half updated
+  wheel_cancel(&conn->deadline);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  conn->deadline_fds = which;
+  conn->armed_at = ts.tv_sec;
+  wheel_arm(&conn->deadline, secs * 1000, conn_expired, conn);
+}
+
+/* Bytes moved: push the body deadline back, at most once per second to keep the wheel lock quiet */
+static void conn_progress(conn_t *conn) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (ts.tv_sec != conn->armed_at) {
+    conn_deadline(conn, BODY_TIMEOUT, conn->deadline_fds);
+  }
+}
+
+/* Disarms the deadline, must be done before host_fd is closed or handed back to the pool */
+static void conn_nodeadline(conn_t *conn) {
+  wheel_cancel(&conn->deadline);
+  conn->host_fd = -1;
+}
+
+/* Serves requests on a client connection until the client asks to close it, stays idle for CLIENT_IDLE_TIMEOUT
+ * or sent MAX_REQUESTS_PER_CONN requests. Pipelined requests are already waiting in rio and are answered
+ * one after the other, so responses go back in the order the requests came in.
  */
-static int serve_client(int connected_fd) {
-  char buf[MAXLINE]; 			// Current buffer read request from client
-  char temp_buf[MAXLINE];   		// temp buffer used to rewrite request in correct format to server
-  char method[MAXLINE];  		// Method holds GET/POST
-  char uri[MAXLINE]; 			// uri is (http://host:port/path)
-  char version[MAXLINE]; 		// version holds HTTP/x.x 
-  char host[MAXLINE]; 			// Host holds (mc.cdm.depaul.edu) (localhost)
-  char path[MAXLINE]; 			// path holds (/) (/cgi-bin) (/home.html)
-  char port_num[MAXLINE]; 		// port_num holds (8080) (3275)
-  char temp_host[MAXLINE]; 		// Used when putting host into dict 
-  char *c_len = NULL 			// Default Content-Length header val in case GET request instead of POST
+static void serve_connection(conn_t *conn, int connected_fd) {
+  int keep_alive = 1;
+  conn->fd = connected_fd;
+  conn->host_fd = -1;
+  conn->deadline_fds = 0;
+  conn->expired = 0;
+  conn->armed_at = 0;
+  rio_readinitb(&conn->rio, connected_fd); // Robust reader initialize with client file descriptor
+  setsockopt(connected_fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+  if (conn->log) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    strcpy(conn->client, "-");
+    if (getpeername(connected_fd, (SA *) &addr, &addr_len) == 0) {
+      getnameinfo((SA *) &addr, addr_len, conn->client, sizeof(conn->client), NULL, 0, NI_NUMERICHOST);
+    }
+  }
+  __atomic_store_n(&conn->stats->busy, 1, __ATOMIC_RELAXED);
+
+  for (int served = 0; keep_alive && served < MAX_REQUESTS_PER_CONN && !conn->expired; served++) {
+    // A new client gets the header deadline, a kept-alive one the idle deadline until its next request line
+    conn_deadline(conn, served > 0 && conn->rio.rio_cnt == 0 ? CLIENT_IDLE_TIMEOUT : HEADER_TIMEOUT, DEADLINE_CLIENT);
+    // The last request allowed on this connection is answered with Connection: close
+    keep_alive = (served + 1 < MAX_REQUESTS_PER_CONN);
+    if (serve_client(conn, &conn->rio, &keep_alive) < 0) {
+      break;
+    }
+  }
+  conn_nodeadline(conn);
+  arena_reset(&conn->arena); 			// Don't hold on to a large request's memory while idle
+  topk_flush(&conn->topk); 			// Nor to the requests of an idle worker
+  __atomic_store_n(&conn->stats->busy, 0, __ATOMIC_RELAXED);
+}
+
+/* Main proxy routine, reads the request line and headers from the client then calls serve_request to check
+ * them, send the request to the server and read the response back to the client.
+ * However the request ends, nothing of it is left behind: its memory is in the arena, reset for the next one,
+ * forward_to_server hands the upstream connection back and disarms its deadline, and the copy of the response
+ * kept for the cache is dropped here.
+ */
+static int serve_client(conn_t *conn, rio_t *rio, int *keep_alive) {
+  http_request_t *req; 			// Request line and headers, parsed in place
   int valid; 				// Used for error checking in functions
-  dict_t *headers = dict_create(); 	// Store headers received from request
-  rio_t rio; 				// Client rio
-  rio_readinitb(&rio, connected_fd); 	// Robust reader initialize with client file descriptor
 
-  // If no request input return to listen state
-  if (!rio_readlineb(&rio, buf, MAXLINE)) {
+  // Everything of the previous request goes at once, the memory is kept for this one
+  arena_reset(&conn->arena);
+  if ((req = arena_alloc(&conn->arena, sizeof(http_request_t))) == NULL) {
     return -1;
   }
 
-  // Makes sure the first line in request supports the correct amount of args: GET uri HTTP/x.x
-  sscanf(buf, "%s %s %s", method, uri, version); 
-  if (method[0] == '\0') {
-    clienterror(connected_fd, "Method", "400", "Bad Request", "Missing arg");
+  conn->status = 0;
+  conn->bytes_in = conn->bytes_out = 0;
+  conn->key.str = NULL;
+  conn->cache = LOG_CACHE_NONE;
+  if ((conn->record = conn->log ? accesslog_reserve(conn->log) : NULL)) {
+    conn->record->parse_us = conn->record->cache_us = 0;
+    conn->record->connect_us = conn->record->ttfb_us = conn->record->body_us = 0;
+  }
+  valid = read_request_head(conn, rio, req);
+  // If no request input return to listen state
+  if (valid < 0) {
     return -1;
   }
+  // The head is parsed in rio's buffer, which the body of a POST overwrites as it is relayed. What is
+  // reported about the request once it is served has to be taken now.
+  conn->method = slice_caseeq(&req->method, "GET") ? METHOD_GET : slice_caseeq(&req->method, "POST") ? METHOD_POST : METHOD_OTHER;
+  if (conn->record) {
+    log_start(conn, req);
+  }
+  if (valid == 400) {
+    clienterror(conn, "Bad headers", "400", "Bad Request", "Denied due to");
+    valid = -1;
+  } else if (valid == 431) {
+    clienterror(conn, "Headers", "431", "Request Header Fields Too Large", "Denied due to");
+    valid = -1;
+  } else if (valid == 500) {
+    valid = out_of_memory(conn);
+  } else {
+    conn->bytes_in = req->head_len;
+    valid = serve_request(conn, rio, req, keep_alive);
+    capture_drop(conn);
+  }
+  count_request(conn);
+  if (conn->record) {
+    log_request(conn);
+  }
+  // Requests that got as far as having a key count towards the heaviest uris and origins
+  if (conn->key.str) {
+    topk_record(&conn->topk, &conn->key, conn->bytes_out);
+  }
+  return valid;
+}
+
+/* Adds the request just served to the worker's counters */
+static void count_request(conn_t *conn) {
+  stats_thread_t *st = conn->stats;
+  int class = (conn->status >= 100 && conn->status < 600) ? conn->status / 100 : 0;
+
+  stats_add(&st->requests[conn->method][class], 1);
+  stats_add(&st->bytes_in, conn->bytes_in);
+  stats_add(&st->bytes_out, conn->bytes_out);
+}
+
+/* Copies the method and uri of the request whose head was just read to its log record */
+static void log_start(conn_t *conn, http_request_t *req) {
+  log_record_t *r = conn->record;
+  size_t n;
+
+  n = req->method.len < sizeof(r->method) - 1 ? req->method.len : sizeof(r->method) - 1;
+  memcpy(r->method, req->method.ptr, n);
+  r->method[n] = '\0';
+  n = req->uri.len < LOG_URI_MAX - 1 ? req->uri.len : LOG_URI_MAX - 1;
+  memcpy(r->uri, req->uri.ptr, n);
+  r->uri[n] = '\0';
+}
+
+/* Hands the request just served to the log thread */
+static void log_request(conn_t *conn) {
+  log_record_t *r = conn->record;
+
+  r->time = time(NULL);
+  r->duration_us = (stats_now() - conn->started_at) / 1000;
+  r->status = conn->status;
+  r->bytes_out = conn->bytes_out;
+  r->cache = conn->cache;
+  strcpy(r->client, conn->client);
+  accesslog_commit(conn->log);
+}
+
+/* Records that a phase of the current request took ns, in the worker's histograms and in its log record */
+static void conn_phase(conn_t *conn, int phase, long long ns) {
+  log_record_t *r = conn->record;
+  unsigned us = ns > 0 ? ns / 1000 : 0;
+
+  stats_phase(conn->stats, phase, ns);
+  if (r == NULL) {
+    return;
+  }
+  switch (phase) {
+  case PHASE_PARSE: r->parse_us = us; break;
+  case PHASE_CACHE: r->cache_us = us; break;
+  case PHASE_CONNECT: r->connect_us = us; break;
+  case PHASE_TTFB: r->ttfb_us = us; break;
+  case PHASE_BODY: r->body_us = us; break;
+  }
+}
 
-  // Check to see if method is only GET/POST
-  if ((strcasecmp(method, "GET") != 0) && (strcasecmp (method, "POST") != 0)) {
-    clienterror(connected_fd, method, "501", "Not Implemented", "Method used is not valid");
+/* Answers a request for STATS_PATH on STATS_HOST with the stats of all workers, in the Prometheus text format */
+static int serve_stats(conn_t *conn, int keep_alive) {
+  char *body = NULL, head[160];
+  size_t len = 0;
+  int queued, n;
+  FILE *out;
+
+  if ((out = open_memstream(&body, &len)) == NULL) {
     return -1;
   }
+  sem_getvalue(&sbuf.items, &queued);
+  stats_prometheus(out, queued, NTHREADS);
+  fclose(out);
 
-  // uri isn't saved as an arg return error
-  if (uri[0] == '\0') {
-    clienterror(connected_fd, "uri", "400", "Bad Request", "Missing arg");
+  n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %zu\r\nConnection: %s\r\n\r\n", len, keep_alive ? "keep-alive" : "close");
+  conn->status = 200;
+  if (rio_writen(conn->fd, head, n) < 0 || rio_writen(conn->fd, body, len) < 0) {
+    free(body);
     return -1;
   }
+  conn->bytes_out += n + len;
+  free(body);
+  return 0;
+}
+
+/* Checks the method, uri and version of a parsed request, then rewrites it for the server and forwards it */
+static int serve_request(conn_t *conn, rio_t *rio, http_request_t *req, int *keep_alive) {
+  int connected_fd = conn->fd; 		// Client file descriptor
+  char *buf; 				// Request rewritten for the server, with our own headers
+  size_t size; 				// Length of buf
+  char *host; 				// Host holds (mc.cdm.depaul.edu) (localhost)
+  char port_num[8]; 			// port_num holds (8080) (3275)
+  char *temp_host; 			// Host header, for clients that did not send one
+  char *method; 			// Method holds GET/POST
+  slice_t host_s, port_s, path; 	// Parts of the uri, path holds (/) (/cgi-bin) (/home.html)
+  dict_t *headers; 			// Store headers received from request
+  int client_keep; 			// Whether the client wants its connection kept after this request
+  int personal = 0; 			// The request carries credentials, its response is not shared
+  int has_te = 0; 			// The request has a Transfer-Encoding header
+  long body_len = -1; 			// Its Content-Length, -1 if it has none
+  int bad_length = 0; 			// Its Content-Length is not a number, or there are several
+  int valid; 				// Used for error checking in functions
 
-  // version isn't saved as an arg set it to default HTTP/1.0
-  if (version[0] == '\0') {
-    strcpy(version, "HTTP/1.0");
+  // Check to see if method is only GET/POST
+  if (slice_caseeq(&req->method, "GET")) {
+    method = "GET";
+  } else if (slice_caseeq(&req->method, "POST")) {
+    method = "POST";
+  } else {
+    clienterror(conn, "Method", "501", "Not Implemented", "Method used is not valid");
+    return -1;
   }
 
-  // Version from client should always be HTTP/1.1 or HTTP/1.0 (We translate to HTTP/1.0 if not in this form)
-  if ((strcasecmp(version, "HTTP/1.1") == 0)) {
-    // If the protocol version isn't 1.0 change it
-    version[7] = '0'; 
+  // Version from client should be HTTP/1.1 or HTTP/1.0 (the default), only 1.1 clients keep their connection by default
+  if (req->version.len == 0 || slice_caseeq(&req->version, "HTTP/1.0")) {
+    client_keep = 0;
+  } else if (slice_caseeq(&req->version, "HTTP/1.1")) {
+    client_keep = 1;
   } else {
     return -1;
   }
 
   /* checks whether uri is valid by seeing if it begins with http://, includes a host, the port_num,
-  * and a path to resources.
+  * and a path to resources. A bare path is fine too when the Host header names the host.
   * EX: http://mc.cdm.depaul.edu:8080/cgi-bin/echo.cgi
   */
-  valid = parse_request(connected_fd, uri, host, port_num, path);
-  // If we get an error report to client and go back to listening state
-  if (valid == -1) {
-    clienterror(connected_fd, uri, "400", "Bad Request", "Received bad request");
+  valid = http_parse_uri(&req->uri, &host_s, &port_s, &path);
+  for (int i = 0; i < req->nheaders; i++) {
+    http_header_t *h = &req->headers[i];
+    // Our own Connection headers replace the client's, but whether it wants to keep its connection is noted
+    if (slice_caseeq(&h->name, "Connection") || slice_caseeq(&h->name, "Proxy-Connection")) {
+      if (http_has_token(&h->value, "close")) {
+        client_keep = 0;
+      } else if (http_has_token(&h->value, "keep-alive")) {
+        client_keep = 1;
+      }
+    } else if (valid == 0 && host_s.len == 0 && slice_caseeq(&h->name, "Host")) {
+      valid = http_parse_host(&h->value, &host_s, &port_s);
+    } else if (slice_caseeq(&h->name, "Authorization") || slice_caseeq(&h->name, "Cookie")) {
+      personal = 1;
+    } else if (slice_caseeq(&h->name, "Transfer-Encoding")) {
+      has_te = 1;
+    } else if (slice_caseeq(&h->name, "Content-Length")) {
+      bad_length |= body_len >= 0 || http_parse_length(&h->value, &body_len) < 0;
+    }
+  }
+  // Only a body of Content-Length bytes is relayed. Bytes of one framed otherwise, or ambiguously, would be
+  // left on the upstream connection, which goes back to the pool, and be read as another client's request.
+  if (has_te) {
+    if (body_len >= 0 || bad_length) {
+      clienterror(conn, "Transfer-Encoding", "400", "Bad Request", "Content-Length along with");
+    } else {
+      clienterror(conn, "Transfer-Encoding", "501", "Not Implemented", "Request body framed by");
+    }
     return -1;
   }
-
-  // Copy host into temp_host for input into dict later
-  strncpy(temp_host, host, MAXLINE);
-  strcat(temp_host, "\r\n");
-
-  // Remake buf with correct format to send to server GET /path HTTP/1.0
-  bzero(buf, MAXLINE);
-  strcat(temp_buf, method);
-  strcat(temp_buf, " ");
-  strcat(temp_buf, path);
-  strcat(temp_buf, " ");
-  strcat(temp_buf, version);
-  strcat(temp_buf, "\r\n");
-  strcpy(buf, temp_buf);
-  bzero(temp_buf, MAXLINE);
-
-  // Reset valid flag and then parse headers making sure they are valid
-  valid = parse_request_headers(&rio, headers, temp_host, strlen(buf));
-  if (valid == -1) {
-    clienterror(connected_fd, "Bad headers", "400", "Bad Request", "Denied due to");
+  if (bad_length) {
+    clienterror(conn, "Content-Length", "400", "Bad Request", "Invalid or repeated");
     return -1;
   }
+  // The body has to be read whatever happens to the request, or the next one on the connection would start
+  // in it. A POST can't do without one, a GET has no use for one and is refused rather than drained.
+  if (strcmp(method, "POST") == 0 && body_len < 0) {
+    clienterror(conn, "Content-Length", "411", "Length Required", "POST request without");
+    return -1;
+  }
+  if (strcmp(method, "GET") == 0 && body_len > 0) {
+    clienterror(conn, "Content-Length", "400", "Bad Request", "GET request with a body of");
+    return -1;
+  }
+  // If we get an error report to client and go back to listening state
+  if (valid == -1 || host_s.len == 0) {
+    clienterror(conn, "uri", "400", "Bad Request", "Received bad request");
+    return -1;
+  }
+  if ((host = arena_strndup(&conn->arena, host_s.ptr, host_s.len)) == NULL) {
+    return out_of_memory(conn);
+  }
+  if (port_s.len > 0) {
+    memcpy(port_num, port_s.ptr, port_s.len);
+    port_num[port_s.len] = '\0';
+  } else {
+    sprintf(port_num, "%d", DEFAULT_PORT);
+  }
+  *keep_alive = *keep_alive && client_keep;
 
-  // We used all the buffer room and need to create a hold for multiple request size headers
-  if (valid == -2) {
-    char temp_hold[MAXLINE * 4]; 	// Large buf to hold multiple request size
-    strcpy(temp_hold, buf); 	// Append first line of request to temp_hold now
-    add_to_buf(headers, temp_hold); // Append to buf first set of headers 
-
-    // Loop through all the headers and add to mass_store dict
-    dict_foreach(headers,
-    {
-      dict_put(mass_store, key, val);
-    });
-
-    // While we have multiple headers not read up to MAXLINE in our rio struct
-    while (valid == -2) {
-     valid = parse_request_headers(&rio, headers, temp_host, 0); // Parse headers again
-
-     // Check if the headers we added to the dictionary exist in mass_store, if they don't add to mass_store now
-     dict_foreach(headers,
-     {	
-       if (dict_get(mass_store, key)) {
-       } else {
-         dict_put(mass_store, key, val);
-       }
-     });
+  // The proxy's own stats, nothing is forwarded
+  if (slice_caseeq(&host_s, STATS_HOST) && slice_caseeq(&path, STATS_PATH) && strcmp(method, "GET") == 0) {
+    return serve_stats(conn, *keep_alive);
+  }
 
-     add_to_buf(headers, temp_hold); // Append to buf with first line in req and set of headers 
+  // Equivalent uris get the same key, hashed once here for everything that looks the request up
+  if (http_make_key(&conn->arena, &host_s, atoi(port_num), DEFAULT_PORT, &path, sort_query, &conn->key) < 0) {
+    return out_of_memory(conn);
+  }
+  if (strcmp(method, "GET") == 0) {
+    long long t = stats_now();
+    size_t written;
+    valid = cache_write_if_cached(&conn->key, connected_fd, *keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n", &written);
+    conn_phase(conn, PHASE_CACHE, stats_now() - t);
+    if (valid == 0) {
+      conn->cache = LOG_CACHE_HIT;
+      conn->status = 200;
+      conn->bytes_out += written;
+      stats_add(&conn->stats->cache_hits, 1);
+      stats_phase(conn->stats, PHASE_TOTAL, stats_now() - conn->started_at);
+    }
+    if (valid <= 0) {
+      return valid;
+    }
+    stats_add(&conn->stats->cache_misses, 1);
+    // A miss: the response is copied as it is relayed, to be added if it can be cached
+    if (!personal) {
+      conn->capture_len = 0;
+      conn->capture_size = 16 * 1024;
+      conn->capture = memacct_malloc(MEM_RELAY, conn->capture_size);
+    }
+  }
 
-     // When we have a 0 return we break looping
-     if (valid == 0) {
-       break;
-     }
+  // A repeated header keeps its first value, the dict keeps them in the client's order
+  if ((headers = dict_create_arena(&conn->arena)) == NULL) {
+    return out_of_memory(conn);
+  }
+  for (int i = 0; i < req->nheaders; i++) {
+    http_header_t *h = &req->headers[i];
+    if (is_hop_by_hop(req, &h->name)) {
+      continue;
+    }
+    if (dict_addkn(headers, h->name.ptr, h->name.len, h->value.ptr, h->value.len) < 0) {
+      return out_of_memory(conn);
+    }
+  }
+  // Headers we don't want to change replace the client's.
+  // The upstream connection is kept alive so it can go back to the pool after the response.
+  if (dict_put(headers, "Connection", "keep-alive") < 0 || dict_put(headers, "Proxy-Connection", "close") < 0 ||
+      dict_put(headers, "User-Agent", USER_AGENT) < 0) {
+    return out_of_memory(conn);
+  }
+  // HTTP/1.1 servers require a Host header
+  if (!dict_get(headers, "Host")) {
+    if ((temp_host = arena_alloc(&conn->arena, host_s.len + sizeof("[]:65535"))) == NULL) {
+      return out_of_memory(conn);
+    }
+    sprintf(temp_host, strchr(host, ':') ? "[%s]:%s" : "%s:%s", host, port_num);
+    if (dict_put(headers, "Host", temp_host) < 0) {
+      return out_of_memory(conn);
+    }
   }
 
-  strcat(temp_hold, "\r\n"); // Add CLRF to end of buf
+  if ((buf = build_request(&conn->arena, method, &path, headers, &size)) == NULL) {
+    return out_of_memory(conn);
+  }
 
   // Now we send the request to the server
-  valid = forward_to_server(connected_fd, &rio, host, port_num, temp_hold, method, c_len);
+  valid = forward_to_server(conn, rio, host, port_num, buf, size, method, body_len, keep_alive);
   if (valid == -1) {
-    clienterror(connected_fd, host, "500", "Internal Server Error", "Did not send to");
+    clienterror(conn, host, "500", "Internal Server Error", "Did not send to");
     return -1;
-  }	
-
-  bzero(temp_hold, MAXLINE * 4);	// Zero out the temp_hold buffer in case of disconnect
-	
-  } else { // Otherwise we don't need to send size > MAXLINE requests
-    add_to_buf(headers, buf); 	// Add all the headers in correct format to buf before sending to server
-    strcat(buf, "\r\n"); 		// Cat on a CLRF as the end of a request		
-
-    // For POST requests need to get Content-Length size
-    if (strcmp(method, "POST") == 0) {
-      c_len = dict_get(headers, "Content-Length"); // Get header val of content-length
-
-      // See if content-length is 0 (Not an int or size 0) or negative
-      if (atoi(c_len) <= 0) {
-        return -1;
-      }
-    }
-
-   // Now we send the request to the server same as before
-   valid = forward_to_server(connected_fd, &rio, host, port_num, buf, method, c_len);
-   if (valid == -1) {
-     clienterror(connected_fd, host, "500", "Internal Server Error", "Did not send to");
-     return -1;
-   }
- }
-
-  // In case connection closes prematurely with client, zero out all char arrays
-  bzero(temp_buf, MAXLINE);
-  bzero(buf, MAXLINE);
-  bzero(method, MAXLINE);
-  bzero(uri, MAXLINE);
-  bzero(temp_host, MAXLINE);
-  bzero(host, MAXLINE);
-  bzero(version, MAXLINE);
-  bzero(path, MAXLINE);
-  bzero(port_num, MAXLINE);
-
-  // Destroy headers
-  dict_destroy(headers);
-  dict_destroy(mass_store);
+  }
+  stats_phase(conn->stats, PHASE_TOTAL, stats_now() - conn->started_at);
   return 0;
 }
 
@@ -414,28 +1107,73 @@ int main(int argc, char **argv) {
   socklen_t client_len; 			// since connfd is a socket connection, need the length in accept() function
   struct sockaddr_in client_addr; 	// client address used in accept() function
   pthread_t tid; 				// Thread id used when creating pre-threaded environment
+  pthread_attr_t attr; 			// Small stacks for the worker threads
 
+  int opt;
+  cache_config_t cache_config = { CACHE_LRU, MAX_CACHE_SIZE, MAX_OBJECT_SIZE };
+
+  // -H sets the largest request line and headers accepted, -q sorts query parameters in cache keys,
+  // -s prints latency percentiles every so many seconds, -l writes an access log, -E picks the cache's
+  // eviction policy, -L counts how the locks are used for the stats
+  while ((opt = getopt(argc, argv, "qs:l:H:E:L")) != -1) {
+    if (opt == 'q') {
+      sort_query = 1;
+      continue;
+    }
+    if (opt == 's' && (report_secs = atoi(optarg)) > 0) {
+      continue;
+    }
+    if (opt == 'l') {
+      access_log = optarg;
+      continue;
+    }
+    if (opt == 'L') {
+      lock_counting(1);
+      continue;
+    }
+    if (opt == 'H' && (max_head_size = strtoul(optarg, NULL, 10)) >= 256) {
+      continue;
+    }
+    if (opt == 'E' && (int) (cache_config.policy = cache_policy_by_name(optarg)) >= 0) {
+      continue;
+    }
+    usage (argv[0]);
+  }
   // Not enough args provided print usage function
-  if (argc != 2) {
+  if (optind != argc - 1) {
     usage (argv[0]);
   }
 
   /* Block SIGPIPE and treat it as an error return value of read/write rather
    * than a signal. This will prevent crashes when client or server
-   * unexpectedly disconnects.
+   * unexpectedly disconnects. SIGUSR1 is taken by the stats thread alone.
   */ 
   sigset_t mask;
   sigemptyset (&mask);
   sigaddset (&mask, SIGPIPE);
+  sigaddset (&mask, SIGUSR1);
   sigprocmask (SIG_BLOCK, &mask, NULL);
 
   sbuf_init(&sbuf, SBUFSIZE); 		// Initializes worker threads and sends to thread routine
-  listenfd = Open_listenfd(argv[1]); 	// Listen for connection on port num
+  pool_init(); 				// Upstream connections shared by all worker threads
+  cache_init(); 			// Responses shared by all worker threads
+  cache_configure(&cache_config);
+  stats_init(report_secs); 		// Merges the workers' latency histograms
+  topk_init(); 				// Heaviest uris and origins
+  if (access_log && accesslog_init(access_log) < 0) {
+    fprintf(stderr, "%s: %s\n", access_log, strerror(errno));
+    exit(1);
+  }
+  wheel_init(); 			// Deadlines of all connections
+  listenfd = Open_listenfd(argv[optind]); // Listen for connection on port num
 
   // Create worker threads
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
   for (int i = 0; i < NTHREADS; i++) {
-    Pthread_create(&tid, NULL, thread, NULL);
+    Pthread_create(&tid, &attr, thread, NULL);
   }
+  memacct_add(MEM_STACKS, (long) NTHREADS * WORKER_STACK_SIZE);
 
   // Accept connection, add to sbuf and then serve in thread routine
   while (1) {
@@ -1,3 +1,17 @@
 #pragma once
 
-#define USER_AGENT "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+#define USER_AGENT "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3"
+
+/* What the proxy's memory is counted for (see memacct.h) */
+enum {
+  MEM_OTHER, 			// Untagged
+  MEM_CACHE_OBJECTS, 		// Cached responses and their keys
+  MEM_CACHE_INDEX, 		// Cache shards and the headers of cached objects
+  MEM_REQUESTS, 		// Request arenas: parsed headers, header dicts, keys
+  MEM_CONNS, 			// Workers' connection contexts, without the buffers counted below
+  MEM_RELAY, 			// rio buffers and copies of responses on their way to the cache
+  MEM_STACKS, 			// Worker thread stacks
+  MEM_POOL, 			// Upstream connection pool
+  MEM_STATS, 			// Histograms, counters, log rings, sketches
+  MEM_TAGS
+};
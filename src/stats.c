@@ -0,0 +1,234 @@
+#include <csapp.h>
+#include <lock.h>
+#include <memacct.h>
+#include "proxy.h"
+#include "stats.h"
+#include "cache.h"
+#include "accesslog.h"
+#include "topk.h"
+
+static const char *phase_names[PHASE_COUNT] = {
+  "queue", "parse", "cache", "connect", "ttfb", "body", "total",
+};
+static const char *method_names[METHOD_COUNT] = { "GET", "POST", "other" };
+static const char *class_names[STATUS_CLASSES] = { "none", "1xx", "2xx", "3xx", "4xx", "5xx" };
+static const char *mem_names[MEM_TAGS] = {
+  "other", "cache_objects", "cache_index", "requests", "conns", "relay", "stacks", "pool", "stats",
+};
+
+static stats_thread_t *threads; 	// Every registered thread's stats, only ever prepended to
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Sum of all threads' stats as of the last merge */
+static struct {
+  pthread_mutex_t lock;
+  hist_t phase[PHASE_COUNT];
+} merged = { PTHREAD_MUTEX_INITIALIZER };
+
+static int report_interval; 	// Seconds between reports on stderr, 0 for none
+
+/* Prototype functions */
+static void stats_merge(void);
+static void *stats_thread(void*);
+static uint64_t stats_load(const uint64_t*);
+static void stats_report_locks(FILE*);
+static void stats_report_memory(FILE*);
+
+/* Adds up every thread's stats into merged. The per-thread counters only grow, so merged is rebuilt from
+ * scratch rather than kept up to date with deltas.
+ */
+static void stats_merge(void) {
+  stats_thread_t *st = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+
+  pthread_mutex_lock(&merged.lock);
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    hist_reset(&merged.phase[p]);
+  }
+  for (; st; st = st->next) {
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      hist_merge(&merged.phase[p], &st->phase[p]);
+    }
+  }
+  pthread_mutex_unlock(&merged.lock);
+}
+
+/* Merges every STATS_MERGE_INTERVAL. It also takes SIGUSR1, blocked in every other thread, to dump the
+ * latencies and the lock counters to stderr: printing from a signal handler would not be safe.
+ */
+static void *stats_thread(void *vargp) {
+  uint64_t reported = 0; 	// Requests at the last report
+  int elapsed = 0;
+  struct timespec interval = { STATS_MERGE_INTERVAL, 0 };
+  sigset_t usr1;
+
+  Pthread_detach(pthread_self());
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  while (1) {
+    if (sigtimedwait(&usr1, NULL, &interval) == SIGUSR1) {
+      stats_merge();
+      stats_report(stderr);
+      stats_report_locks(stderr);
+      stats_report_memory(stderr);
+      continue;
+    }
+    stats_merge();
+    elapsed += STATS_MERGE_INTERVAL;
+    if (report_interval && elapsed >= report_interval) {
+      elapsed = 0;
+      if (merged.phase[PHASE_TOTAL].count != reported) {
+        reported = merged.phase[PHASE_TOTAL].count;
+        stats_report(stderr);
+      }
+    }
+  }
+  return NULL;
+}
+
+void stats_init(int report_secs) {
+  pthread_t tid;
+  report_interval = report_secs;
+  Pthread_create(&tid, NULL, stats_thread, NULL);
+}
+
+stats_thread_t *stats_register(void) {
+  stats_thread_t *st = calloc(1, sizeof(stats_thread_t));
+  memacct_add(MEM_STATS, sizeof(stats_thread_t));
+
+  pthread_mutex_lock(&threads_lock);
+  st->next = threads;
+  __atomic_store_n(&threads, st, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&threads_lock);
+  return st;
+}
+
+void stats_report(FILE *out) {
+  pthread_mutex_lock(&merged.lock);
+  fprintf(out, "%-8s %10s %10s %10s %10s %10s (us)\n", "phase", "count", "p50", "p99", "p999", "max");
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    hist_t *h = &merged.phase[p];
+    fprintf(out, "%-8s %10lu %10.1f %10.1f %10.1f %10.1f\n", phase_names[p], (unsigned long) h->count,
+            hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+  }
+  pthread_mutex_unlock(&merged.lock);
+  fflush(out);
+}
+
+static uint64_t stats_load(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Prints the counters of each kind of lock */
+static void stats_report_locks(FILE *out) {
+  lock_stats_t locks[LOCK_MAX_NAMES];
+  int n = lock_stats(locks, LOCK_MAX_NAMES);
+
+  if (n == 0) {
+    fprintf(out, "lock counters are off, see -L\n");
+    return;
+  }
+  fprintf(out, "%-8s %12s %12s %12s %12s\n", "lock", "acquired", "contended", "wait(us)", "maxhold(us)");
+  for (int i = 0; i < n; i++) {
+    fprintf(out, "%-8s %12lu %12lu %12.1f %12.1f\n", locks[i].name, (unsigned long) locks[i].acquisitions,
+            (unsigned long) locks[i].contended, locks[i].wait_ns / 1e3, locks[i].max_hold_ns / 1e3);
+  }
+  fflush(out);
+}
+
+/* Prints the bytes counted for each part of the proxy */
+static void stats_report_memory(FILE *out) {
+  fprintf(out, "%-14s %12s\n", "memory", "bytes");
+  for (int t = 0; t < MEM_TAGS; t++) {
+    fprintf(out, "%-14s %12ld\n", mem_names[t], memacct_bytes(t));
+  }
+  fflush(out);
+}
+
+void stats_prometheus(FILE *out, int queued, int workers) {
+  static const double quantiles[] = { 0.5, 0.99, 0.999 };
+  uint64_t requests[METHOD_COUNT][STATUS_CLASSES] = {{ 0 }};
+  uint64_t bytes_in = 0, bytes_out = 0, hits = 0, misses = 0, connect_errors = 0;
+  int busy = 0;
+  hist_t *phase = calloc(PHASE_COUNT, sizeof(hist_t)); 	// Too large for a worker's stack
+  cache_stats_t cache;
+  lock_stats_t locks[LOCK_MAX_NAMES];
+  int nlocks;
+
+  for (stats_thread_t *st = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); st; st = st->next) {
+    for (int m = 0; m < METHOD_COUNT; m++) {
+      for (int c = 0; c < STATUS_CLASSES; c++) {
+        requests[m][c] += stats_load(&st->requests[m][c]);
+      }
+    }
+    bytes_in += stats_load(&st->bytes_in);
+    bytes_out += stats_load(&st->bytes_out);
+    hits += stats_load(&st->cache_hits);
+    misses += stats_load(&st->cache_misses);
+    connect_errors += stats_load(&st->connect_errors);
+    busy += __atomic_load_n(&st->busy, __ATOMIC_RELAXED);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      hist_merge(&phase[p], &st->phase[p]);
+    }
+  }
+  cache_stats(&cache);
+  nlocks = lock_stats(locks, LOCK_MAX_NAMES);
+
+  fprintf(out, "# TYPE proxy_requests_total counter\n");
+  for (int m = 0; m < METHOD_COUNT; m++) {
+    for (int c = 0; c < STATUS_CLASSES; c++) {
+      if (requests[m][c]) {
+        fprintf(out, "proxy_requests_total{method=\"%s\",code=\"%s\"} %lu\n", method_names[m], class_names[c],
+                (unsigned long) requests[m][c]);
+      }
+    }
+  }
+  fprintf(out, "# TYPE proxy_received_bytes_total counter\nproxy_received_bytes_total %lu\n", (unsigned long) bytes_in);
+  fprintf(out, "# TYPE proxy_sent_bytes_total counter\nproxy_sent_bytes_total %lu\n", (unsigned long) bytes_out);
+  fprintf(out, "# TYPE proxy_cache_hits_total counter\nproxy_cache_hits_total %lu\n", (unsigned long) hits);
+  fprintf(out, "# TYPE proxy_cache_misses_total counter\nproxy_cache_misses_total %lu\n", (unsigned long) misses);
+  fprintf(out, "# TYPE proxy_cache_evictions_total counter\nproxy_cache_evictions_total %lu\n", cache.evictions);
+  fprintf(out, "# TYPE proxy_cache_objects gauge\nproxy_cache_objects %zu\n", cache.objects);
+  fprintf(out, "# TYPE proxy_cache_bytes gauge\nproxy_cache_bytes %zu\n", cache.bytes);
+  fprintf(out, "# TYPE proxy_cache_max_bytes gauge\nproxy_cache_max_bytes %zu\n", cache.max_bytes);
+  fprintf(out, "# TYPE proxy_queued_connections gauge\nproxy_queued_connections %d\n", queued);
+  fprintf(out, "# TYPE proxy_workers gauge\nproxy_workers %d\n", workers);
+  fprintf(out, "# TYPE proxy_busy_workers gauge\nproxy_busy_workers %d\n", busy);
+  fprintf(out, "# TYPE proxy_upstream_connect_errors_total counter\nproxy_upstream_connect_errors_total %lu\n",
+          (unsigned long) connect_errors);
+  fprintf(out, "# TYPE proxy_access_log_dropped_total counter\nproxy_access_log_dropped_total %lu\n",
+          (unsigned long) accesslog_dropped());
+
+  fprintf(out, "# TYPE proxy_lock_acquisitions_total counter\n");
+  for (int i = 0; i < nlocks; i++) {
+    fprintf(out, "proxy_lock_acquisitions_total{lock=\"%s\"} %lu\n", locks[i].name, (unsigned long) locks[i].acquisitions);
+  }
+  fprintf(out, "# TYPE proxy_lock_contended_total counter\n");
+  for (int i = 0; i < nlocks; i++) {
+    fprintf(out, "proxy_lock_contended_total{lock=\"%s\"} %lu\n", locks[i].name, (unsigned long) locks[i].contended);
+  }
+  fprintf(out, "# TYPE proxy_lock_wait_seconds_total counter\n");
+  for (int i = 0; i < nlocks; i++) {
+    fprintf(out, "proxy_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", locks[i].name, locks[i].wait_ns / 1e9);
+  }
+  fprintf(out, "# TYPE proxy_lock_max_hold_seconds gauge\n");
+  for (int i = 0; i < nlocks; i++) {
+    fprintf(out, "proxy_lock_max_hold_seconds{lock=\"%s\"} %.9f\n", locks[i].name, locks[i].max_hold_ns / 1e9);
+  }
+
+  fprintf(out, "# TYPE proxy_memory_bytes gauge\n");
+  for (int t = 0; t < MEM_TAGS; t++) {
+    fprintf(out, "proxy_memory_bytes{subsystem=\"%s\"} %ld\n", mem_names[t], memacct_bytes(t));
+  }
+
+  fprintf(out, "# TYPE proxy_phase_seconds summary\n");
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    for (int q = 0; q < 3; q++) {
+      fprintf(out, "proxy_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n", phase_names[p], quantiles[q],
+              hist_quantile(&phase[p], quantiles[q]) / 1e9);
+    }
+    fprintf(out, "proxy_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[p], phase[p].sum / 1e9);
+    fprintf(out, "proxy_phase_seconds_count{phase=\"%s\"} %lu\n", phase_names[p], (unsigned long) phase[p].count);
+  }
+  free(phase);
+  topk_prometheus(out);
+}
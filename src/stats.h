@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+#include <hist.h>
+
+#define STATS_MERGE_INTERVAL 1 	// Seconds between two merges of the threads' histograms
+#define STATS_HOST "proxy.local" 	// GET http://STATS_HOST/STATS_PATH is answered by the proxy itself
+#define STATS_PATH "/__stats"
+
+/* Methods and status classes requests are counted by */
+enum { METHOD_GET, METHOD_POST, METHOD_OTHER, METHOD_COUNT };
+#define STATUS_CLASSES 6 		// By status / 100, 0 for requests that got no response
+
+/* Phases of a request whose latency is recorded */
+enum {
+  PHASE_QUEUE, 			// Accepted connection waiting in sbuf for a worker
+  PHASE_PARSE, 			// Request line and headers, from their first byte
+  PHASE_CACHE, 			// Cache lookup, including writing out a hit
+  PHASE_CONNECT, 		// Opening a new upstream connection (open_clientfd)
+  PHASE_TTFB, 			// Request sent to the server until its status line
+  PHASE_BODY, 			// End of the response headers until the end of its body
+  PHASE_TOTAL, 			// First byte of the request until the end of the response
+  PHASE_COUNT
+};
+
+/* What one thread records, only ever written by that thread so recording takes no lock and no atomic
+ * read-modify-write. The merge thread reads it as it goes.
+ */
+typedef struct stats_thread {
+  hist_t phase[PHASE_COUNT]; 	// Latencies in ns
+  uint64_t requests[METHOD_COUNT][STATUS_CLASSES];
+  uint64_t bytes_in; 		// From clients: request heads and bodies
+  uint64_t bytes_out; 		// To clients
+  uint64_t cache_hits, cache_misses;
+  uint64_t connect_errors; 	// Upstream connections that could not be opened
+  int busy; 			// Set while the thread serves a connection
+  struct stats_thread *next; 	// In the list of all threads' stats
+} stats_thread_t;
+
+/* Starts the thread merging every thread's stats each STATS_MERGE_INTERVAL seconds. If report_secs is
+ * not 0 it also prints the report to stderr that often, when there were new requests. SIGUSR1 makes it
+ * print the report and the lock counters, the signal must be blocked in all threads before this is called.
+ */
+void stats_init(int report_secs);
+
+/* Gives the calling thread its own stats, to be passed to the recording functions */
+stats_thread_t *stats_register(void);
+
+/* Prints the count and p50/p99/p999/max latencies of each phase as of the last merge */
+void stats_report(FILE *out);
+
+/* Prints every counter in the Prometheus text format, summed over the threads now. The gauges of the
+ * connection queue are given by the caller, which owns it.
+ */
+void stats_prometheus(FILE *out, int queued, int workers);
+
+/* Monotonic clock in ns */
+static inline long long stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Adds n to a counter of the calling thread's stats. A single writer needs no atomic read-modify-write,
+ * only a store readers never see half of.
+ */
+static inline void stats_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Records that phase took ns */
+static inline void stats_phase(stats_thread_t *st, int phase, long long ns) {
+  hist_record(&st->phase[phase], ns > 0 ? ns : 0);
+}
@@ -0,0 +1,100 @@
+#include <csapp.h>
+#include <lock.h>
+#include <memacct.h>
+#include "proxy.h"
+#include "topk.h"
+
+/* What each sketch counts */
+enum { TOPK_URI_REQUESTS, TOPK_URI_BYTES, TOPK_ORIGIN_REQUESTS, TOPK_ORIGIN_BYTES, TOPK_SKETCHES };
+
+static const char *topk_metrics[TOPK_SKETCHES] = {
+  "proxy_top_uri_requests", "proxy_top_uri_bytes", "proxy_top_origin_requests", "proxy_top_origin_bytes",
+};
+static const char *topk_labels[TOPK_SKETCHES] = { "uri", "uri", "origin", "origin" };
+
+static sketch_t sketches[TOPK_SKETCHES];
+static lock_t topk_lock;
+
+/* Prototype functions */
+static void topk_copy(char*, const char*, size_t);
+static void topk_label(FILE*, const char*);
+
+/* Copies n bytes of s as a name, cut to fit */
+static void topk_copy(char *dst, const char *s, size_t n) {
+  if (n > SKETCH_KEY_MAX - 1) {
+    n = SKETCH_KEY_MAX - 1;
+  }
+  memcpy(dst, s, n);
+  dst[n] = '\0';
+}
+
+/* Prints s as a label value, escaped */
+static void topk_label(FILE *out, const char *s) {
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*s == '\n' ? ' ' : *s, out);
+  }
+}
+
+void topk_init(void) {
+  lock_init(&topk_lock, "topk");
+  for (int i = 0; i < TOPK_SKETCHES; i++) {
+    sketch_init(&sketches[i], TOPK_WIDTH, TOPK_DEPTH);
+    memacct_add(MEM_STATS, TOPK_WIDTH * TOPK_DEPTH * sizeof(uint64_t));
+  }
+}
+
+void topk_record(topk_batch_t *batch, const http_key_t *key, size_t bytes) {
+  topk_sample_t *s = &batch->samples[batch->n++];
+  // The key is http://host[:port]/path, its origin is what is before the path
+  const char *host = key->str + 7, *path = strchr(host, '/');
+  size_t origin_len = path ? (size_t) (path - host) : strlen(host);
+
+  s->uri_hash = key->hash;
+  s->origin_hash = http_hash64(host, origin_len);
+  s->bytes = bytes;
+  topk_copy(s->uri, key->str, key->len);
+  topk_copy(s->origin, host, origin_len);
+  if (batch->n == TOPK_BATCH) {
+    topk_flush(batch);
+  }
+}
+
+void topk_flush(topk_batch_t *batch) {
+  if (batch->n == 0) {
+    return;
+  }
+  lock_acquire(&topk_lock);
+  for (int i = 0; i < batch->n; i++) {
+    topk_sample_t *s = &batch->samples[i];
+    sketch_add(&sketches[TOPK_URI_REQUESTS], s->uri_hash, s->uri, 1);
+    sketch_add(&sketches[TOPK_URI_BYTES], s->uri_hash, s->uri, s->bytes);
+    sketch_add(&sketches[TOPK_ORIGIN_REQUESTS], s->origin_hash, s->origin, 1);
+    sketch_add(&sketches[TOPK_ORIGIN_BYTES], s->origin_hash, s->origin, s->bytes);
+  }
+  lock_release(&topk_lock);
+  batch->n = 0;
+}
+
+void topk_prometheus(FILE *out) {
+  sketch_top_t top[TOPK_SKETCHES][SKETCH_TOP];
+  int n[TOPK_SKETCHES];
+
+  // Copied under the lock, printed without it
+  lock_acquire(&topk_lock);
+  for (int i = 0; i < TOPK_SKETCHES; i++) {
+    n[i] = sketch_top(&sketches[i], top[i]);
+  }
+  lock_release(&topk_lock);
+
+  for (int i = 0; i < TOPK_SKETCHES; i++) {
+    fprintf(out, "# TYPE %s gauge\n", topk_metrics[i]);
+    for (int j = 0; j < n[i]; j++) {
+      fprintf(out, "%s{rank=\"%d\",%s=\"", topk_metrics[i], j + 1, topk_labels[i]);
+      topk_label(out, top[i][j].key);
+      fprintf(out, "\"} %lu\n", (unsigned long) top[i][j].count);
+    }
+  }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+#include <sketch.h>
+#include "http.h"
+
+#define TOPK_BATCH 32 		// Requests a worker notes before adding them to the sketches in one go
+#define TOPK_WIDTH 4096 	// Counters per sketch row
+#define TOPK_DEPTH 4 		// Rows of each sketch
+
+/* A request as the sketches see it */
+typedef struct {
+  uint64_t uri_hash; 		// The request's key hash, not computed again
+  uint64_t origin_hash;
+  size_t bytes; 		// Sent to the client
+  char uri[SKETCH_KEY_MAX];
+  char origin[SKETCH_KEY_MAX];
+} topk_sample_t;
+
+/* Requests noted by one worker, only the worker touches it */
+typedef struct {
+  topk_sample_t samples[TOPK_BATCH];
+  int n;
+} topk_batch_t;
+
+/* Heaviest uris and origins (host[:port]) by requests and by bytes, estimated by count-min sketches shared
+ * by all workers. Workers add their requests a batch at a time so the sketches' lock is taken once every
+ * TOPK_BATCH requests, the last few requests of each worker only show once its batch is added.
+ */
+
+/* Initialize the sketches, must be called once before any worker thread starts */
+void topk_init(void);
+
+/* Notes a request for key that sent bytes to the client, adding the batch to the sketches when it is full */
+void topk_record(topk_batch_t *batch, const http_key_t *key, size_t bytes);
+
+/* Adds what is in the batch to the sketches now */
+void topk_flush(topk_batch_t *batch);
+
+/* Prints the heaviest keys of each sketch in the Prometheus text format */
+void topk_prometheus(FILE *out);
@@ -0,0 +1,142 @@
+#include <csapp.h>
+#include <lock.h>
+#include "wheel.h"
+
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/* Slots are circular lists with a sentinel, level 0 holds the timers of the next WHEEL_SLOTS ticks,
+ * each next level covers WHEEL_SLOTS times more and is cascaded down when level 0 wraps around.
+ */
+static struct {
+  lock_t lock; 				// Taken to arm and cancel each deadline, reported as "wheel"
+  uint64_t now; 			// Next tick to be processed
+  wtimer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel;
+
+/* Current tick on the monotonic clock */
+static uint64_t wheel_ticks(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / WHEEL_TICK_MS;
+}
+
+static void wheel_unlink(wtimer_t *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+  t->armed = 0;
+}
+
+/* Puts t in the slot of the lowest level whose range includes its expiry. Wheel must be locked. */
+static void wheel_link(wtimer_t *t) {
+  uint64_t delta = t->expires > wheel.now ? t->expires - wheel.now : 0;
+  uint64_t when = t->expires > wheel.now ? t->expires : wheel.now;
+  int level = 0;
+  wtimer_t *head;
+
+  while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+  // Past the last level's range, park it in the furthest slot, it is re-placed when cascaded
+  if (delta >= ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+    when = wheel.now + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  }
+  head = &wheel.slots[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+  t->armed = 1;
+}
+
+/* Moves the timers of one slot of level down to the lower levels. Returns the slot index. */
+static int wheel_cascade(int level) {
+  int idx = (wheel.now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  wtimer_t *head = &wheel.slots[level][idx];
+  wtimer_t list = { .next = head->next, .prev = head->prev };
+
+  if (head->next == head) {
+    return idx;
+  }
+  // Detach the whole slot then re-add each timer
+  list.next->prev = &list;
+  list.prev->next = &list;
+  head->next = head->prev = head;
+  while (list.next != &list) {
+    wtimer_t *t = list.next;
+    wheel_unlink(t);
+    wheel_link(t);
+  }
+  return idx;
+}
+
+/* Fires the timers due up to the current tick */
+static void wheel_advance(uint64_t target) {
+  while (wheel.now <= target) {
+    int idx = wheel.now & WHEEL_MASK;
+    wtimer_t *head = &wheel.slots[0][idx];
+
+    // Level 0 wrapped around: bring down the next slot of each level above, as far as they wrap too
+    for (int level = 1; idx == 0 && level < WHEEL_LEVELS; level++) {
+      if (wheel_cascade(level) != 0) {
+        break;
+      }
+    }
+    while (head->next != head) {
+      wtimer_t *t = head->next;
+      wheel_unlink(t);
+      t->fn(t->arg);
+    }
+    wheel.now++;
+  }
+}
+
+static void *wheel_thread(void *vargp) {
+  struct timespec tick = { .tv_sec = 0, .tv_nsec = WHEEL_TICK_MS * 1000000L };
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    nanosleep(&tick, NULL);
+    lock_acquire(&wheel.lock);
+    wheel_advance(wheel_ticks());
+    lock_release(&wheel.lock);
+  }
+  return NULL;
+}
+
+void wheel_init(void) {
+  pthread_t tid;
+
+  lock_init(&wheel.lock, "wheel");
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+      wheel.slots[level][i].next = wheel.slots[level][i].prev = &wheel.slots[level][i];
+    }
+  }
+  wheel.now = wheel_ticks();
+  Pthread_create(&tid, NULL, wheel_thread, NULL);
+}
+
+void wheel_arm(wtimer_t *t, unsigned ms, void (*fn)(void*), void *arg) {
+  uint64_t now = wheel_ticks();
+
+  lock_acquire(&wheel.lock);
+  if (t->armed) {
+    wheel_unlink(t);
+  }
+  t->fn = fn;
+  t->arg = arg;
+  // Round up so a timer never fires early
+  t->expires = now + (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+  wheel_link(t);
+  lock_release(&wheel.lock);
+}
+
+void wheel_cancel(wtimer_t *t) {
+  lock_acquire(&wheel.lock);
+  if (t->armed) {
+    wheel_unlink(t);
+  }
+  lock_release(&wheel.lock);
+}
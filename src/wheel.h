@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#define WHEEL_TICK_MS 10 	// Resolution of the timers
+#define WHEEL_BITS 6 		// Each level has 1 << WHEEL_BITS slots
+#define WHEEL_LEVELS 4 		// 4 levels of 64 slots at 10ms cover about 46 hours
+
+/* A timer, meant to be embedded in the structure it guards. Zero it before its first use. */
+typedef struct wtimer {
+  struct wtimer *next, *prev; 	// Links in the wheel slot, only valid when armed
+  uint64_t expires; 		// Tick at which it fires
+  void (*fn)(void*); 		// Called by the wheel thread on expiry
+  void *arg;
+  int armed;
+} wtimer_t;
+
+/* Starts the thread that turns the hierarchical timer wheel, call once before arming any timer */
+void wheel_init(void);
+
+/* Arms t to call fn(arg) in ms milliseconds, replacing its previous deadline if it was armed. O(1).
+ * fn runs on the wheel thread with the wheel locked: it must be short and must not arm or cancel timers.
+ */
+void wheel_arm(wtimer_t *t, unsigned ms, void (*fn)(void*), void *arg);
+
+/* Disarms t if it is armed. O(1). Once this returns fn is not running and won't be called. */
+void wheel_cancel(wtimer_t *t);